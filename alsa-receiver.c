@@ -1,9 +1,11 @@
 #include "common.h"
 
-#define __USE_BSD
-#define __USE_POSIX199309
-#define __USE_MISC
-#define _POSIX_C_SOURCE
+#define __USE_BSD 1
+#define __USE_POSIX199309 1
+#define __USE_MISC 1
+#define _POSIX_C_SOURCE 199506L
+#define __USE_POSIX2 1
+#define __USE_XOPEN2K 1
 
 #include <stdio.h>
 #include <time.h>
@@ -15,45 +17,65 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <alloca.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <alsa/asoundlib.h>
 
+#include "format.h"
+#include "mixer.h"
+#include "receiver.h"
+#include "rtthread.h"
+#include "transport.h"
+
 #define MIN_WRITE_SIZE 200
+#define MAX_POLL_FDS 16
+#define RESUME_RETRY_MS 10 // between attempts to resume a suspended device
 #define IGN(x) __##x __attribute__((unused))
 
 snd_pcm_t *handle;
 snd_pcm_hw_params_t *hwparams;
 snd_pcm_sw_params_t *swparams;
-snd_pcm_channel_area_t *areas;
+const snd_pcm_channel_area_t *areas;
 snd_output_t *output = NULL;
 unsigned int periodSize;
+char *periodBuffer;
+int periodPending = 0; // periodBuffer has been rendered but not yet written
+int useMmap = 0; // render straight into the device's ring buffer
+
+pthread_t audioThread;
+atomic_int audioRunning;
+atomic_ulong xruns;     // reported by the main loop, the audio thread may not print
+atomic_int lastXrun;
+unsigned long xrunsReported = 0;
+int suspended = 0;      // waiting for snd_pcm_resume, see resumeDevice
+atomic_int deviceFailed; // the audio thread gave up, the main loop exits
 
 char *alsaDevice = "hw:0,0";
 
 int running;
-float sampleRate = 44000;
-float localPositionAvg;
-float localPositionBlend = 0.0002;
-int32_t samplesTooMuch = 0;
-uint64_t maximumDrift = 4;
 
 double targetLatency = 0.05;  // in s
-uint64_t senderOffset; // incoming packet offset which would start at audioBuffer[0]
-char audioBuffer[32000];
-
-char receiveBuffer[8000];
-uint64_t receivePos = 0;
-int debugRate = 256;
-int debugCounter = 0;
-
-int beepOnFailure = 0;
+receiver rx;
+int mixing;
+mixer mix;
+
+static snd_pcm_format_t alsaFormat(int format) {
+  switch(format) {
+    case SAMPLE_S24LE: return SND_PCM_FORMAT_S24_3LE;
+    case SAMPLE_FLOAT32LE: return SND_PCM_FORMAT_FLOAT_LE;
+    default: return SND_PCM_FORMAT_S16_LE;
+  }
+}
 
 static int set_hwparams(snd_pcm_t *handle,
             snd_pcm_hw_params_t *params,
             snd_pcm_access_t access)
 {
-    unsigned int channels = 2;
-    unsigned int rate = 44100;
-    unsigned int format = SND_PCM_FORMAT_S16_LE;
+    unsigned int channels = rx.format.channels;
+    unsigned int rate = rx.format.rate;
+    snd_pcm_format_t format = alsaFormat(rx.format.format);
     unsigned int resample = 0;
 
     snd_pcm_uframes_t size;
@@ -168,187 +190,350 @@ static int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams)
     }
     return 0;
 }
+// reports an unrecoverable device error; the audio thread cannot exit the
+// process itself, it stops and leaves that to the main loop
+static void fail(const char *message, int err) {
+    receiverReportDevice(&rx, message, err, err < 0? snd_strerror: NULL);
+    if(!rx.threaded) exit(EXIT_FAILURE);
+
+    atomic_store(&deviceFailed, 1);
+    atomic_store(&audioRunning, 0);
+}
+
+// one attempt at resuming a suspended device, returns -1 while it still is;
+// writeAudio retries on every wakeup instead of sleeping on the audio thread
+static int resumeDevice()
+{
+    int err = snd_pcm_resume(handle);
+    if (err == -EAGAIN)
+        return -1;
+
+    suspended = 0;
+    if (err < 0) {
+        err = snd_pcm_prepare(handle);
+        if (err < 0)
+            receiverReportDevice(&rx, "Can't recovery from suspend, prepare failed", err, snd_strerror);
+    }
+    return 0;
+}
+
 /*
  *   Underrun and suspend recovery
  */
  
 static int xrun_recovery(snd_pcm_t *handle, int err)
 {
-    printf("stream recovery\n");
+    atomic_store(&lastXrun, err);
+    atomic_fetch_add(&xruns, 1);
     if (err == -EPIPE) {    /* under-run */
         err = snd_pcm_prepare(handle);
         if (err < 0)
-            printf("Can't recovery from underrun, prepare failed: %s\n", snd_strerror(err));
+            receiverReportDevice(&rx, "Can't recovery from underrun, prepare failed", err, snd_strerror);
         return 0;
     } else if (err == -ESTRPIPE) {
-        while ((err = snd_pcm_resume(handle)) == -EAGAIN)
-            sleep(1);   /* wait until the suspend flag is released */
-        if (err < 0) {
-            err = snd_pcm_prepare(handle);
-            if (err < 0)
-                printf("Can't recovery from suspend, prepare failed: %s\n", snd_strerror(err));
-        }
+        suspended = 1;
+        resumeDevice();
         return 0;
     }
     return err;
 }
-// drop-in replacement for bzero on audioBuffer
-void failureSound(char *bufferPos, size_t len) {
-  char reference;
-  if(bufferPos == audioBuffer) {
-    reference = bufferPos[0];
-  } else {
-    reference = bufferPos[-1];
-  }
+// for group playout: how long until a frame written now, after extra
+// frames not yet committed, gets heard
+void reportDelay(snd_pcm_sframes_t extra) {
+  snd_pcm_sframes_t delay;
+  if(snd_pcm_delay(handle, &delay) < 0) return;
+
+  if(delay < 0) delay = 0;
+  receiverSetOutputDelay(&rx, (uint64_t)(delay + extra) * 1000000000 / rx.format.rate);
+  if(mixing) mixerSetOutputDelay(&mix, rx.outputDelay);
+}
 
-  if(!beepOnFailure) {
-    for(size_t i = 0; i < len; ++i) {
-      bufferPos[i] = reference;
-    }
-  } else if(reference > 0) {
-    for(size_t i = 0; i < len; ++i) {
-      bufferPos[i] = reference - (i % 4? 0: 4);
-    }
+void render(char *out, size_t len) {
+  if(mixing) {
+    mixerRender(&mix, out, len);
   } else {
-    for(size_t i = 0; i < len; ++i) {
-      bufferPos[i] = reference + (i % 4? 0: 4);
-    }
+    receiverRender(&rx, out, len);
   }
 }
 
-int frameAlign(float f) {
-  return ((int)f) / 4 * 4;
+// the mixer reads all senders on the socket itself
+int receive(int fd) {
+  if(!mixing) return receiveInput(&rx, fd);
+
+  mixerReceive(&mix, fd);
+  return 1;
 }
 
-void receiveInput() {
-  while(1) {
-    int len = read(0, receiveBuffer + receivePos, sizeof(receiveBuffer) - receivePos);
-    if(len < 0) {
-      if(errno == EAGAIN || errno == EWOULDBLOCK) return;
+void writeAudioCopy() {
+  if(!periodPending) {
+    if(rx.group) reportDelay(0);
+    render(periodBuffer, periodSize * rx.frameBytes);
+    periodPending = 1;
+  }
+
+  int err = snd_pcm_writei(handle, periodBuffer, periodSize);
+  if(err == -EAGAIN) return;
+  if(err < 0) {
+      if(xrun_recovery(handle, err) < 0) fail("Write error", err);
+      return;
+  }
+
+  periodPending = 0;
+}
 
-      fprintf(stderr, "Failed to receive packet: %s\n", strerror(errno));
+// renders straight into the mmapped device ring buffer, so audio leaves the
+// playout buffer through the resampler without any intermediate copy
+void writeAudioMmap() {
+  snd_pcm_sframes_t avail = snd_pcm_avail_update(handle);
+  if(avail < 0) {
+      if(xrun_recovery(handle, avail) < 0) fail("Avail update error", avail);
       return;
-    } else if(len == 0) {
-      running = 0;
-    } else {
-      receivePos += len;
+  }
+
+  snd_pcm_sframes_t rendered = 0;
+  while((snd_pcm_uframes_t)avail >= periodSize) {
+    snd_pcm_uframes_t offset, frames = periodSize;
+    int err = snd_pcm_mmap_begin(handle, &areas, &offset, &frames);
+    if(err < 0) {
+        if(xrun_recovery(handle, err) < 0) fail("MMAP begin error", err);
+        return;
+    }
+
+    // interleaved access, so the first area describes the whole frame
+    if(areas[0].first % 8 || areas[0].step != rx.frameBytes * 8) {
+        fail("Device ring buffer is not interleaved as requested, step", areas[0].step);
+        return;
     }
 
-    dataPacket *packet = (dataPacket *)receiveBuffer;
-    if(receivePos < sizeof(packet->length) || receivePos < packet->length) continue;
+    char *ring = (char *)areas[0].addr + areas[0].first / 8 + offset * rx.frameBytes;
+    if(rx.group) reportDelay(rendered);
+    render(ring, frames * rx.frameBytes);
 
-    struct timespec t;
-    if(clock_gettime(CLOCK_REALTIME, &t)) {
-      fprintf(stderr, "Failed to get current time: %s\n", strerror(errno));
+    snd_pcm_sframes_t committed = snd_pcm_mmap_commit(handle, offset, frames);
+    if(committed < 0 || (snd_pcm_uframes_t)committed != frames) {
+        if(xrun_recovery(handle, committed >= 0? -EPIPE: committed) < 0) fail("MMAP commit error", committed);
+        return;
     }
 
-    uint64_t now = (uint64_t)(t.tv_sec) * 1000000000 + t.tv_nsec;
-    double packetToPlayIn = (packet->time + targetLatency * 1000000000 - now) / 1000000000;
+    avail -= frames;
+    rendered += frames;
+  }
 
-    int dataLen = packet->length - sizeof(*packet) + sizeof(packet->data);
-    int64_t localPosition = packet->position - senderOffset;
-    int64_t desiredLocalPosition = 4 * sampleRate * targetLatency;
+  // unlike writei, commits do not start playback on their own
+  if(snd_pcm_state(handle) == SND_PCM_STATE_PREPARED) {
+    int err = snd_pcm_start(handle);
+    if(err < 0) fail("Start error", err);
+  }
+}
 
-    if(packetToPlayIn < 0) {
-      fprintf(stderr, "Packet arrived too late.\n");
-    } else if(localPosition < 0) {
-      fprintf(stderr, "Playback is too far ahead.\n");
+void writeAudio() {
+  if(suspended && resumeDevice()) return;
 
-      failureSound(audioBuffer, sizeof(audioBuffer));
-      senderOffset = packet->position - frameAlign(desiredLocalPosition);
-      localPositionAvg = localPosition = packet->position - senderOffset;
-    } else if(localPosition + dataLen > (int)sizeof(audioBuffer)) {
-      fprintf(stderr, "Playback is too far behind.\n");
+  if(useMmap) {
+    writeAudioMmap();
+  } else {
+    writeAudioCopy();
+  }
+}
 
-      failureSound(audioBuffer, sizeof(audioBuffer));
-      senderOffset = packet->position - frameAlign(desiredLocalPosition);
-      localPositionAvg = localPosition = packet->position - senderOffset;
-    } else {
-      memcpy(audioBuffer + localPosition, packet->data, dataLen);
+// opens the device in the receiver's current format
+int openDevice() {
+  int err;
 
-      localPositionAvg = (1 - localPositionBlend) * localPositionAvg + localPositionBlend * localPosition;
-    }
+  if ((err = snd_pcm_open(&handle, alsaDevice, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
+      fprintf(stderr, "Playback open error: %s\n", snd_strerror(err));
+      return -1;
+  }
 
-    if(++debugCounter > debugRate) {
-      fprintf(stderr, "Packet for: +%lfs, buf pos: %lld, avg %f, delta %d\n", packetToPlayIn, (long long int)localPosition, localPositionAvg, samplesTooMuch);
-      debugCounter = 0;
-    }
+  if ((err = set_hwparams(handle, hwparams, useMmap? SND_PCM_ACCESS_MMAP_INTERLEAVED: SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
+      printf("Setting of hwparams failed: %s\n", snd_strerror(err));
+      return -1;
+  }
+  if ((err = set_swparams(handle, swparams)) < 0) {
+      printf("Setting of swparams failed: %s\n", snd_strerror(err));
+      return -1;
+  }
 
-    uint64_t shift = packet->length;
-    memmove(receiveBuffer, receiveBuffer + shift, receivePos - shift);
-    receivePos -= shift;
+  if(useMmap) return 0;
 
-    if(localPositionAvg > desiredLocalPosition + maximumDrift) {
-      samplesTooMuch = frameAlign(localPositionAvg - desiredLocalPosition);
-      localPositionAvg = (0.1 * desiredLocalPosition + 0.9 * localPositionAvg);
-    } else if(localPositionAvg < desiredLocalPosition - maximumDrift) {
-      samplesTooMuch = frameAlign(localPositionAvg - desiredLocalPosition);
-      localPositionAvg = (0.1 * desiredLocalPosition + 0.9 * localPositionAvg);
-    }
+  free(periodBuffer);
+  periodBuffer = malloc(periodSize * rx.frameBytes);
+  if(!periodBuffer) {
+    fprintf(stderr, "Failed to allocate period buffer.\n");
+    return -1;
   }
+  periodPending = 0;
+
+  return 0;
 }
 
-void writeAudio() {
-  int requested = periodSize * 4;
+void reportXruns() {
+  unsigned long count = atomic_load(&xruns);
+  if(count == xrunsReported) return;
 
-  int err = snd_pcm_writei(handle, audioBuffer, periodSize);
-  if(err == -EAGAIN) return;
-  if(err < 0) {
-      fprintf(stderr, "Err: %s\n", snd_strerror(err));
-      if(xrun_recovery(handle, err) < 0) {
-          printf("Write error: %s\n", snd_strerror(err));
-          exit(EXIT_FAILURE);
+  metricsStore(&rx.metrics->xruns, count);
+
+  fprintf(stderr, "Err: %s\n", snd_strerror(atomic_load(&lastXrun)));
+  fprintf(stderr, "stream recovery%s\n", count - xrunsReported > 1? ", repeatedly": "");
+  xrunsReported = count;
+}
+
+// Audio thread of the split mode: waits for the device and renders, the
+// receiver hands it packets through a queue. Blocking writei paces the
+// copying mode by itself. It never prints, see fail and receiverReportDevice.
+void *audioLoop(void *IGN(arg)) {
+  while(atomic_load_explicit(&audioRunning, memory_order_relaxed)) {
+    if(suspended) {
+      // neither writei nor the device's descriptors block while suspended
+      poll(NULL, 0, RESUME_RETRY_MS);
+    } else if(useMmap) {
+      int err = snd_pcm_wait(handle, 100);
+      if(err < 0 && xrun_recovery(handle, err) < 0) {
+        fail("Wait error", err);
+        break;
       }
-      return;
-  }
+    }
 
-  if(samplesTooMuch > 1) {
-    requested += samplesTooMuch;
-    samplesTooMuch = 0;
-  } else if(samplesTooMuch < -1) {
-    requested += samplesTooMuch;
-    samplesTooMuch = 0;
+    writeAudio();
   }
 
-  if(requested < 0) requested = 0;
-  if(requested > (int)sizeof(audioBuffer) / 4) requested = sizeof(audioBuffer) / 4;
+  return NULL;
+}
+
+int startAudio() {
+  atomic_store(&audioRunning, 1);
+  return startRealtimeThread(&audioThread, audioLoop, NULL);
+}
+
+void stopAudio() {
+  atomic_store(&audioRunning, 0);
+  pthread_join(audioThread, NULL);
+}
+
+// reopens the device once the receiver adopted a new stream format,
+// returns 1 if it did
+int followFormat() {
+  if(!rx.formatChanged) return 0;
+
+  if(rx.threaded) stopAudio();
 
-  memmove(audioBuffer, audioBuffer + requested, sizeof(audioBuffer) - requested);
-  failureSound(audioBuffer + sizeof(audioBuffer) - requested, requested);
-  senderOffset += requested;
+  if(receiverFollowFormat(&rx)) {
+    snd_pcm_close(handle);
+    if(openDevice()) exit(EXIT_FAILURE);
+  }
+
+  if(rx.threaded && startAudio()) exit(EXIT_FAILURE);
+  return 1;
 }
 
 int main(int argc, char **argv) {
   int err;
+  int reportWakeups = 0;
+  char *listenAddress = NULL;
+  int busyPoll = 0;
+  int threaded = 0;
+  audioFormat format = defaultFormat;
+  int fixedFormat = 0;
+  lossSimulator loss;
+  int adaptive = 0;
+  char *metricsName = NULL;
+  char *tracePath = NULL;
+  int verbose = 0;
+  double latencyPercentile = 0.99, latencyMargin = 0.01;
+  int group = 0;
+  int opt;
+
+  lossInit(&loss);
+  mixerInit(&mix, &rx);
+
+  while((opt = getopt(argc, argv, "wbtu:f:d:ml:a:M:vT:gxX:")) != -1) {
+    switch(opt) {
+      case 't': threaded = 1; break;
+      case 'l':
+        if(lossParse(&loss, optarg)) return 1;
+        break;
+      case 'M': metricsName = optarg; break;
+      case 'T': tracePath = optarg; break;
+      case 'v': verbose = 1; break;
+      case 'a':
+        if(parseJitterTarget(optarg, &latencyPercentile, &latencyMargin)) return 1;
+        adaptive = 1;
+        break;
+      case 'd': alsaDevice = optarg; break;
+      case 'm': useMmap = 1; break;
+      case 'f':
+        if(parseFormat(optarg, &format)) return 1;
+        fixedFormat = 1;
+        break;
+      case 'w': reportWakeups = 1; break;
+      case 'b': busyPoll = 1; break;
+      case 'u': listenAddress = optarg; break;
+      case 'g': group = 1; break;
+      case 'x': mixing = 1; break;
+      case 'X':
+        if(mixerParseGain(&mix, optarg)) return 1;
+        break;
+      default:
+        fprintf(stderr, "Usage: ./alsa-receiver [-w] [-b] [-t] [-u [host:]port] [-f format] [-l loss] [-a percentile] [-M name] [-T file] [-v] [-d device] [-m] [-g] [-x] [-X id:dB] [target latency]\n");
+        fprintf(stderr, "  -w  report main loop wakeups per second\n");
+        fprintf(stderr, "  -b  busy-poll instead of waiting for events\n");
+        fprintf(stderr, "  -t  play from a separate real-time thread with memory locked\n");
+        fprintf(stderr, "  -u  receive UDP datagrams on the given port instead of reading stdin\n");
+        fprintf(stderr, "  -f  play only format[:channels[:rate]] instead of following the stream\n");
+        fprintf(stderr, "  -l  drop percent[:mean burst length] of incoming packets, to test loss handling\n");
+        fprintf(stderr, "  -a  adapt the target latency to percentile[:margin ms] of the arrival delay, e.g. 99:10,\n");
+        fprintf(stderr, "      the target latency given becomes the upper limit\n");
+        fprintf(stderr, "  -M  publish metrics in shared memory under this name, for receiver-stats\n");
+        fprintf(stderr, "  -T  record incoming packets with their arrival times to this file, for trace-replay\n");
+        fprintf(stderr, "  -v  print a status line every 256 packets\n");
+        fprintf(stderr, "  -d  ALSA device, e.g. null or a file plugin for testing, default hw:0,0\n");
+        fprintf(stderr, "  -m  write into the mmapped device buffer instead of using writei\n");
+        fprintf(stderr, "  -g  group playout: be heard in step with other receivers of the stream, needs -u\n");
+        fprintf(stderr, "  -x  mix every sender on the UDP port, each in the output format, needs -u,\n");
+        fprintf(stderr, "      -M publishes the sums and each stream's own metrics as name.0, name.1 and so on\n");
+        fprintf(stderr, "  -X  play stream id at this gain in dB when mixing, e.g. 2:-12, repeat it\n");
+        return 1;
+    }
+  }
 
-  if(argc != 2 && argc != 3) {
-    fprintf(stderr, "Usage: ./pulse-receiver [target latency]\n");
+  if(argc - optind != 1) {
+    fprintf(stderr, "Usage: ./alsa-receiver [-w] [-b] [-t] [-u [host:]port] [-f format] [-l loss] [-a percentile] [-M name] [-T file] [-v] [-d device] [-m] [-g] [-x] [-X id:dB] [target latency]\n");
     return 1;
   }
 
-  if(argc == 2) {
-    targetLatency = atof(argv[1]);
+  if(group && (!listenAddress || adaptive)) {
+    fprintf(stderr, "Group playout needs UDP input for a shared clock and a fixed target latency.\n");
+    return 1;
+  }
+
+  if(mixing && (!listenAddress || threaded || tracePath)) {
+    fprintf(stderr, "Mixing needs UDP input, runs on one thread and records no trace.\n");
+    return 1;
   }
+
+  targetLatency = atof(argv[optind]);
   fprintf(stderr, "Target latency: %f\n", targetLatency);
 
-  senderOffset = -1ull << 62;
+  if(receiverInit(&rx, &format, targetLatency)) {
+    fprintf(stderr, "Failed to allocate playout buffer.\n");
+    return 1;
+  }
+  rx.loss = loss;
+  rx.adaptive = adaptive;
+  rx.latencyPercentile = latencyPercentile;
+  rx.latencyMargin = latencyMargin;
+  if(verbose) rx.debugRate = 256;
+  if(metricsName) receiverPublishMetrics(&rx, metricsName);
+  if(mixing && metricsName) mixerPublishMetrics(&mix, metricsName);
+  if(tracePath && receiverRecord(&rx, tracePath)) return 1;
+  rx.fixedFormat = fixedFormat;
+  rx.reportWakeups = reportWakeups;
+  rx.group = group;
 
   snd_pcm_hw_params_alloca(&hwparams);
   snd_pcm_sw_params_alloca(&swparams);
 
-  if ((err = snd_pcm_open(&handle, alsaDevice, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
-      fprintf(stderr, "Playback open error: %s\n", snd_strerror(err));
-      return 1;
-  }
-
-  if ((err = set_hwparams(handle, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
-      printf("Setting of hwparams failed: %s\n", snd_strerror(err));
-      exit(EXIT_FAILURE);
-  }
-  if ((err = set_swparams(handle, swparams)) < 0) {
-      printf("Setting of swparams failed: %s\n", snd_strerror(err));
-      exit(EXIT_FAILURE);
-  }
+  if(openDevice()) exit(EXIT_FAILURE);
 
   err = snd_output_stdio_attach(&output, stdout, 0);
   if (err < 0) {
@@ -356,18 +541,111 @@ int main(int argc, char **argv) {
       return 0;
   }
   snd_pcm_dump(handle, output);
-  if(fcntl(0, F_SETFL, O_NONBLOCK)) {
-    fprintf(stderr, "Could not enable non-blocking mode for stdin: %s\n", strerror(errno));
+  int inputFd = 0;
+  if(listenAddress) {
+    inputFd = udpOpen(listenAddress, 1);
+    if(inputFd < 0) return 1;
+
+    rx.datagrams = 1;
+  }
+
+  if(fcntl(inputFd, F_SETFL, O_NONBLOCK)) {
+    fprintf(stderr, "Could not enable non-blocking mode for input: %s\n", strerror(errno));
     return 1;
   }
 
   running = 1;
 
-  while(running) {
-    writeAudio();
-    receiveInput();
+  if(threaded) {
+    if(receiverStartQueues(&rx)) {
+      fprintf(stderr, "Failed to allocate packet queues.\n");
+      return 1;
+    }
+    if(startAudio()) return 1;
+
+    // the network thread only waits for input, with a timeout to keep
+    // reporting what the audio thread has to say
+    struct pollfd input;
+    input.fd = inputFd;
+    input.events = POLLIN;
+
+    while(running) {
+      if(poll(&input, 1, 100) < 0) {
+        if(errno == EINTR) continue;
+
+        fprintf(stderr, "Could not wait for events: %s\n", strerror(errno));
+        return 1;
+      }
+      receiverWakeup(&rx);
+
+      if(input.revents) {
+        if(!receiveInput(&rx, inputFd)) running = 0;
+        followFormat();
+      }
+
+      receiverPrintEvents(&rx);
+      reportXruns();
+      if(atomic_load(&deviceFailed)) running = 0;
+    }
+
+    stopAudio();
+    receiverPrintEvents(&rx);
+    if(atomic_load(&deviceFailed)) return 1;
+  } else if(busyPoll) {
+    while(running) {
+      writeAudio();
+      if(!receive(inputFd)) running = 0;
+      followFormat();
+      receiverWakeup(&rx);
+      reportXruns();
+
+      usleep(1);
+    }
+  } else {
+    struct pollfd fds[1 + MAX_POLL_FDS];
+    fds[0].fd = inputFd;
+    fds[0].events = POLLIN;
+
+    int pcmFds = snd_pcm_poll_descriptors(handle, fds + 1, MAX_POLL_FDS);
+    if(pcmFds < 0) {
+      fprintf(stderr, "Could not get playback poll descriptors: %s\n", snd_strerror(pcmFds));
+      return 1;
+    }
+
+    while(running) {
+      // a suspended device is retried on a timer, its descriptors say nothing useful
+      if(poll(fds, suspended? 1: 1 + pcmFds, suspended? RESUME_RETRY_MS: -1) < 0) {
+        if(errno == EINTR) continue;
 
-    usleep(1);
+        fprintf(stderr, "Could not wait for events: %s\n", strerror(errno));
+        return 1;
+      }
+      receiverWakeup(&rx);
+
+      if(fds[0].revents) {
+        if(!receive(inputFd)) running = 0;
+
+        if(followFormat()) {
+          pcmFds = snd_pcm_poll_descriptors(handle, fds + 1, MAX_POLL_FDS);
+          if(pcmFds < 0) {
+            fprintf(stderr, "Could not get playback poll descriptors: %s\n", snd_strerror(pcmFds));
+            return 1;
+          }
+          continue;
+        }
+      }
+
+      if(suspended) {
+        writeAudio();
+        reportXruns();
+        continue;
+      }
+
+      unsigned short revents;
+      snd_pcm_poll_descriptors_revents(handle, fds + 1, pcmFds, &revents);
+      if(revents & (POLLOUT | POLLERR)) writeAudio();
+      reportXruns();
+    }
   }
 
   snd_pcm_close(handle);
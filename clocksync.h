@@ -0,0 +1,117 @@
+#ifndef H_594FD770_8BDC_46C1_888A_242520F6AAB2
+#define H_594FD770_8BDC_46C1_888A_242520F6AAB2
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define CLOCK_SYNC_SAMPLES 32
+#define CLOCK_SYNC_FAST_SAMPLES 8 // sent at a faster rate right after start
+#define CLOCK_SYNC_MAXIMUM_SKEW 0.0005
+
+static inline uint64_t realtimeNow() {
+  struct timespec t;
+  if(clock_gettime(CLOCK_REALTIME, &t)) {
+    fprintf(stderr, "Failed to get current time: %s\n", strerror(errno));
+  }
+
+  return (uint64_t)(t.tv_sec) * 1000000000 + t.tv_nsec;
+}
+
+// NTP-style offset and skew estimation between sender and receiver clocks.
+//
+// Every round trip yields an offset sample and the delay it was measured
+// with. Samples with a short delay suffered little queueing, so the offset
+// is anchored at the one with the shortest delay in the window, and the skew
+// is fitted over those whose delay is close to it.
+struct clockSync_t {
+  int samples;
+  int next;
+  uint64_t at[CLOCK_SYNC_SAMPLES];     // local receive time of the answer
+  int64_t offset[CLOCK_SYNC_SAMPLES];  // remote minus local clock, in ns
+  int64_t delay[CLOCK_SYNC_SAMPLES];   // round trip minus remote processing, in ns
+
+  uint64_t anchorTime;
+  int64_t anchorOffset;
+  double skew;
+
+  uint64_t lastRequest;
+  int requests;
+};
+
+typedef struct clockSync_t clockSync;
+
+static inline void clockSyncInit(clockSync *cs) {
+  memset(cs, 0, sizeof(*cs));
+}
+
+static inline int clockSyncValid(const clockSync *cs) {
+  return cs->samples > 0;
+}
+
+// whether it is time to send another request
+static inline int clockSyncDue(clockSync *cs, uint64_t now) {
+  uint64_t interval = cs->requests < CLOCK_SYNC_FAST_SAMPLES? 100000000: 1000000000;
+  if(now - cs->lastRequest < interval) return 0;
+
+  cs->lastRequest = now;
+  ++cs->requests;
+  return 1;
+}
+
+// t1: request sent (local), t2: request received (remote),
+// t3: answer sent (remote), t4: answer received (local)
+static inline void clockSyncSample(clockSync *cs, uint64_t t1, uint64_t t2, uint64_t t3, uint64_t t4) {
+  int64_t delay = (int64_t)(t4 - t1) - (int64_t)(t3 - t2);
+  if(delay < 0) return;
+
+  int i = cs->next;
+  cs->at[i] = t4;
+  cs->offset[i] = ((int64_t)(t2 - t1) + (int64_t)(t3 - t4)) / 2;
+  cs->delay[i] = delay;
+  cs->next = (i + 1) % CLOCK_SYNC_SAMPLES;
+  if(cs->samples < CLOCK_SYNC_SAMPLES) ++cs->samples;
+
+  int best = 0;
+  for(int j = 1; j < cs->samples; ++j) {
+    if(cs->delay[j] < cs->delay[best]) best = j;
+  }
+
+  cs->anchorTime = cs->at[best];
+  cs->anchorOffset = cs->offset[best];
+
+  // least squares slope over the low-delay samples, relative to the anchor
+  int64_t limit = 2 * cs->delay[best] + 100000;
+  double sumX = 0, sumY = 0, sumXX = 0, sumXY = 0;
+  int n = 0;
+
+  for(int j = 0; j < cs->samples; ++j) {
+    if(cs->delay[j] > limit) continue;
+
+    double x = (double)(int64_t)(cs->at[j] - cs->anchorTime);
+    double y = (double)(cs->offset[j] - cs->anchorOffset);
+    sumX += x;
+    sumY += y;
+    sumXX += x * x;
+    sumXY += x * y;
+    ++n;
+  }
+
+  double denominator = n * sumXX - sumX * sumX;
+  if(n < 4 || denominator <= 0) return;
+
+  cs->skew = (n * sumXY - sumX * sumY) / denominator;
+  if(cs->skew > CLOCK_SYNC_MAXIMUM_SKEW) cs->skew = CLOCK_SYNC_MAXIMUM_SKEW;
+  if(cs->skew < -CLOCK_SYNC_MAXIMUM_SKEW) cs->skew = -CLOCK_SYNC_MAXIMUM_SKEW;
+}
+
+// remote minus local clock at local time now, in ns
+static inline int64_t clockSyncOffset(const clockSync *cs, uint64_t now) {
+  if(!cs->samples) return 0;
+
+  return cs->anchorOffset + (int64_t)(cs->skew * (double)(int64_t)(now - cs->anchorTime));
+}
+
+#endif
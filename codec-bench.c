@@ -0,0 +1,193 @@
+#include "common.h"
+
+#define __USE_POSIX199309 1
+#define __USE_POSIX2 1
+#define __USE_MISC 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <math.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "codec.h"
+#include "format.h"
+
+// Compression ratio and cost of codec.h, packet by packet as the sender
+// would compress, on raw PCM from a file or on a synthetic signal.
+
+codec encoder, decoder;
+char decoded[MAX_PAYLOAD];
+
+uint64_t cpuTime() {
+  struct timespec t;
+  if(clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t)) {
+    fprintf(stderr, "Failed to get cpu time: %s\n", strerror(errno));
+  }
+
+  return (uint64_t)(t.tv_sec) * 1000000000 + t.tv_nsec;
+}
+
+// a few tones with slowly moving levels over faint noise, roughly as
+// compressible as quiet music
+void synthesize(const audioFormat *format, char *out, size_t frames) {
+  size_t bytes = sampleBytes(format->format);
+  float scale = sampleScale(format->format);
+  static const double tones[] = { 110, 277, 440, 1320, 3520 };
+
+  for(size_t i = 0; i < frames; ++i) {
+    double t = (double)i / format->rate;
+    for(int c = 0; c < format->channels; ++c) {
+      double x = 0;
+      for(size_t k = 0; k < sizeof(tones) / sizeof(*tones); ++k) {
+        x += 0.08 * (1 + sin(2 * M_PI * 0.1 * (k + 1) * t)) * sin(2 * M_PI * tones[k] * t + c * 0.3 * k);
+      }
+      x += 0.001 * (rand() / (double)RAND_MAX * 2 - 1);
+
+      storeSample(format->format, out, x * scale);
+      out += bytes;
+    }
+  }
+}
+
+char *readInput(const char *path, size_t *len) {
+  FILE *file = strcmp(path, "-")? fopen(path, "rb"): stdin;
+  if(!file) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+
+  size_t size = 1 << 20;
+  char *data = malloc(size);
+  *len = 0;
+
+  while(data) {
+    *len += fread(data + *len, 1, size - *len, file);
+    if(*len < size) break;
+
+    char *grown = realloc(data, 2 * size);
+    if(!grown) free(data);
+    data = grown;
+    size *= 2;
+  }
+
+  if(!data) {
+    fprintf(stderr, "Failed to allocate input buffer.\n");
+  } else if(ferror(file)) {
+    fprintf(stderr, "Failed to read %s: %s\n", path, strerror(errno));
+    free(data);
+    data = NULL;
+  }
+
+  if(file != stdin) fclose(file);
+  return data;
+}
+
+int main(int argc, char **argv) {
+  double seconds = 60;
+  size_t packetFrames = 100; // what pulse-sender's 400 byte fragments hold in s16le stereo
+  audioFormat format = defaultFormat;
+  int opt;
+
+  while((opt = getopt(argc, argv, "s:b:f:")) != -1) {
+    switch(opt) {
+      case 's': seconds = atof(optarg); break;
+      case 'b': packetFrames = atoi(optarg); break;
+      case 'f':
+        if(parseFormat(optarg, &format)) return 1;
+        break;
+      default:
+        fprintf(stderr, "Usage: ./codec-bench [-s seconds of audio] [-b frames per packet] [-f format[:channels[:rate]]] [raw pcm file or -]\n");
+        return 1;
+    }
+  }
+
+  size_t frame = frameBytes(&format);
+  if(argc - optind > 1 || !packetFrames || packetFrames * frame > MAX_PAYLOAD) {
+    fprintf(stderr, "Usage: ./codec-bench [-s seconds of audio] [-b frames per packet] [-f format[:channels[:rate]]] [raw pcm file or -]\n");
+    fprintf(stderr, "Packets hold at most %zu frames of this format.\n", MAX_PAYLOAD / frame);
+    return 1;
+  }
+
+  char *pcm;
+  size_t len;
+  if(argc - optind == 1) {
+    pcm = readInput(argv[optind], &len);
+    if(!pcm) return 1;
+
+    // a canonical WAV header would only cost a few bytes of noise, skip it anyway
+    if(len >= 44 && !memcmp(pcm, "RIFF", 4)) {
+      memmove(pcm, pcm + 44, len - 44);
+      len -= 44;
+    }
+  } else {
+    len = (size_t)(seconds * format.rate) * frame;
+    pcm = malloc(len);
+    if(!pcm) {
+      fprintf(stderr, "Failed to allocate input buffer.\n");
+      return 1;
+    }
+    synthesize(&format, pcm, len / frame);
+  }
+
+  len = len / frame * frame;
+  if(!len) {
+    fprintf(stderr, "No audio to compress.\n");
+    return 1;
+  }
+
+  // all packets are coded before any is decoded, so timing covers whole
+  // passes rather than single packets
+  size_t packetBytes = packetFrames * frame;
+  uint64_t packets = (len + packetBytes - 1) / packetBytes;
+  size_t codedSize = len + packets * (codecHeaderLength(format.channels) + 8) + MAX_PAYLOAD;
+  uint8_t *coded = malloc(codedSize);
+  uint16_t *codedLengths = malloc(packets * sizeof(*codedLengths));
+  if(!coded || !codedLengths) {
+    fprintf(stderr, "Failed to allocate output buffer.\n");
+    return 1;
+  }
+
+  uint64_t start = cpuTime();
+  size_t codedBytes = 0;
+  for(uint64_t i = 0; i < packets; ++i) {
+    size_t offset = i * packetBytes;
+    size_t frames = (len - offset < packetBytes? len - offset: packetBytes) / frame;
+
+    codedLengths[i] = codecEncode(&encoder, format.format, format.channels, pcm + offset, frames,
+        coded + codedBytes, MAX_PAYLOAD);
+    if(!codedLengths[i]) {
+      fprintf(stderr, "Packet at byte %zu does not fit coded, use fewer frames per packet.\n", offset);
+      return 1;
+    }
+    codedBytes += codedLengths[i];
+  }
+  uint64_t encodeTime = cpuTime() - start;
+
+  start = cpuTime();
+  size_t consumed = 0;
+  for(uint64_t i = 0; i < packets; ++i) {
+    size_t offset = i * packetBytes;
+    ssize_t decodedLen = codecDecode(&decoder, format.format, format.channels, coded + consumed, codedLengths[i],
+        decoded, sizeof(decoded));
+    consumed += codedLengths[i];
+
+    size_t expected = len - offset < packetBytes? len - offset: packetBytes;
+    if(decodedLen != (ssize_t)expected || memcmp(decoded, pcm + offset, expected)) {
+      fprintf(stderr, "Packet at byte %zu did not survive coding.\n", offset);
+      return 1;
+    }
+  }
+  uint64_t decodeTime = cpuTime() - start; // includes the comparison
+
+  double audio = (double)len / frame / format.rate;
+  printf("Coded %.1fs of %s, %d channels, %u Hz in %llu packets of %zu frames: %.1f%% of the size, %.1f bytes per packet\n",
+      audio, formatName(format.format), format.channels, format.rate, (unsigned long long)packets, packetFrames,
+      100.0 * codedBytes / len, (double)codedBytes / packets);
+  printf("%.3fms cpu per second of audio to encode, %.3fms to decode, %.0f kbit/s instead of %.0f\n",
+      encodeTime / 1e6 / audio, decodeTime / 1e6 / audio, codedBytes * 8 / audio / 1000, len * 8 / audio / 1000);
+
+  return 0;
+}
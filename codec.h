@@ -0,0 +1,413 @@
+#ifndef H_5B7D2E94_0C61_4A8F_B3D5_9E42F17C6A08
+#define H_5B7D2E94_0C61_4A8F_B3D5_9E42F17C6A08
+
+#include "common.h"
+#include "format.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#define CODEC_MAX_FRAMES (MAX_PAYLOAD / 2) // the most a packet can decode to, mono s16le
+#define CODEC_MAX_ORDER 4
+#define CODEC_VERBATIM 7  // method for channels stored as they are
+#define CODEC_ESCAPE 24   // this many ones instead of a quotient are followed by the raw value
+#define CODEC_MID FORMAT_MAX_CHANNELS
+#define CODEC_SIDE (FORMAT_MAX_CHANNELS + 1)
+
+// Lossless compression of integer PCM in the style of FLAC's fixed
+// predictors. Every packet stands alone, so a lost packet costs nothing but
+// itself:
+//
+//   uint16_t frames
+//   uint8_t  stereo mode (enum codecStereo), always independent unless stereo
+//   uint8_t  method per channel: predictor order or CODEC_VERBATIM in the low
+//            3 bits, Rice parameter in the high 5
+//   bits     channel after channel, MSB first: Rice coded zigzag residuals,
+//            the first samples predicted with the orders available, or the
+//            samples themselves for CODEC_VERBATIM
+//
+// Float samples do not predict, they always go verbatim.
+enum codecStereo {
+  CODEC_INDEPENDENT = 0,
+  CODEC_LEFT_SIDE = 1,
+  CODEC_SIDE_RIGHT = 2,
+  CODEC_MID_SIDE = 3,
+};
+
+// scratch for one encoder or decoder, too large for the stack
+struct codec_t {
+  int32_t samples[FORMAT_MAX_CHANNELS + 2][CODEC_MAX_FRAMES]; // channels, then mid and side
+};
+
+typedef struct codec_t codec;
+
+static inline size_t codecHeaderLength(int channels) {
+  return 3 + channels;
+}
+
+static inline int32_t codecLoad(int format, const char *p) {
+  if(format == SAMPLE_FLOAT32LE) {
+    int32_t bits;
+    memcpy(&bits, p, sizeof(bits));
+    return bits;
+  }
+
+  return (int32_t)loadSample(format, p);
+}
+
+static inline void codecStore(int format, char *p, int32_t x) {
+  switch(format) {
+    case SAMPLE_S16LE: {
+      int16_t s = x;
+      memcpy(p, &s, sizeof(s));
+      break;
+    }
+    case SAMPLE_S24LE:
+      p[0] = x;
+      p[1] = x >> 8;
+      p[2] = x >> 16;
+      break;
+    default:
+      memcpy(p, &x, sizeof(x));
+      break;
+  }
+}
+
+// sample n predicted from the ones before it, with as much of order as
+// there are; unsigned so damaged input wraps instead of overflowing
+static inline uint32_t codecPredict(const int32_t *x, size_t n, int order) {
+  const uint32_t *u = (const uint32_t *)x;
+
+  switch(n < (size_t)order? (int)n: order) {
+    case 1: return u[n - 1];
+    case 2: return 2 * u[n - 1] - u[n - 2];
+    case 3: return 3 * u[n - 1] - 3 * u[n - 2] + u[n - 3];
+    case 4: return 4 * u[n - 1] - 6 * u[n - 2] + 4 * u[n - 3] - u[n - 4];
+    default: return 0;
+  }
+}
+
+static inline uint32_t codecZigzag(int32_t x) {
+  return ((uint32_t)x << 1) ^ (uint32_t)(x >> 31);
+}
+
+static inline int32_t codecUnzigzag(uint32_t u) {
+  return (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+}
+
+// the cheapest way to code a channel, sizes in bits
+struct codecChoice_t {
+  int method;
+  int rice;
+  uint64_t bits;
+};
+
+typedef struct codecChoice_t codecChoice;
+
+static inline codecChoice codecAnalyze(const int32_t *x, size_t frames, int width, int predict) {
+  codecChoice best = { CODEC_VERBATIM, 0, (uint64_t)frames * width };
+  if(!predict) return best;
+
+  uint64_t sums[CODEC_MAX_ORDER + 1] = { 0 };
+  for(size_t n = 0; n < frames; ++n) {
+    for(int order = 0; order <= CODEC_MAX_ORDER; ++order) {
+      sums[order] += codecZigzag((int32_t)((uint32_t)x[n] - codecPredict(x, n, order)));
+    }
+  }
+
+  for(int order = 0; order <= CODEC_MAX_ORDER; ++order) {
+    int rice = 0;
+    while(rice < 30 && ((uint64_t)frames << (rice + 1)) < sums[order]) ++rice;
+
+    uint64_t bits = (uint64_t)frames * (rice + 1) + (sums[order] >> rice);
+    if(bits < best.bits) {
+      best.method = order;
+      best.rice = rice;
+      best.bits = bits;
+    }
+  }
+
+  return best;
+}
+
+struct codecWriter_t {
+  uint8_t *out;
+  size_t capacity;
+  size_t length;
+  uint64_t acc;
+  int bits;
+  int overflow;
+};
+
+typedef struct codecWriter_t codecWriter;
+
+// n up to 32
+static inline void codecPut(codecWriter *w, uint32_t value, int n) {
+  if(!n) return;
+
+  w->acc = (w->acc << n) | (value & (uint32_t)(0xffffffffull >> (32 - n)));
+  w->bits += n;
+
+  while(w->bits >= 8) {
+    w->bits -= 8;
+    if(w->length == w->capacity) {
+      w->overflow = 1;
+      return;
+    }
+    w->out[w->length++] = w->acc >> w->bits;
+  }
+}
+
+static inline void codecPutRice(codecWriter *w, uint32_t u, int rice) {
+  uint32_t q = u >> rice;
+  if(q >= CODEC_ESCAPE) {
+    codecPut(w, (1u << CODEC_ESCAPE) - 1, CODEC_ESCAPE);
+    codecPut(w, u, 32);
+    return;
+  }
+
+  codecPut(w, ((1u << q) - 1) << 1, q + 1);
+  codecPut(w, u, rice);
+}
+
+// compresses frames of interleaved pcm into out, returns its length or 0 if
+// it would not fit capacity
+static inline size_t codecEncode(codec *c, int format, int channels, const char *pcm, size_t frames,
+    uint8_t *out, size_t capacity) {
+  if(!frames || frames > CODEC_MAX_FRAMES || capacity < codecHeaderLength(channels)) return 0;
+
+  size_t bytes = sampleBytes(format);
+  int width = bytes * 8;
+  int predict = format != SAMPLE_FLOAT32LE;
+
+  for(size_t n = 0; n < frames; ++n) {
+    for(int ch = 0; ch < channels; ++ch) {
+      c->samples[ch][n] = codecLoad(format, pcm);
+      pcm += bytes;
+    }
+  }
+
+  int slots[FORMAT_MAX_CHANNELS];
+  codecChoice choices[FORMAT_MAX_CHANNELS];
+  int stereo = CODEC_INDEPENDENT;
+
+  for(int ch = 0; ch < channels; ++ch) {
+    slots[ch] = ch;
+    choices[ch] = codecAnalyze(c->samples[ch], frames, width, predict);
+  }
+
+  if(channels == 2 && predict) {
+    int32_t *left = c->samples[0], *right = c->samples[1];
+    for(size_t n = 0; n < frames; ++n) {
+      c->samples[CODEC_MID][n] = (left[n] + right[n]) >> 1;
+      c->samples[CODEC_SIDE][n] = left[n] - right[n];
+    }
+
+    codecChoice mid = codecAnalyze(c->samples[CODEC_MID], frames, width, predict);
+    codecChoice side = codecAnalyze(c->samples[CODEC_SIDE], frames, width + 1, predict);
+
+    uint64_t costs[4] = {
+      choices[0].bits + choices[1].bits,
+      choices[0].bits + side.bits,
+      side.bits + choices[1].bits,
+      mid.bits + side.bits,
+    };
+    for(int mode = 1; mode < 4; ++mode) {
+      if(costs[mode] < costs[stereo]) stereo = mode;
+    }
+
+    if(stereo == CODEC_LEFT_SIDE) {
+      slots[1] = CODEC_SIDE;
+      choices[1] = side;
+    } else if(stereo == CODEC_SIDE_RIGHT) {
+      slots[0] = CODEC_SIDE;
+      choices[0] = side;
+    } else if(stereo == CODEC_MID_SIDE) {
+      slots[0] = CODEC_MID;
+      slots[1] = CODEC_SIDE;
+      choices[0] = mid;
+      choices[1] = side;
+    }
+  }
+
+  out[0] = frames;
+  out[1] = frames >> 8;
+  out[2] = stereo;
+  for(int ch = 0; ch < channels; ++ch) {
+    out[3 + ch] = choices[ch].method | choices[ch].rice << 3;
+  }
+
+  codecWriter w = { out, capacity, codecHeaderLength(channels), 0, 0, 0 };
+
+  for(int ch = 0; ch < channels && !w.overflow; ++ch) {
+    const int32_t *x = c->samples[slots[ch]];
+    int method = choices[ch].method;
+
+    if(method == CODEC_VERBATIM) {
+      int bits = width + (slots[ch] == CODEC_SIDE);
+      for(size_t n = 0; n < frames && !w.overflow; ++n) codecPut(&w, x[n], bits);
+      continue;
+    }
+
+    for(size_t n = 0; n < frames && !w.overflow; ++n) {
+      codecPutRice(&w, codecZigzag((int32_t)((uint32_t)x[n] - codecPredict(x, n, method))), choices[ch].rice);
+    }
+  }
+
+  if(!w.overflow && w.bits) codecPut(&w, 0, 8 - w.bits);
+  return w.overflow? 0: w.length;
+}
+
+struct codecReader_t {
+  const uint8_t *in;
+  size_t length;
+  size_t pos;
+  uint64_t acc; // left aligned, the next bit is the top one
+  int bits;
+};
+
+typedef struct codecReader_t codecReader;
+
+static inline void codecRefill(codecReader *r) {
+  while(r->bits <= 56 && r->pos < r->length) {
+    r->acc |= (uint64_t)r->in[r->pos++] << (56 - r->bits);
+    r->bits += 8;
+  }
+}
+
+static inline void codecSkip(codecReader *r, int n) {
+  r->acc = n < 64? r->acc << n: 0;
+  r->bits -= n;
+}
+
+// n up to 32, returns -1 past the end of the input
+static inline int codecRead(codecReader *r, int n, uint32_t *value) {
+  if(!n) {
+    *value = 0;
+    return 0;
+  }
+
+  codecRefill(r);
+  if(r->bits < n) return -1;
+
+  *value = r->acc >> (64 - n);
+  codecSkip(r, n);
+  return 0;
+}
+
+static inline int codecReadRice(codecReader *r, int rice, uint32_t *u) {
+  int q = 0;
+
+  while(1) {
+    codecRefill(r);
+    if(!r->bits) return -1;
+
+    uint64_t inverted = ~r->acc;
+    int ones = inverted? __builtin_clzll(inverted): 64;
+    if(ones > r->bits) ones = r->bits;
+
+    if(q + ones >= CODEC_ESCAPE) {
+      codecSkip(r, CODEC_ESCAPE - q);
+      return codecRead(r, 32, u);
+    }
+
+    if(ones < r->bits) {
+      codecSkip(r, ones + 1);
+      q += ones;
+      break;
+    }
+
+    codecSkip(r, ones);
+    q += ones;
+  }
+
+  uint32_t low;
+  if(codecRead(r, rice, &low)) return -1;
+  *u = (uint32_t)q << rice | low;
+  return 0;
+}
+
+// decodes a packet into interleaved pcm, returns its length in bytes or -1
+// for input which cannot have come from codecEncode
+static inline ssize_t codecDecode(codec *c, int format, int channels, const uint8_t *in, size_t len,
+    char *out, size_t capacity) {
+  size_t header = codecHeaderLength(channels);
+  if(len < header) return -1;
+
+  size_t frames = in[0] | (size_t)in[1] << 8;
+  int stereo = in[2];
+  size_t bytes = sampleBytes(format);
+  int width = bytes * 8;
+
+  if(!frames || frames > CODEC_MAX_FRAMES || frames * bytes * channels > capacity) return -1;
+  if(stereo > CODEC_MID_SIDE || (stereo != CODEC_INDEPENDENT && channels != 2)) return -1;
+
+  int slots[FORMAT_MAX_CHANNELS];
+  for(int ch = 0; ch < channels; ++ch) slots[ch] = ch;
+  if(stereo == CODEC_LEFT_SIDE) slots[1] = CODEC_SIDE;
+  if(stereo == CODEC_SIDE_RIGHT) slots[0] = CODEC_SIDE;
+  if(stereo == CODEC_MID_SIDE) {
+    slots[0] = CODEC_MID;
+    slots[1] = CODEC_SIDE;
+  }
+
+  codecReader r = { in, len, header, 0, 0 };
+
+  for(int ch = 0; ch < channels; ++ch) {
+    int32_t *x = c->samples[slots[ch]];
+    int method = in[3 + ch] & 7;
+    int rice = in[3 + ch] >> 3;
+
+    if(method == CODEC_VERBATIM) {
+      int bits = width + (slots[ch] == CODEC_SIDE);
+      for(size_t n = 0; n < frames; ++n) {
+        uint32_t v;
+        if(codecRead(&r, bits, &v)) return -1;
+        x[n] = bits < 32? (int32_t)(v << (32 - bits)) >> (32 - bits): (int32_t)v;
+      }
+      continue;
+    }
+
+    if(method > CODEC_MAX_ORDER || format == SAMPLE_FLOAT32LE) return -1;
+
+    for(size_t n = 0; n < frames; ++n) {
+      uint32_t u;
+      if(codecReadRice(&r, rice, &u)) return -1;
+      x[n] = (int32_t)((uint32_t)codecUnzigzag(u) + codecPredict(x, n, method));
+    }
+  }
+
+  if(stereo != CODEC_INDEPENDENT) {
+    int32_t *left = c->samples[0], *right = c->samples[1];
+    const int32_t *mid = c->samples[CODEC_MID], *side = c->samples[CODEC_SIDE];
+
+    for(size_t n = 0; n < frames; ++n) {
+      switch(stereo) {
+        case CODEC_LEFT_SIDE:
+          right[n] = (int32_t)((uint32_t)left[n] - (uint32_t)side[n]);
+          break;
+        case CODEC_SIDE_RIGHT:
+          left[n] = (int32_t)((uint32_t)right[n] + (uint32_t)side[n]);
+          break;
+        default: {
+          int64_t sum = (int64_t)mid[n] * 2 + (side[n] & 1);
+          left[n] = (sum + side[n]) >> 1;
+          right[n] = (sum - side[n]) >> 1;
+          break;
+        }
+      }
+    }
+  }
+
+  for(size_t n = 0; n < frames; ++n) {
+    for(int ch = 0; ch < channels; ++ch) {
+      codecStore(format, out, c->samples[ch][n]);
+      out += bytes;
+    }
+  }
+
+  return frames * bytes * channels;
+}
+
+#endif
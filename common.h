@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 
+// Legacy (version 0) wire format: every packet repeats full 64 bit fields.
 struct dataPacket_t {
   uint64_t length;
   uint64_t position;
@@ -12,4 +13,108 @@ struct dataPacket_t {
 
 typedef struct dataPacket_t dataPacket;
 
+// the fixed part of dataPacket, as parsed by receivers
+struct dataPacketHeader_t {
+  uint64_t length; // including this header
+  uint64_t position;
+  uint64_t time; // nanoseconds since the epoch
+};
+
+typedef struct dataPacketHeader_t dataPacketHeader;
+
+// Version 3 wire format: a compact header per packet carrying the low 32
+// bits of its absolute position and time, which receivers unwrap against
+// the newest ones seen, so a lost or reordered stream header misplaces
+// nothing (version 2 counted both from the last stream header). The version
+// byte sits where a legacy length field is always zero, so both formats can
+// be told apart packet by packet.
+#define PROTOCOL_VERSION 3
+#define MAX_PAYLOAD sizeof(((dataPacket *)0)->data)
+
+enum packetType {
+  PACKET_AUDIO = 0,
+  PACKET_STREAM_HEADER = 1,
+  PACKET_TIME_REQUEST = 2,  // receiver to sender, over UDP only
+  PACKET_TIME_RESPONSE = 3, // sender to receiver
+  PACKET_PARITY = 4,        // forward error correction, see fec.h
+  PACKET_NACK = 5,          // receiver to sender, over UDP only
+  PACKET_RETRANSMIT = 6,    // sender to receiver, answers PACKET_NACK
+  PACKET_CODED = 7,         // audio compressed with codec.h, positions still count PCM bytes
+  PACKET_SILENCE = 8,       // the sender suppresses quiet audio, see silenceMarker
+};
+
+enum sampleFormat {
+  SAMPLE_S16LE = 1,
+  SAMPLE_S24LE = 2,     // packed, three bytes per sample
+  SAMPLE_FLOAT32LE = 3,
+};
+
+struct packetHeader_t {
+  uint16_t length; // including this header
+  uint8_t type;
+  uint8_t version;
+  uint32_t position; // low 32 bits of the stream position in bytes
+  uint32_t time; // low 32 bits of microseconds since the epoch
+};
+
+typedef struct packetHeader_t packetHeader;
+
+// the value with the given low 32 bits nearest to reference, for positions
+// and times within 2^31 units of it
+static inline uint64_t unwrap32(uint64_t reference, uint32_t low) {
+  return reference + (int32_t)(low - (uint32_t)reference);
+}
+
+// payload of PACKET_STREAM_HEADER, sent at start and then periodically
+struct streamHeader_t {
+  uint8_t format; // enum sampleFormat
+  uint8_t channels;
+  uint16_t stream; // sender ID, tells mixing receivers which gain to apply
+  uint32_t rate;
+  uint64_t position;
+  uint64_t time; // nanoseconds since the epoch at which position was captured
+};
+
+typedef struct streamHeader_t streamHeader;
+
+// payload of PACKET_TIME_REQUEST/PACKET_TIME_RESPONSE, all in nanoseconds since the epoch
+struct timeSync_t {
+  uint64_t requestSent;     // receiver clock
+  uint64_t requestReceived; // sender clock
+  uint64_t responseSent;    // sender clock
+};
+
+typedef struct timeSync_t timeSync;
+
+// payload of PACKET_NACK, one or more ranges of stream bytes the receiver
+// is missing; positions are absolute since they may predate the current
+// stream header
+struct nackRange_t {
+  uint64_t position;
+  uint32_t length;
+  uint32_t reserved;
+};
+
+typedef struct nackRange_t nackRange;
+
+// prefix of a PACKET_RETRANSMIT payload, followed by audio as originally sent
+struct retransmitHeader_t {
+  uint64_t position;
+  uint64_t time; // nanoseconds since the epoch, from the original packet
+};
+
+typedef struct retransmitHeader_t retransmitHeader;
+
+// payload of PACKET_SILENCE, sent instead of audio below the sender's
+// threshold. The packet's position and time are those of the latest
+// suppressed capture. Silence runs from skipped bytes before that position
+// to length bytes after it, and receivers keep playing silence beyond it
+// until audio or the next marker arrives.
+struct silenceMarker_t {
+  uint32_t skipped; // since the previous marker
+  uint32_t length;
+};
+
+typedef struct silenceMarker_t silenceMarker;
+
 #endif
@@ -0,0 +1,438 @@
+#ifndef H_7E41C5A2_93D8_4B6F_A0E2_58C1F7D3B914
+#define H_7E41C5A2_93D8_4B6F_A0E2_58C1F7D3B914
+
+#include "common.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define FEC_MAX_DATA 32   // audio packets per group
+#define FEC_MAX_PARITY 8  // parity packets per group
+#define FEC_PREFIX_MAX (sizeof(fecParityHeader) + FEC_MAX_DATA * (sizeof(int32_t) + sizeof(uint16_t)))
+
+// Systematic Reed-Solomon erasure code over GF(2^8) for groups of audio
+// packets. Parity j of a group is sum_i C[j][i] * payload_i with a Cauchy
+// matrix C whose columns are scaled so that row 0 is all ones: a single
+// parity per group is plain XOR, and any e lost packets can be rebuilt from
+// any e parities of their group. Payloads of different lengths are zero
+// padded to the longest one.
+//
+// A PACKET_PARITY payload is a fecParityHeader, then count int32 member
+// positions relative to the parity packet's own position, count uint16
+// member lengths and finally the parity bytes.
+struct fecParityHeader_t {
+  uint32_t group;
+  uint8_t index;    // which parity of the group, row of C
+  uint8_t parities; // sent per group
+  uint8_t count;    // audio packets covered
+  uint8_t reserved;
+};
+
+typedef struct fecParityHeader_t fecParityHeader;
+
+static uint8_t gfExp[512];
+static uint8_t gfLog[256];
+
+static inline void gfInit() {
+  if(gfExp[0]) return;
+
+  unsigned int x = 1;
+  for(int i = 0; i < 255; ++i) {
+    gfExp[i] = gfExp[i + 255] = x;
+    gfLog[x] = i;
+    x <<= 1;
+    if(x & 0x100) x ^= 0x11d;
+  }
+  gfExp[510] = gfExp[0];
+}
+
+static inline uint8_t gfMul(uint8_t a, uint8_t b) {
+  return a && b? gfExp[gfLog[a] + gfLog[b]]: 0;
+}
+
+static inline uint8_t gfInverse(uint8_t a) {
+  return gfExp[255 - gfLog[a]];
+}
+
+// coefficient of data packet i in parity j
+static inline uint8_t fecCoefficient(int j, int i) {
+  uint8_t y = FEC_MAX_PARITY + i;
+  return gfMul(y, gfInverse(j ^ y)); // (x_0 + y_i) / (x_j + y_i) with x_j = j
+}
+
+// dst ^= c * src
+static inline void gfMulAdd(uint8_t *dst, const uint8_t *src, size_t len, uint8_t c) {
+  if(c == 1) {
+    for(size_t i = 0; i < len; ++i) dst[i] ^= src[i];
+    return;
+  }
+
+  uint8_t row[256];
+  for(int x = 0; x < 256; ++x) row[x] = gfMul(c, x);
+  for(size_t i = 0; i < len; ++i) dst[i] ^= row[src[i]];
+}
+
+// inverts the n x n matrix m in place, returns -1 if it is singular
+static inline int gfInvert(uint8_t m[FEC_MAX_PARITY][FEC_MAX_PARITY], int n) {
+  uint8_t inv[FEC_MAX_PARITY][FEC_MAX_PARITY];
+  memset(inv, 0, sizeof(inv));
+  for(int i = 0; i < n; ++i) inv[i][i] = 1;
+
+  for(int col = 0; col < n; ++col) {
+    int pivot = col;
+    while(pivot < n && !m[pivot][col]) ++pivot;
+    if(pivot == n) return -1;
+
+    for(int k = 0; k < n; ++k) {
+      uint8_t t = m[col][k]; m[col][k] = m[pivot][k]; m[pivot][k] = t;
+      t = inv[col][k]; inv[col][k] = inv[pivot][k]; inv[pivot][k] = t;
+    }
+
+    uint8_t scale = gfInverse(m[col][col]);
+    for(int k = 0; k < n; ++k) {
+      m[col][k] = gfMul(m[col][k], scale);
+      inv[col][k] = gfMul(inv[col][k], scale);
+    }
+
+    for(int row = 0; row < n; ++row) {
+      uint8_t f = m[row][col];
+      if(row == col || !f) continue;
+      for(int k = 0; k < n; ++k) {
+        m[row][k] ^= gfMul(f, m[col][k]);
+        inv[row][k] ^= gfMul(f, inv[col][k]);
+      }
+    }
+  }
+
+  memcpy(m, inv, sizeof(inv));
+  return 0;
+}
+
+// Sender side: parities are accumulated as packets are sent, so payloads
+// never have to be kept around.
+struct fecEncoder_t {
+  int data;     // packets per group, 0 if disabled
+  int parities; // parity packets per group
+
+  uint32_t group;
+  int count;
+  uint64_t positions[FEC_MAX_DATA];
+  uint16_t lengths[FEC_MAX_DATA];
+  size_t parityLen;
+
+  // prefix built right in front of the parity bytes, which start at FEC_PREFIX_MAX
+  uint8_t packets[FEC_MAX_PARITY][FEC_PREFIX_MAX + MAX_PAYLOAD];
+};
+
+typedef struct fecEncoder_t fecEncoder;
+
+static inline void fecEncoderInit(fecEncoder *fec, int data, int parities) {
+  gfInit();
+  fec->data = data;
+  fec->parities = parities;
+  fec->group = 0;
+  fec->count = 0;
+  fec->parityLen = 0;
+}
+
+// payload overhead of a parity packet on top of the parity bytes
+static inline size_t fecPrefixLength(int count) {
+  return sizeof(fecParityHeader) + count * (sizeof(int32_t) + sizeof(uint16_t));
+}
+
+// returns 1 once the group is complete and has to be emitted
+static inline int fecAdd(fecEncoder *fec, uint64_t position, const void *data, size_t len) {
+  int i = fec->count++;
+  fec->positions[i] = position;
+  fec->lengths[i] = len;
+
+  if(len > fec->parityLen) {
+    for(int j = 0; j < fec->parities; ++j) {
+      memset(fec->packets[j] + FEC_PREFIX_MAX + fec->parityLen, 0, len - fec->parityLen);
+    }
+    fec->parityLen = len;
+  }
+
+  for(int j = 0; j < fec->parities; ++j) {
+    gfMulAdd(fec->packets[j] + FEC_PREFIX_MAX, data, len, fecCoefficient(j, i));
+  }
+
+  return fec->count == fec->data;
+}
+
+// builds parity packet j of the current group for a parity packet sent at
+// position, returns its payload
+static inline const uint8_t *fecParity(fecEncoder *fec, int j, uint64_t position, size_t *len) {
+  size_t prefix = fecPrefixLength(fec->count);
+  uint8_t *p = fec->packets[j] + FEC_PREFIX_MAX - prefix;
+
+  fecParityHeader header;
+  memset(&header, 0, sizeof(header));
+  header.group = fec->group;
+  header.index = j;
+  header.parities = fec->parities;
+  header.count = fec->count;
+  memcpy(p, &header, sizeof(header));
+
+  uint8_t *offsets = p + sizeof(header);
+  uint8_t *lengths = offsets + fec->count * sizeof(int32_t);
+  for(int i = 0; i < fec->count; ++i) {
+    int32_t offset = fec->positions[i] - position;
+    memcpy(offsets + i * sizeof(offset), &offset, sizeof(offset));
+    memcpy(lengths + i * sizeof(uint16_t), &fec->lengths[i], sizeof(uint16_t));
+  }
+
+  *len = prefix + fec->parityLen;
+  return p;
+}
+
+// to be called once all parities of the group have been sent
+static inline void fecNextGroup(fecEncoder *fec) {
+  ++fec->group;
+  fec->count = 0;
+  fec->parityLen = 0;
+}
+
+#define FEC_HISTORY 128 // received payloads kept for rebuilding others
+#define FEC_GROUPS 8    // groups waiting for packets or parities
+
+struct fecReceived_t {
+  uint64_t position;
+  size_t length;
+  uint8_t data[MAX_PAYLOAD];
+};
+
+typedef struct fecReceived_t fecReceived;
+
+struct fecGroup_t {
+  int used;
+  int done;
+  uint32_t group;
+  int count;
+  uint64_t positions[FEC_MAX_DATA];
+  uint16_t lengths[FEC_MAX_DATA];
+  uint32_t found;   // bit i set once packet i has been received
+  uint32_t parities; // bit j set once parity j has been received
+  uint64_t time;    // of the newest parity, stands in for lost packets' times
+  size_t parityLen;
+  uint8_t parity[FEC_MAX_PARITY][MAX_PAYLOAD];
+};
+
+typedef struct fecGroup_t fecGroup;
+
+// Receiver side: remembers recent payloads by position and rebuilds lost
+// ones once a group has as many parities as holes.
+struct fecDecoder_t {
+  int active; // set by the first parity packet, until then nothing is copied
+  fecReceived history[FEC_HISTORY];
+  int historyNext;
+  fecGroup groups[FEC_GROUPS];
+
+  // output of the last fecRemember/fecReceiveParity call
+  int recoveredCount;
+  uint64_t recoveredTime;
+  uint64_t recoveredPositions[FEC_MAX_PARITY];
+  uint16_t recoveredLengths[FEC_MAX_PARITY];
+  uint8_t recoveredData[FEC_MAX_PARITY][MAX_PAYLOAD];
+
+  uint64_t recovered;
+  uint64_t unrecovered;
+};
+
+typedef struct fecDecoder_t fecDecoder;
+
+static inline void fecDecoderInit(fecDecoder *fec) {
+  gfInit();
+  fec->active = 0;
+  fec->historyNext = 0;
+  for(int i = 0; i < FEC_HISTORY; ++i) fec->history[i].length = 0;
+  for(int i = 0; i < FEC_GROUPS; ++i) fec->groups[i].used = 0;
+  fec->recoveredCount = 0;
+  fec->recovered = 0;
+  fec->unrecovered = 0;
+}
+
+static inline const fecReceived *fecFind(const fecDecoder *fec, uint64_t position, size_t length) {
+  for(int i = 0; i < FEC_HISTORY; ++i) {
+    const fecReceived *r = &fec->history[i];
+    if(r->length == length && r->position == position) return r;
+  }
+  return NULL;
+}
+
+static inline int fecPopCount(uint32_t x) {
+  int n = 0;
+  for(; x; x &= x - 1) ++n;
+  return n;
+}
+
+// rebuilds the missing packets of a group if enough parities are there,
+// results end up in fec->recovered*
+static inline void fecTryGroup(fecDecoder *fec, fecGroup *g) {
+  const uint8_t *data[FEC_MAX_DATA];
+  int missing[FEC_MAX_PARITY];
+  int e = 0;
+
+  for(int i = 0; i < g->count; ++i) {
+    data[i] = NULL;
+    if(g->found & (1u << i)) {
+      const fecReceived *r = fecFind(fec, g->positions[i], g->lengths[i]);
+      if(r) {
+        data[i] = r->data;
+        continue;
+      }
+      g->found &= ~(1u << i); // aged out of the history
+    }
+
+    if(e == FEC_MAX_PARITY) return;
+    missing[e++] = i;
+  }
+
+  if(!e) {
+    g->done = 1;
+    return;
+  }
+  if(fecPopCount(g->parities) < e) return;
+
+  // use the first e parities received, syndromes go straight to the output
+  int rows[FEC_MAX_PARITY];
+  int n = 0;
+  for(int j = 0; j < FEC_MAX_PARITY && n < e; ++j) {
+    if(g->parities & (1u << j)) rows[n++] = j;
+  }
+
+  uint8_t syndromes[FEC_MAX_PARITY][MAX_PAYLOAD];
+  uint8_t m[FEC_MAX_PARITY][FEC_MAX_PARITY];
+  for(int r = 0; r < e; ++r) {
+    memcpy(syndromes[r], g->parity[rows[r]], g->parityLen);
+    for(int i = 0; i < g->count; ++i) {
+      if(data[i]) gfMulAdd(syndromes[r], data[i], g->lengths[i], fecCoefficient(rows[r], i));
+    }
+    for(int c = 0; c < e; ++c) {
+      m[r][c] = fecCoefficient(rows[r], missing[c]);
+    }
+  }
+
+  if(gfInvert(m, e)) return;
+
+  for(int c = 0; c < e; ++c) {
+    memset(fec->recoveredData[c], 0, g->parityLen);
+    for(int r = 0; r < e; ++r) {
+      if(m[c][r]) gfMulAdd(fec->recoveredData[c], syndromes[r], g->parityLen, m[c][r]);
+    }
+    fec->recoveredPositions[c] = g->positions[missing[c]];
+    fec->recoveredLengths[c] = g->lengths[missing[c]];
+  }
+
+  fec->recoveredCount = e;
+  fec->recoveredTime = g->time;
+  fec->recovered += e;
+  g->done = 1;
+}
+
+static inline void fecRetire(fecDecoder *fec, fecGroup *g) {
+  if(g->used && !g->done) {
+    fec->unrecovered += g->count - fecPopCount(g->found);
+  }
+  g->used = 0;
+}
+
+// keeps a received audio payload around and checks whether it completes a
+// group; returns the number of packets rebuilt, see fec->recovered*
+static inline int fecRemember(fecDecoder *fec, uint64_t position,
+    const char *payload1, size_t len1, const char *payload2, size_t len2) {
+  fec->recoveredCount = 0;
+  if(!fec->active || len1 + len2 > MAX_PAYLOAD) return 0;
+
+  fecReceived *r = &fec->history[fec->historyNext];
+  fec->historyNext = (fec->historyNext + 1) % FEC_HISTORY;
+  r->position = position;
+  r->length = len1 + len2;
+  memcpy(r->data, payload1, len1);
+  memcpy(r->data + len1, payload2, len2);
+
+  for(int k = 0; k < FEC_GROUPS; ++k) {
+    fecGroup *g = &fec->groups[k];
+    if(!g->used || g->done) continue;
+
+    for(int i = 0; i < g->count; ++i) {
+      if(g->positions[i] != position || g->lengths[i] != r->length) continue;
+
+      g->found |= 1u << i;
+      fecTryGroup(fec, g);
+      return fec->recoveredCount;
+    }
+  }
+
+  return 0;
+}
+
+// handles a PACKET_PARITY payload, position being that of the parity packet
+// itself; returns the number of packets rebuilt, see fec->recovered*
+static inline int fecReceiveParity(fecDecoder *fec, uint64_t position, uint64_t time,
+    const char *payload, size_t len) {
+  fec->recoveredCount = 0;
+  int first = !fec->active; // its packets came before anything was remembered
+  fec->active = 1;
+
+  fecParityHeader header;
+  if(len < sizeof(header)) return -1;
+  memcpy(&header, payload, sizeof(header));
+
+  size_t prefix = fecPrefixLength(header.count);
+  if(header.count == 0 || header.count > FEC_MAX_DATA || header.index >= FEC_MAX_PARITY ||
+      len < prefix || len - prefix > MAX_PAYLOAD) return -1;
+
+  fecGroup *g = NULL;
+  for(int k = 0; k < FEC_GROUPS && !g; ++k) {
+    if(fec->groups[k].used && fec->groups[k].group == header.group) g = &fec->groups[k];
+  }
+
+  if(!g) {
+    // take a free slot or the oldest group
+    g = &fec->groups[0];
+    for(int k = 0; k < FEC_GROUPS; ++k) {
+      fecGroup *c = &fec->groups[k];
+      if(!c->used) {
+        g = c;
+        break;
+      }
+      if((int32_t)(c->group - g->group) < 0) g = c;
+    }
+    fecRetire(fec, g);
+
+    g->used = 1;
+    g->done = first;
+    g->group = header.group;
+    g->count = header.count;
+    g->found = 0;
+    g->parities = 0;
+    g->parityLen = len - prefix;
+
+    const char *offsets = payload + sizeof(header);
+    const char *lengths = offsets + header.count * sizeof(int32_t);
+    for(int i = 0; i < g->count; ++i) {
+      int32_t offset;
+      memcpy(&offset, offsets + i * sizeof(offset), sizeof(offset));
+      memcpy(&g->lengths[i], lengths + i * sizeof(uint16_t), sizeof(uint16_t));
+      g->positions[i] = position + offset;
+
+      if(g->lengths[i] > g->parityLen) {
+        g->used = 0;
+        return -1;
+      }
+      if(fecFind(fec, g->positions[i], g->lengths[i])) g->found |= 1u << i;
+    }
+  }
+
+  if(g->done || len - prefix != g->parityLen) return 0;
+
+  memcpy(g->parity[header.index], payload + prefix, g->parityLen);
+  g->parities |= 1u << header.index;
+  g->time = time;
+
+  fecTryGroup(fec, g);
+  return fec->recoveredCount;
+}
+
+#endif
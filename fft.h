@@ -0,0 +1,44 @@
+#ifndef H_28309968_D1EF_451D_A99B_B39FD21B75C8
+#define H_28309968_D1EF_451D_A99B_B39FD21B75C8
+
+#include <complex.h>
+#include <math.h>
+#include <stddef.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// In-place iterative radix-2 FFT, n must be a power of two.
+// The inverse transform is not normalized.
+static inline void fft(double complex *x, size_t n, int inverse) {
+  for(size_t i = 1, j = 0; i < n; ++i) {
+    size_t bit = n >> 1;
+    for(; j & bit; bit >>= 1) j ^= bit;
+    j ^= bit;
+
+    if(i < j) {
+      double complex tmp = x[i];
+      x[i] = x[j];
+      x[j] = tmp;
+    }
+  }
+
+  for(size_t len = 2; len <= n; len <<= 1) {
+    double angle = (inverse? 2: -2) * M_PI / len;
+    double complex step = cos(angle) + I * sin(angle);
+
+    for(size_t i = 0; i < n; i += len) {
+      double complex w = 1;
+      for(size_t k = 0; k < len / 2; ++k) {
+        double complex u = x[i + k];
+        double complex v = x[i + k + len / 2] * w;
+        x[i + k] = u + v;
+        x[i + k + len / 2] = u - v;
+        w *= step;
+      }
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef H_6A0E5B1D_3C47_4F0B_9D8E_2B71C4E5A930
+#define H_6A0E5B1D_3C47_4F0B_9D8E_2B71C4E5A930
+
+#include "common.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FORMAT_MAX_CHANNELS 8
+
+// Sample spec of a stream or device. Samples are interleaved, so a frame
+// holds one sample per channel.
+struct audioFormat_t {
+  int format; // enum sampleFormat
+  int channels;
+  unsigned int rate;
+};
+
+typedef struct audioFormat_t audioFormat;
+
+static const audioFormat defaultFormat = { SAMPLE_S16LE, 2, 44100 };
+
+static inline size_t sampleBytes(int format) {
+  switch(format) {
+    case SAMPLE_S16LE: return 2;
+    case SAMPLE_S24LE: return 3;
+    case SAMPLE_FLOAT32LE: return 4;
+    default: return 0;
+  }
+}
+
+static inline size_t frameBytes(const audioFormat *format) {
+  return sampleBytes(format->format) * format->channels;
+}
+
+static inline size_t bytesPerSecond(const audioFormat *format) {
+  return frameBytes(format) * format->rate;
+}
+
+static inline int formatValid(const audioFormat *format) {
+  return sampleBytes(format->format) && format->channels >= 1 &&
+    format->channels <= FORMAT_MAX_CHANNELS && format->rate >= 8000 && format->rate <= 384000;
+}
+
+static inline int formatEqual(const audioFormat *a, const audioFormat *b) {
+  return a->format == b->format && a->channels == b->channels && a->rate == b->rate;
+}
+
+static inline const char *formatName(int format) {
+  switch(format) {
+    case SAMPLE_S16LE: return "s16le";
+    case SAMPLE_S24LE: return "s24le";
+    case SAMPLE_FLOAT32LE: return "float32le";
+    default: return "unknown";
+  }
+}
+
+// parses "format[:channels[:rate]]", e.g. "float32le:6:48000"; fields left
+// out keep their current value
+static inline int parseFormat(const char *spec, audioFormat *format) {
+  audioFormat parsed = *format;
+  char name[16];
+  size_t len = strcspn(spec, ":");
+  if(len >= sizeof(name)) len = sizeof(name) - 1;
+  memcpy(name, spec, len);
+  name[len] = '\0';
+
+  parsed.format = 0;
+  for(int f = SAMPLE_S16LE; f <= SAMPLE_FLOAT32LE; ++f) {
+    if(!strcmp(name, formatName(f))) parsed.format = f;
+  }
+
+  spec += strcspn(spec, ":");
+  if(*spec == ':') {
+    parsed.channels = atoi(++spec);
+    spec += strcspn(spec, ":");
+  }
+  if(*spec == ':') {
+    parsed.rate = atoi(++spec);
+  }
+
+  if(!formatValid(&parsed)) {
+    fprintf(stderr, "Unsupported sample format, use s16le, s24le or float32le, 1 to %d channels, 8000 to 384000 Hz.\n", FORMAT_MAX_CHANNELS);
+    return -1;
+  }
+
+  *format = parsed;
+  return 0;
+}
+
+// Per sample conversion to and from float in the format's own scale, so
+// S16 stays within +-32768 and S24 within +-8388608. Meant to be used with
+// a constant format in code the compiler specialises, where the switch
+// disappears.
+static inline __attribute__((always_inline)) float loadSample(int format, const char *p) {
+  switch(format) {
+    case SAMPLE_S16LE: {
+      int16_t s;
+      memcpy(&s, p, sizeof(s));
+      return s;
+    }
+    case SAMPLE_S24LE: {
+      const unsigned char *b = (const unsigned char *)p;
+      int32_t s = (int32_t)((uint32_t)b[0] << 8 | (uint32_t)b[1] << 16 | (uint32_t)b[2] << 24) >> 8;
+      return s;
+    }
+    default: {
+      float s;
+      memcpy(&s, p, sizeof(s));
+      return s;
+    }
+  }
+}
+
+static inline __attribute__((always_inline)) void storeSample(int format, char *p, float x) {
+  switch(format) {
+    case SAMPLE_S16LE: {
+      int16_t s = x > 32767? 32767: x < -32768? -32768: x;
+      memcpy(p, &s, sizeof(s));
+      break;
+    }
+    case SAMPLE_S24LE: {
+      int32_t s = x > 8388607? 8388607: x < -8388608? -8388608: x;
+      p[0] = s;
+      p[1] = s >> 8;
+      p[2] = s >> 16;
+      break;
+    }
+    default:
+      memcpy(p, &x, sizeof(x));
+      break;
+  }
+}
+
+// full scale of a format, in the scale used above
+static inline float sampleScale(int format) {
+  return format == SAMPLE_S16LE? 32768: format == SAMPLE_S24LE? 8388608: 1;
+}
+
+#endif
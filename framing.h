@@ -0,0 +1,151 @@
+#ifndef H_B1CA3953_E620_4223_B838_7C6BF341504F
+#define H_B1CA3953_E620_4223_B838_7C6BF341504F
+
+#include "common.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define FRAMING_BUFFER_SIZE 16384 // must be a power of two
+
+// Circular input buffer for the dataPacket byte stream. Packets are parsed
+// where they were received, the payload is handed out as (up to) two spans
+// so it can be copied straight to its final destination.
+struct framingBuffer_t {
+  char data[FRAMING_BUFFER_SIZE];
+  uint64_t readPos;  // absolute stream offsets, indexed modulo buffer size
+  uint64_t writePos;
+};
+
+typedef struct framingBuffer_t framingBuffer;
+
+static inline void framingInit(framingBuffer *in) {
+  in->readPos = 0;
+  in->writePos = 0;
+}
+
+// reads whatever fits from fd, same return convention as read(2)
+static inline ssize_t framingFill(framingBuffer *in, int fd) {
+  size_t used = in->writePos - in->readPos;
+  size_t start = in->writePos & (FRAMING_BUFFER_SIZE - 1);
+  size_t space = FRAMING_BUFFER_SIZE - used;
+  size_t first = FRAMING_BUFFER_SIZE - start;
+  if(first > space) first = space;
+
+  struct iovec spans[2] = {
+    { in->data + start, first },
+    { in->data, space - first },
+  };
+
+  ssize_t len = readv(fd, spans, spans[1].iov_len? 2: 1);
+  if(len > 0) in->writePos += len;
+  return len;
+}
+
+static inline void framingCopyOut(const framingBuffer *in, uint64_t pos, void *dst, size_t len) {
+  size_t start = pos & (FRAMING_BUFFER_SIZE - 1);
+  size_t first = FRAMING_BUFFER_SIZE - start;
+  if(first > len) first = len;
+
+  memcpy(dst, in->data + start, first);
+  memcpy((char *)dst + first, in->data, len - first);
+}
+
+// A packet header in either wire format. Version 3 positions and times are
+// only their low 32 bits, the receiver unwraps them.
+struct framedPacket_t {
+  uint64_t length; // on the wire, including the header
+  size_t headerLength;
+  int version; // 0 for legacy packets
+  int type;
+  uint64_t position;
+  uint64_t time; // nanoseconds since the epoch (legacy) or low bits of microseconds
+};
+
+typedef struct framedPacket_t framedPacket;
+
+// Returns 1 if the header could be decoded from the first available bytes
+// of a packet, 0 if more bytes are needed and -1 if it is impossible.
+static inline int framingParseHeader(const char *bytes, size_t available, framedPacket *packet) {
+  if(available < sizeof(packetHeader)) return 0;
+
+  if(bytes[3]) {
+    packetHeader header;
+    memcpy(&header, bytes, sizeof(header));
+    if(header.version != PROTOCOL_VERSION) return -1;
+    if(header.length < sizeof(header) || header.length > sizeof(header) + MAX_PAYLOAD) return -1;
+
+    packet->length = header.length;
+    packet->headerLength = sizeof(header);
+    packet->version = header.version;
+    packet->type = header.type;
+    packet->position = header.position;
+    packet->time = header.time;
+    return 1;
+  }
+
+  dataPacketHeader header;
+  if(available < sizeof(header)) return 0;
+
+  memcpy(&header, bytes, sizeof(header));
+  if(header.length < sizeof(header) || header.length > sizeof(dataPacket)) return -1;
+
+  packet->length = header.length;
+  packet->headerLength = sizeof(header);
+  packet->version = 0;
+  packet->type = PACKET_AUDIO;
+  packet->position = header.position;
+  packet->time = header.time;
+  return 1;
+}
+
+// Returns 1 if a complete packet is available, 0 if more input is needed and
+// -1 if the stream contains an impossible header. In the latter case all
+// buffered input is discarded, as packet boundaries are lost.
+static inline int framingNext(framingBuffer *in, framedPacket *packet,
+    const char **payload1, size_t *len1, const char **payload2, size_t *len2) {
+  size_t used = in->writePos - in->readPos;
+
+  char bytes[sizeof(dataPacketHeader)];
+  size_t available = used < sizeof(bytes)? used: sizeof(bytes);
+  framingCopyOut(in, in->readPos, bytes, available);
+
+  int status = framingParseHeader(bytes, available, packet);
+  if(status < 0) {
+    in->readPos = in->writePos;
+    return -1;
+  }
+
+  if(!status || used < packet->length) return 0;
+
+  size_t len = packet->length - packet->headerLength;
+  size_t start = (in->readPos + packet->headerLength) & (FRAMING_BUFFER_SIZE - 1);
+  size_t first = FRAMING_BUFFER_SIZE - start;
+  if(first > len) first = len;
+
+  *payload1 = in->data + start;
+  *len1 = first;
+  *payload2 = in->data;
+  *len2 = len - first;
+  return 1;
+}
+
+// validates a packet which arrived as a single datagram,
+// returns 1 if it is well-formed and -1 otherwise
+static inline int framingParseDatagram(const char *data, size_t len, framedPacket *packet,
+    const char **payload, size_t *payloadLen) {
+  if(framingParseHeader(data, len, packet) <= 0) return -1;
+  if(packet->length != len) return -1;
+
+  *payload = data + packet->headerLength;
+  *payloadLen = len - packet->headerLength;
+  return 1;
+}
+
+static inline void framingConsume(framingBuffer *in, const framedPacket *packet) {
+  in->readPos += packet->length;
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef H_4DCC8B8A_1C0E_4C4D_BFB1_6D4F18552943
+#define H_4DCC8B8A_1C0E_4C4D_BFB1_6D4F18552943
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define JITTER_BINS 2048  // of JITTER_BIN_WIDTH each, longer delays go into the last one
+#define JITTER_BIN_WIDTH 0.0005 // in s
+#define JITTER_DECAY 0.95 // per jitterDecay call, so old evenings are forgotten
+
+// Running histogram of how long packets took from capture to arrival.
+struct jitterHistogram_t {
+  float bins[JITTER_BINS];
+  float total;
+};
+
+typedef struct jitterHistogram_t jitterHistogram;
+
+static inline void jitterInit(jitterHistogram *h) {
+  memset(h, 0, sizeof(*h));
+}
+
+static inline void jitterAdd(jitterHistogram *h, double delay) {
+  int bin = delay < 0? 0: delay / JITTER_BIN_WIDTH;
+  if(bin >= JITTER_BINS) bin = JITTER_BINS - 1;
+
+  h->bins[bin] += 1;
+  h->total += 1;
+}
+
+static inline void jitterDecay(jitterHistogram *h) {
+  for(int i = 0; i < JITTER_BINS; ++i) h->bins[i] *= JITTER_DECAY;
+  h->total *= JITTER_DECAY;
+}
+
+// delay in s which the given fraction of packets did not exceed
+static inline double jitterPercentile(const jitterHistogram *h, double fraction) {
+  float remaining = h->total * (1 - fraction);
+  int bin = JITTER_BINS - 1;
+  while(bin > 0 && remaining >= h->bins[bin]) remaining -= h->bins[bin--];
+
+  return (bin + 1) * JITTER_BIN_WIDTH;
+}
+
+// parses "percentile[:margin in ms]", e.g. "99.5:10"
+static inline int parseJitterTarget(const char *spec, double *fraction, double *margin) {
+  double f = atof(spec) / 100;
+  const char *colon = strchr(spec, ':');
+  double m = colon? atof(colon + 1) / 1000: *margin;
+
+  if(f <= 0 || f >= 1 || m < 0) {
+    fprintf(stderr, "Invalid adaptive latency spec %s, expected percentile[:margin in ms].\n", spec);
+    return -1;
+  }
+
+  *fraction = f;
+  *margin = m;
+  return 0;
+}
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef H_C81E2F5B_46A0_4D3E_9B7C_E2A5D0F4816C
+#define H_C81E2F5B_46A0_4D3E_9B7C_E2A5D0F4816C
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Gilbert-Elliott loss model for testing: the link flips between a good
+// state without losses and a bad one which loses everything, so losses come
+// in bursts of a configurable mean length at a configurable overall rate.
+struct lossSimulator_t {
+  double enter; // probability of going bad after a packet
+  double leave; // probability of recovering after a packet
+  int bad;
+  uint64_t random;
+
+  uint64_t dropped;
+};
+
+typedef struct lossSimulator_t lossSimulator;
+
+static inline void lossInit(lossSimulator *loss) {
+  memset(loss, 0, sizeof(*loss));
+  loss->random = 0x9E3779B97F4A7C15ull;
+}
+
+// parses "percent[:mean burst length]", e.g. "2:3"
+static inline int lossParse(lossSimulator *loss, const char *spec) {
+  double rate = atof(spec) / 100;
+  double burst = 1;
+  const char *colon = strchr(spec, ':');
+  if(colon) burst = atof(colon + 1);
+
+  if(rate < 0 || rate >= 1 || burst < 1) {
+    fprintf(stderr, "Invalid loss spec %s, expected percent[:mean burst length].\n", spec);
+    return -1;
+  }
+
+  loss->leave = 1 / burst;
+  loss->enter = rate * loss->leave / (1 - rate);
+  return 0;
+}
+
+// restarts a copy of a configured simulator on a sequence of its own, so
+// several receivers sharing the configuration lose different packets
+static inline void lossSeed(lossSimulator *loss, uint64_t seed) {
+  loss->random = 0x9E3779B97F4A7C15ull * (seed + 1) | 1; // xorshift needs a nonzero state
+  loss->bad = 0;
+  loss->dropped = 0;
+}
+
+static inline double lossRandom(lossSimulator *loss) {
+  loss->random ^= loss->random << 13;
+  loss->random ^= loss->random >> 7;
+  loss->random ^= loss->random << 17;
+  return (loss->random >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// whether the next packet is lost
+static inline int lossDrop(lossSimulator *loss) {
+  if(!loss->enter) return 0;
+
+  loss->bad = loss->bad? lossRandom(loss) >= loss->leave: lossRandom(loss) < loss->enter;
+  if(loss->bad) ++loss->dropped;
+  return loss->bad;
+}
+
+#endif
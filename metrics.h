@@ -0,0 +1,238 @@
+#ifndef H_472D38FA_A4B8_423B_BB56_CC432810CD0D
+#define H_472D38FA_A4B8_423B_BB56_CC432810CD0D
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define METRICS_MAGIC 0x524d5034 // "RMP4", changes with the layout
+#define METRICS_DELAY_BINS 128   // arrival delay, 1 ms each
+#define METRICS_FILL_BINS 128    // buffer fill of in-order packets, 2 ms each
+#define METRICS_SIZE_BINS 24     // device write sizes, bin n holds sizes below 2^n bytes
+#define METRICS_ERROR_BINS 256   // distance of in-order packets from where they should land, 0.25 ms each
+
+// Counters, gauges and histograms of a running receiver, kept in shared
+// memory for receiver-stats to read while it plays.
+//
+// Every field has exactly one writing thread, so updates are a relaxed load
+// and store without locked instructions or syscalls; readers only ever see
+// a field's old or new value. Histograms are cumulative counts, readers
+// diff two snapshots to look at an interval.
+struct receiverMetrics_t {
+  uint32_t magic;
+  uint32_t size;
+
+  // network thread
+  atomic_ullong packets;       // audio packets received, before loss simulation
+  atomic_ullong bytes;
+  atomic_ullong queueDropped;  // audio thread not keeping up
+  atomic_ullong fecRecovered;
+  atomic_ullong fecUnrecovered;
+  atomic_ullong simulatedLoss;
+  atomic_ullong nackRequested;
+  atomic_ullong retransmitted;
+  atomic_ullong retransmitTooLate;
+  atomic_ullong gapsExpired;
+  atomic_ullong silenceMarkers; // PACKET_SILENCE, the sender suppressed quiet audio
+  atomic_llong latencyUs;      // current target latency
+  atomic_ullong arrivalDelay[METRICS_DELAY_BINS]; // capture to arrival, synced clocks only
+  atomic_ullong wakeups;
+
+  // audio thread
+  atomic_ullong placed;        // packets handed to placement
+  atomic_ullong latePackets;
+  atomic_ullong tooLate;
+  atomic_ullong resetsAhead;
+  atomic_ullong resetsBehind;
+  atomic_llong localPosition;  // in bytes, of the last in-order packet
+  atomic_llong localPositionAvg;
+  atomic_llong desiredPositionAvg;
+  atomic_llong ratioPpb;       // resampling ratio minus one, in parts per billion
+  atomic_llong driftFrames;    // frames consumed minus frames played, i.e. drift corrected so far
+  atomic_ullong correctedFrames; // frames inserted or dropped by drift correction, in either direction
+  atomic_ullong silenceFrames; // announced silence synthesised for playout
+  atomic_ullong bufferFill[METRICS_FILL_BINS];
+  atomic_ullong playoutError[METRICS_ERROR_BINS];
+  atomic_ullong writes;
+  atomic_ullong writeSizes[METRICS_SIZE_BINS];
+  atomic_llong outputDelayUs;  // device buffering reported for group playout
+
+  // device
+  atomic_ullong xruns;         // ALSA xruns or pulseaudio underflows
+};
+
+typedef struct receiverMetrics_t receiverMetrics;
+
+static inline void metricsInit(receiverMetrics *m) {
+  memset(m, 0, sizeof(*m));
+  m->magic = METRICS_MAGIC;
+  m->size = sizeof(*m);
+}
+
+// single writer only
+static inline void metricsAdd(atomic_ullong *counter, uint64_t n) {
+  atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline void metricsStore(atomic_ullong *counter, uint64_t value) {
+  atomic_store_explicit(counter, value, memory_order_relaxed);
+}
+
+static inline void metricsSet(atomic_llong *gauge, int64_t value) {
+  atomic_store_explicit(gauge, value, memory_order_relaxed);
+}
+
+static inline uint64_t metricsLoad(const atomic_ullong *counter) {
+  return atomic_load_explicit((atomic_ullong *)counter, memory_order_relaxed);
+}
+
+static inline int64_t metricsGet(const atomic_llong *gauge) {
+  return atomic_load_explicit((atomic_llong *)gauge, memory_order_relaxed);
+}
+
+static inline void metricsBin(atomic_ullong *bins, int count, double value) {
+  int bin = value < 0? 0: value >= count? count - 1: (int)value;
+  metricsAdd(&bins[bin], 1);
+}
+
+// Counters and histograms which add up over receivers sharing one device,
+// e.g. the streams of a mixer. Gauges mean nothing summed, and wakeups,
+// writes and xruns belong to the device, so those are left out.
+struct metricsCounter_t {
+  size_t offset;
+  int count;
+};
+
+typedef struct metricsCounter_t metricsCounter;
+
+static const metricsCounter metricsCounters[] = {
+  { offsetof(receiverMetrics, packets), 1 },
+  { offsetof(receiverMetrics, bytes), 1 },
+  { offsetof(receiverMetrics, queueDropped), 1 },
+  { offsetof(receiverMetrics, fecRecovered), 1 },
+  { offsetof(receiverMetrics, fecUnrecovered), 1 },
+  { offsetof(receiverMetrics, simulatedLoss), 1 },
+  { offsetof(receiverMetrics, nackRequested), 1 },
+  { offsetof(receiverMetrics, retransmitted), 1 },
+  { offsetof(receiverMetrics, retransmitTooLate), 1 },
+  { offsetof(receiverMetrics, gapsExpired), 1 },
+  { offsetof(receiverMetrics, silenceMarkers), 1 },
+  { offsetof(receiverMetrics, arrivalDelay), METRICS_DELAY_BINS },
+  { offsetof(receiverMetrics, placed), 1 },
+  { offsetof(receiverMetrics, latePackets), 1 },
+  { offsetof(receiverMetrics, tooLate), 1 },
+  { offsetof(receiverMetrics, resetsAhead), 1 },
+  { offsetof(receiverMetrics, resetsBehind), 1 },
+  { offsetof(receiverMetrics, correctedFrames), 1 },
+  { offsetof(receiverMetrics, silenceFrames), 1 },
+  { offsetof(receiverMetrics, bufferFill), METRICS_FILL_BINS },
+  { offsetof(receiverMetrics, playoutError), METRICS_ERROR_BINS },
+};
+
+// stores the sum of the parts' counters in sum, which may be one of them;
+// single writer of sum only
+static inline void metricsSum(receiverMetrics *sum, const receiverMetrics *const *parts, int count) {
+  for(size_t c = 0; c < sizeof(metricsCounters) / sizeof(metricsCounters[0]); ++c) {
+    for(int i = 0; i < metricsCounters[c].count; ++i) {
+      size_t offset = metricsCounters[c].offset + i * sizeof(atomic_ullong);
+      uint64_t total = 0;
+      for(int p = 0; p < count; ++p) total += metricsLoad((const atomic_ullong *)((const char *)parts[p] + offset));
+      metricsStore((atomic_ullong *)((char *)sum + offset), total);
+    }
+  }
+}
+
+// bin index of a write size, see METRICS_SIZE_BINS
+static inline int metricsSizeBin(size_t size) {
+  int bin = 0;
+  while(size && bin < METRICS_SIZE_BINS - 1) {
+    size >>= 1;
+    ++bin;
+  }
+  return bin;
+}
+
+// copies a histogram, minus an earlier copy if given
+static inline void metricsLoadBins(uint64_t *dst, const atomic_ullong *bins, const uint64_t *previous, int count) {
+  for(int i = 0; i < count; ++i) {
+    dst[i] = metricsLoad(&bins[i]) - (previous? previous[i]: 0);
+  }
+}
+
+// bin below whose upper edge the given fraction of the counts lies
+static inline double metricsPercentile(const uint64_t *bins, int count, double fraction) {
+  uint64_t total = 0;
+  for(int i = 0; i < count; ++i) total += bins[i];
+  if(!total) return 0;
+
+  uint64_t below = 0;
+  for(int i = 0; i < count; ++i) {
+    below += bins[i];
+    if(below >= fraction * total) return i + 1;
+  }
+  return count;
+}
+
+// creates or reuses the shared memory object name, e.g. "/pulse-receiver"
+static inline receiverMetrics *metricsPublish(const char *name) {
+  int fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+  if(fd < 0) {
+    fprintf(stderr, "Failed to open shared memory %s for metrics: %s\n", name, strerror(errno));
+    return NULL;
+  }
+
+  if(ftruncate(fd, sizeof(receiverMetrics))) {
+    fprintf(stderr, "Failed to size shared memory %s for metrics: %s\n", name, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+
+  receiverMetrics *m = mmap(NULL, sizeof(*m), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(m == MAP_FAILED) {
+    fprintf(stderr, "Failed to map shared memory %s for metrics: %s\n", name, strerror(errno));
+    return NULL;
+  }
+
+  metricsInit(m);
+  return m;
+}
+
+static inline const receiverMetrics *metricsAttach(const char *name) {
+  int fd = shm_open(name, O_RDONLY, 0);
+  if(fd < 0) {
+    fprintf(stderr, "Failed to open shared memory %s: %s\n", name, strerror(errno));
+    return NULL;
+  }
+
+  struct stat st;
+  if(fstat(fd, &st) || (size_t)st.st_size < sizeof(receiverMetrics)) {
+    fprintf(stderr, "Shared memory %s holds no receiver metrics.\n", name);
+    close(fd);
+    return NULL;
+  }
+
+  const receiverMetrics *m = mmap(NULL, sizeof(*m), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(m == MAP_FAILED) {
+    fprintf(stderr, "Failed to map shared memory %s: %s\n", name, strerror(errno));
+    return NULL;
+  }
+
+  if(m->magic != METRICS_MAGIC || m->size != sizeof(*m)) {
+    fprintf(stderr, "Shared memory %s was written by another version.\n", name);
+    munmap((void *)m, sizeof(*m));
+    return NULL;
+  }
+
+  return m;
+}
+
+#endif
@@ -0,0 +1,373 @@
+#ifndef H_A29D6CEC_146A_42FD_A685_EBE33E9A8645
+#define H_A29D6CEC_146A_42FD_A685_EBE33E9A8645
+
+#include "format.h"
+#include "receiver.h"
+
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#define MIXER_MAX_STREAMS 8
+#define MIXER_MAX_GAINS 16
+#define MIXER_IDLE 2            // in s without packets before a stream is dropped
+#define MIXER_RESTART 0.1       // in s, the same when its sender restarted, see mixerSuperseded
+#define MIXER_GAIN_ONE 8192     // unity gain of the integer kernels, gains stay below 4
+#define MIXER_CHUNK (RESAMPLER_MAX_FRAMES * FORMAT_MAX_CHANNELS * 4)
+
+// Several senders played on one device, e.g. music and announcements. Every
+// sender address on the UDP socket gets a receiver of its own once a stream
+// header arrives from it, with its own clock synchronisation, senderOffset
+// and drift correction against the one device clock, and the mixer adds up
+// what they render.
+//
+// A stream is its sender host and the stream ID of its stream header (see
+// pulse-sender -i), which also selects the gain. Audio packets carry no ID,
+// so datagrams are matched to streams by full sender address; a sender
+// restarting on a new port shows up as a second stream with the same host
+// and ID, which takes over once the old one falls silent, see
+// mixerSuperseded. Mixing is a plain loop per format over whole buffers,
+// which the compiler turns into SIMD multiplies and saturating adds, so
+// every stream costs one render and one such pass. Single threaded.
+struct mixerStream_t {
+  receiver rx;
+  int active;
+  uint64_t lastPacket; // monotonic nanoseconds
+  char name[64];       // sender address
+};
+
+typedef struct mixerStream_t mixerStream;
+
+struct mixer_t {
+  const receiver *config; // format, target latency and options for every stream
+  mixerStream streams[MIXER_MAX_STREAMS];
+  uint64_t rejected;      // datagrams from senders beyond MIXER_MAX_STREAMS
+
+  // every stream keeps metrics of its own, the config's hold their sums,
+  // see mixerPublishMetrics
+  const char *metricsName;
+  receiverMetrics *published[MIXER_MAX_STREAMS]; // per slot once shared, NULL before
+  receiverMetrics retired; // counters of streams which left
+
+  int gains;
+  uint16_t gainStream[MIXER_MAX_GAINS];
+  float gain[MIXER_MAX_GAINS];
+
+  char datagram[sizeof(dataPacket)];
+  char chunk[MIXER_CHUNK]; // one stream's share of a render
+};
+
+typedef struct mixer_t mixer;
+
+// config stays in use, streams start out as copies of its settings
+static inline void mixerInit(mixer *m, const receiver *config) {
+  m->config = config;
+  for(int i = 0; i < MIXER_MAX_STREAMS; ++i) m->streams[i].active = 0;
+  m->rejected = 0;
+  m->gains = 0;
+
+  m->metricsName = NULL;
+  for(int i = 0; i < MIXER_MAX_STREAMS; ++i) m->published[i] = NULL;
+  metricsInit(&m->retired);
+}
+
+// after receiverPublishMetrics of the config: also shares each stream's own
+// metrics, gauges included, as name.0, name.1 and so on for receiver-stats
+static inline void mixerPublishMetrics(mixer *m, const char *name) {
+  m->metricsName = name;
+}
+
+// parses "id:dB", e.g. "2:-12" to play stream 2 at a quarter of its level
+static inline int mixerParseGain(mixer *m, const char *spec) {
+  const char *colon = strchr(spec, ':');
+  double level = colon? atof(colon + 1): 1;
+  if(!colon || level >= 12 || m->gains == MIXER_MAX_GAINS) {
+    fprintf(stderr, "Invalid stream gain %s, expected stream:dB below 12 dB, for at most %d streams.\n",
+        spec, MIXER_MAX_GAINS);
+    return -1;
+  }
+
+  m->gainStream[m->gains] = atoi(spec);
+  m->gain[m->gains] = pow(10, level / 20);
+  ++m->gains;
+  return 0;
+}
+
+static inline float mixerGain(const mixer *m, const mixerStream *s) {
+  if(!s->rx.haveStreamHeader) return 1;
+
+  for(int i = 0; i < m->gains; ++i) {
+    if(m->gainStream[i] == s->rx.stream.stream) return m->gain[i];
+  }
+  return 1;
+}
+
+static inline int mixerStart(mixer *m, mixerStream *s, const struct sockaddr_storage *peer, socklen_t peerLength) {
+  const receiver *config = m->config;
+  int slot = s - m->streams;
+  if(receiverInit(&s->rx, &config->format, config->targetLatency)) {
+    fprintf(stderr, "Failed to allocate playout buffer.\n");
+    return -1;
+  }
+
+  if(m->metricsName && !m->published[slot]) {
+    char name[256];
+    snprintf(name, sizeof(name), "%s.%d", m->metricsName, slot);
+    m->published[slot] = metricsPublish(name); // the stream keeps its private metrics on failure
+  }
+  if(m->published[slot]) {
+    metricsInit(m->published[slot]);
+    s->rx.metrics = m->published[slot];
+    metricsSet(&s->rx.metrics->latencyUs, config->targetLatency * 1000000);
+  }
+
+  s->rx.fixedFormat = 1;
+  s->rx.datagrams = 1;
+  s->rx.adaptive = config->adaptive;
+  s->rx.latencyPercentile = config->latencyPercentile;
+  s->rx.latencyMargin = config->latencyMargin;
+  s->rx.loss = config->loss;
+  lossSeed(&s->rx.loss, slot);
+  s->rx.debugRate = config->debugRate;
+  s->rx.group = config->group;
+  s->rx.outputDelay = config->outputDelay;
+  memcpy(&s->rx.peer, peer, peerLength);
+  s->rx.peerLength = peerLength;
+
+  char host[NI_MAXHOST], port[NI_MAXSERV];
+  if(getnameinfo((const struct sockaddr *)peer, peerLength, host, sizeof(host), port, sizeof(port),
+      NI_NUMERICHOST | NI_NUMERICSERV)) {
+    strcpy(host, "?");
+    strcpy(port, "?");
+  }
+  snprintf(s->name, sizeof(s->name), "%s:%s", host, port);
+  fprintf(stderr, "Stream from %s joined.\n", s->name);
+
+  s->active = 1;
+  return 0;
+}
+
+static inline void mixerStop(mixer *m, mixerStream *s) {
+  if(s->rx.haveStreamHeader) {
+    fprintf(stderr, "Stream %u from %s left.\n", s->rx.stream.stream, s->name);
+  } else {
+    fprintf(stderr, "Stream unknown from %s left.\n", s->name);
+  }
+
+  const receiverMetrics *parts[2] = { &m->retired, s->rx.metrics };
+  metricsSum(&m->retired, parts, 2);
+  playoutFree(&s->rx.playout);
+  s->active = 0;
+}
+
+// whether a datagram from an unknown sender may start a stream: only a
+// stream header does, not stray back channel answers or garbage
+static inline int mixerStartsStream(const char *data, size_t len) {
+  framedPacket frame;
+  const char *payload;
+  size_t payloadLen;
+  if(framingParseDatagram(data, len, &frame, &payload, &payloadLen) < 0) return 0;
+
+  return frame.version == PROTOCOL_VERSION && frame.type == PACKET_STREAM_HEADER &&
+    payloadLen >= sizeof(streamHeader);
+}
+
+// the stream a datagram belongs to, a new one for an unknown sender's
+// stream header, NULL to ignore the datagram
+static inline mixerStream *mixerFind(mixer *m, const struct sockaddr_storage *peer, socklen_t peerLength,
+    const char *data, size_t len) {
+  mixerStream *free = NULL;
+
+  for(int i = 0; i < MIXER_MAX_STREAMS; ++i) {
+    mixerStream *s = &m->streams[i];
+    if(!s->active) {
+      if(!free) free = s;
+      continue;
+    }
+    if(s->rx.peerLength == peerLength && !memcmp(&s->rx.peer, peer, peerLength)) return s;
+  }
+
+  if(!mixerStartsStream(data, len)) return NULL;
+  if(!free) {
+    if(!m->rejected++) fprintf(stderr, "Already mixing %d streams, ignoring further senders.\n", MIXER_MAX_STREAMS);
+    return NULL;
+  }
+
+  return mixerStart(m, free, peer, peerLength)? NULL: free;
+}
+
+static inline int mixerSameHost(const struct sockaddr_storage *a, const struct sockaddr_storage *b) {
+  if(a->ss_family != b->ss_family) return 0;
+
+  if(a->ss_family == AF_INET) {
+    return !memcmp(&((const struct sockaddr_in *)a)->sin_addr, &((const struct sockaddr_in *)b)->sin_addr,
+        sizeof(struct in_addr));
+  }
+  if(a->ss_family == AF_INET6) {
+    return !memcmp(&((const struct sockaddr_in6 *)a)->sin6_addr, &((const struct sockaddr_in6 *)b)->sin6_addr,
+        sizeof(struct in6_addr));
+  }
+  return 0;
+}
+
+// whether a stream with the same host and ID has had packets more recently,
+// i.e. s's sender restarted on another port and s is only waiting out
+// MIXER_IDLE; two live senders of one ID keep each other alive
+static inline const mixerStream *mixerSuperseded(const mixer *m, const mixerStream *s) {
+  if(!s->rx.haveStreamHeader) return NULL;
+
+  for(int i = 0; i < MIXER_MAX_STREAMS; ++i) {
+    const mixerStream *t = &m->streams[i];
+    if(t == s || !t->active || !t->rx.haveStreamHeader || t->rx.stream.stream != s->rx.stream.stream) continue;
+
+    if(t->lastPacket > s->lastPacket && mixerSameHost(&t->rx.peer, &s->rx.peer)) return t;
+  }
+  return NULL;
+}
+
+// processes everything readable on the (non-blocking) UDP socket, the
+// streams answer their senders over it
+static inline void mixerReceive(mixer *m, int fd) {
+  uint64_t now = monotonicNow();
+
+  while(1) {
+    struct sockaddr_storage peer;
+    socklen_t peerLength = sizeof(peer);
+    ssize_t len = recvfrom(fd, m->datagram, sizeof(m->datagram), 0, (struct sockaddr *)&peer, &peerLength);
+    if(len < 0) {
+      if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+
+      fprintf(stderr, "Failed to receive packet: %s\n", strerror(errno));
+      break;
+    }
+
+    mixerStream *s = mixerFind(m, &peer, peerLength, m->datagram, len);
+    if(!s) continue;
+
+    s->lastPacket = now;
+    receiveDatagram(&s->rx, m->datagram, len);
+  }
+
+  for(int i = 0; i < MIXER_MAX_STREAMS; ++i) {
+    if(m->streams[i].active) receiverServeBackChannel(&m->streams[i].rx, fd);
+  }
+}
+
+// for group playout, see receiverSetOutputDelay
+static inline void mixerSetOutputDelay(mixer *m, uint64_t delay) {
+  for(int i = 0; i < MIXER_MAX_STREAMS; ++i) {
+    if(m->streams[i].active) receiverSetOutputDelay(&m->streams[i].rx, delay);
+  }
+}
+
+static inline void mixerAddS16(char *out, const char *in, size_t samples, int16_t gain) {
+  for(size_t i = 0; i < samples; ++i) {
+    int16_t a, x;
+    memcpy(&a, out + 2 * i, sizeof(a));
+    memcpy(&x, in + 2 * i, sizeof(x));
+
+    int32_t sum = a + ((x * gain) >> 13);
+    int16_t s = sum > 32767? 32767: sum < -32768? -32768: sum;
+    memcpy(out + 2 * i, &s, sizeof(s));
+  }
+}
+
+// like mixerAddS16 on packed 24 bit samples; the byte shuffles this takes
+// need SSSE3, the baseline x86-64 build runs it as a branch-free scalar loop
+static inline void mixerAddS24(char *out, const char *in, size_t samples, float gain) {
+  for(size_t i = 0; i < samples; ++i) {
+    const unsigned char *a = (const unsigned char *)out + 3 * i, *x = (const unsigned char *)in + 3 * i;
+    int32_t mixed = (int32_t)((uint32_t)a[0] << 8 | (uint32_t)a[1] << 16 | (uint32_t)a[2] << 24) >> 8;
+    int32_t sample = (int32_t)((uint32_t)x[0] << 8 | (uint32_t)x[1] << 16 | (uint32_t)x[2] << 24) >> 8;
+
+    int32_t sum = mixed + (int32_t)(sample * gain);
+    int32_t s = sum > 8388607? 8388607: sum < -8388608? -8388608: sum;
+    out[3 * i] = s;
+    out[3 * i + 1] = s >> 8;
+    out[3 * i + 2] = s >> 16;
+  }
+}
+
+static inline void mixerAddFloat(char *out, const char *in, size_t samples, float gain) {
+  for(size_t i = 0; i < samples; ++i) {
+    float a, x;
+    memcpy(&a, out + 4 * i, sizeof(a));
+    memcpy(&x, in + 4 * i, sizeof(x));
+
+    a += x * gain;
+    memcpy(out + 4 * i, &a, sizeof(a));
+  }
+}
+
+// adds len bytes of in, scaled by gain, to out; integer formats saturate,
+// float is left for the device to clip
+static inline void mixerAdd(int format, char *out, const char *in, size_t len, float gain) {
+  switch(format) {
+    case SAMPLE_S16LE:
+      mixerAddS16(out, in, len / 2, gain * MIXER_GAIN_ONE + 0.5f);
+      break;
+    case SAMPLE_FLOAT32LE:
+      mixerAddFloat(out, in, len / 4, gain);
+      break;
+    default:
+      mixerAddS24(out, in, len / 3, gain);
+      break;
+  }
+}
+
+// renders len bytes of the mix, len holding whole frames, and publishes the
+// streams' summed counters in the config's metrics; streams which
+// have gone quiet for MIXER_IDLE are dropped here, as nothing else runs
+// once their packets stop
+static inline void mixerRender(mixer *m, char *out, size_t len) {
+  const audioFormat *format = &m->config->format;
+  size_t chunk = sizeof(m->chunk) / m->config->frameBytes * m->config->frameBytes;
+  uint64_t now = monotonicNow();
+
+  memset(out, 0, len);
+
+  for(int i = 0; i < MIXER_MAX_STREAMS; ++i) {
+    mixerStream *s = &m->streams[i];
+    if(!s->active) continue;
+
+    if(now > s->lastPacket + MIXER_IDLE * 1000000000ull) {
+      mixerStop(m, s);
+      continue;
+    }
+
+    const mixerStream *successor = mixerSuperseded(m, s);
+    if(successor && now > s->lastPacket + (uint64_t)(MIXER_RESTART * 1000000000)) {
+      fprintf(stderr, "Stream %u restarted from %s.\n", s->rx.stream.stream, successor->name);
+      mixerStop(m, s);
+      continue;
+    }
+
+    float gain = mixerGain(m, s);
+    for(size_t done = 0; done < len; done += chunk) {
+      size_t piece = len - done < chunk? len - done: chunk;
+      receiverRender(&s->rx, m->chunk, piece);
+      mixerAdd(format->format, out + done, m->chunk, piece, gain);
+    }
+  }
+
+  // the streams' renders are not device writes, the mix is
+  receiverMetrics *metrics = m->config->metrics;
+  metricsAdd(&metrics->writes, 1);
+  metricsAdd(&metrics->writeSizes[metricsSizeBin(len)], 1);
+
+  const receiverMetrics *parts[1 + MIXER_MAX_STREAMS];
+  int count = 0;
+  parts[count++] = &m->retired;
+  for(int i = 0; i < MIXER_MAX_STREAMS; ++i) {
+    if(m->streams[i].active) parts[count++] = m->streams[i].rx.metrics;
+  }
+  metricsSum(metrics, parts, count);
+}
+
+#endif
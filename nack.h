@@ -0,0 +1,198 @@
+#ifndef H_3B733F9C_58C3_453D_840B_6129A2FA47EC
+#define H_3B733F9C_58C3_453D_840B_6129A2FA47EC
+
+#include "common.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HISTORY_PACKETS 1024
+#define NACK_MAX_GAPS 32
+#define NACK_MAX_RANGES NACK_MAX_GAPS        // per PACKET_NACK
+#define NACK_RETRY_INTERVAL 20000000ull     // ns between requests for the same gap
+#define NACK_MAX_TRIES 3
+
+struct historyEntry_t {
+  uint64_t position;
+  uint64_t time;
+  size_t length; // 0 if unused
+};
+
+typedef struct historyEntry_t historyEntry;
+
+// Sender side: copies of recently sent audio for answering NACKs. Audio is
+// kept in a byte ring indexed by stream position, packet boundaries and
+// times in a ring of entries, so retransmissions match the originals.
+struct senderHistory_t {
+  char *data;
+  size_t size; // a power of two
+  historyEntry entries[HISTORY_PACKETS];
+  int next;
+};
+
+typedef struct senderHistory_t senderHistory;
+
+static inline int historyInit(senderHistory *h, size_t minimumSize) {
+  size_t size = 1;
+  while(size < minimumSize) size *= 2;
+
+  h->data = calloc(size, 1);
+  if(!h->data) return -1;
+
+  h->size = size;
+  for(int i = 0; i < HISTORY_PACKETS; ++i) h->entries[i].length = 0;
+  h->next = 0;
+  return 0;
+}
+
+static inline void historyAdd(senderHistory *h, uint64_t position, const char *data, size_t len, uint64_t time) {
+  historyEntry *e = &h->entries[h->next];
+  h->next = (h->next + 1) % HISTORY_PACKETS;
+  e->length = 0;
+  if(len > h->size) return;
+
+  size_t offset = position & (h->size - 1);
+  size_t first = len < h->size - offset? len: h->size - offset;
+  memcpy(h->data + offset, data, first);
+  memcpy(h->data, data + first, len - first);
+
+  e->position = position;
+  e->time = time;
+  e->length = len;
+}
+
+// whether the entry's audio is still there, end being the sender's position
+static inline int historyValid(const senderHistory *h, const historyEntry *e, uint64_t end) {
+  return e->length && end - e->position <= h->size;
+}
+
+struct nackGap_t {
+  uint64_t position;
+  uint64_t length;
+  uint64_t deadline; // local ns since the epoch after which filling it is pointless
+  uint64_t sent;     // last request
+  int tries;
+};
+
+typedef struct nackGap_t nackGap;
+
+// Receiver side: notices holes in the stream positions of arriving packets
+// and decides when to ask for them, until they are filled or can no longer
+// make their playout deadline.
+struct nackTracker_t {
+  int started;
+  uint64_t next; // end of the newest packet seen
+  nackGap gaps[NACK_MAX_GAPS];
+  int count;
+
+  uint64_t requested;     // ranges sent, including repeats
+  uint64_t retransmitted; // retransmissions which arrived in time
+  uint64_t tooLate;       // retransmissions which missed their deadline
+  uint64_t expired;       // gaps given up on
+};
+
+typedef struct nackTracker_t nackTracker;
+
+static inline void nackInit(nackTracker *t) {
+  t->started = 0;
+  t->next = 0;
+  t->count = 0;
+  t->requested = 0;
+  t->retransmitted = 0;
+  t->tooLate = 0;
+  t->expired = 0;
+}
+
+static inline void nackRemove(nackTracker *t, int i) {
+  t->gaps[i] = t->gaps[--t->count];
+}
+
+// removes whatever part of the gaps the packet covers
+static inline void nackFill(nackTracker *t, uint64_t position, uint64_t length) {
+  uint64_t end = position + length;
+
+  for(int i = 0; i < t->count; ++i) {
+    nackGap *g = &t->gaps[i];
+    uint64_t gapEnd = g->position + g->length;
+    if(end <= g->position || position >= gapEnd) continue;
+
+    if(position <= g->position && end >= gapEnd) {
+      nackRemove(t, i--);
+    } else if(position <= g->position) {
+      g->position = end;
+      g->length = gapEnd - end;
+    } else {
+      g->length = position - g->position;
+      if(end < gapEnd && t->count < NACK_MAX_GAPS) {
+        nackGap *rest = &t->gaps[t->count++];
+        *rest = *g;
+        rest->position = end;
+        rest->length = gapEnd - end;
+      }
+    }
+  }
+}
+
+// to be called for every packet received, deadline being that of the
+// packet's first byte; gaps further than window away from the newest packet
+// are taken as a restarted stream instead
+static inline void nackArrived(nackTracker *t, uint64_t position, uint64_t length, uint64_t deadline,
+    double bytesPerSecond, uint64_t window) {
+  uint64_t end = position + length;
+
+  if(!t->started || end + window < t->next || position > t->next + window) {
+    t->started = 1;
+    t->next = end;
+    t->count = 0;
+    return;
+  }
+
+  if(position > t->next) {
+    if(t->count < NACK_MAX_GAPS) {
+      nackGap *g = &t->gaps[t->count++];
+      g->position = t->next;
+      g->length = position - t->next;
+      // the missing audio plays before the packet, by the gap's duration
+      uint64_t ahead = g->length / bytesPerSecond * 1000000000;
+      g->deadline = deadline > ahead? deadline - ahead: 0;
+      g->sent = 0;
+      g->tries = 0;
+    }
+  } else {
+    nackFill(t, position, length);
+  }
+
+  if(end > t->next) t->next = end;
+}
+
+// drops hopeless gaps and returns the ones to be requested now
+static inline int nackDue(nackTracker *t, uint64_t now, nackRange *ranges, int max) {
+  int n = 0;
+
+  for(int i = 0; i < t->count; ++i) {
+    nackGap *g = &t->gaps[i];
+    int waited = now - g->sent >= NACK_RETRY_INTERVAL;
+
+    if(now > g->deadline || (g->tries == NACK_MAX_TRIES && waited)) {
+      ++t->expired;
+      nackRemove(t, i--);
+      continue;
+    }
+
+    if(g->tries < NACK_MAX_TRIES && waited && n < max) {
+      ranges[n].position = g->position;
+      ranges[n].length = g->length;
+      ranges[n].reserved = 0;
+      ++n;
+
+      g->sent = now;
+      ++g->tries;
+    }
+  }
+
+  t->requested += n;
+  return n;
+}
+
+#endif
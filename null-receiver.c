@@ -0,0 +1,414 @@
+#include "common.h"
+
+#define __USE_BSD 1
+#define __USE_POSIX 1
+#define __USE_POSIX199309 1
+#define __USE_MISC 1
+#define __USE_POSIX2 1
+#define __USE_XOPEN2K 1
+#define __USE_XOPEN_EXTENDED 1
+#define __USE_XOPEN2K8 1
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+
+#include "format.h"
+#include "mixer.h"
+#include "receiver.h"
+#include "transport.h"
+
+#define WAV_HEADER_SIZE 44
+#define ONSET_QUIET 0.1 // in s of digital silence before playback counts as resuming
+#define IGN(x) __##x __attribute__((unused))
+
+// Receiver without a sound card: a sink clocked by CLOCK_MONOTONIC takes a
+// period of audio whenever one is due, optionally running fast or slow, and
+// either drops it or appends it to a WAV file. Meant for benchmarks and
+// tests, everything up to the device is the same as in the other receivers.
+// For group playout tests the sink can pretend to buffer like a real device
+// and log when audio resumes after silence, see skew-meter. With -x it mixes
+// every sender on its UDP port instead, see mixer.h.
+
+volatile sig_atomic_t running;
+
+double targetLatency = 0.05;  // in s
+receiver rx;
+int mixing;
+mixer mix;
+
+double periodTime = 0.01; // in s
+double skew = 0;          // sink clock deviation, in ppm
+size_t periodBytes;
+char *periodBuffer;
+uint64_t clockStart;      // monotonic nanoseconds at which period 0 was due
+uint64_t periods;
+
+int wavFd = -1;
+uint64_t wavBytes;
+
+double deviceDelay = 0;   // in s, how long the simulated device takes to play what it is given
+FILE *onsetFile;
+uint64_t quietFrames;     // digital silence played in a row
+
+static void put16(char *p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void put32(char *p, uint32_t v) {
+  put16(p, v);
+  put16(p + 2, v >> 16);
+}
+
+// (re)starts the WAV file in the current format, sizes are filled in by wavFinish
+int wavStart() {
+  char header[WAV_HEADER_SIZE];
+  memcpy(header, "RIFF", 4);
+  put32(header + 4, WAV_HEADER_SIZE - 8);
+  memcpy(header + 8, "WAVEfmt ", 8);
+  put32(header + 16, 16);
+  put16(header + 20, rx.format.format == SAMPLE_FLOAT32LE? 3: 1);
+  put16(header + 22, rx.format.channels);
+  put32(header + 24, rx.format.rate);
+  put32(header + 28, bytesPerSecond(&rx.format));
+  put16(header + 32, rx.frameBytes);
+  put16(header + 34, sampleBytes(rx.format.format) * 8);
+  memcpy(header + 36, "data", 4);
+  put32(header + 40, 0);
+
+  wavBytes = 0;
+  if(ftruncate(wavFd, 0) || pwrite(wavFd, header, sizeof(header), 0) != sizeof(header)) {
+    fprintf(stderr, "Failed to write WAV header: %s\n", strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+void wavFinish() {
+  uint64_t bytes = wavBytes < 0xffffffffu - WAV_HEADER_SIZE? wavBytes: 0xffffffffu - WAV_HEADER_SIZE;
+  char size[4];
+
+  put32(size, WAV_HEADER_SIZE - 8 + bytes);
+  if(pwrite(wavFd, size, 4, 4) != 4) fprintf(stderr, "Failed to finish WAV file: %s\n", strerror(errno));
+  put32(size, bytes);
+  if(pwrite(wavFd, size, 4, 40) != 4) fprintf(stderr, "Failed to finish WAV file: %s\n", strerror(errno));
+}
+
+// sizes the period for the receiver's current format and restarts the sink clock
+int openSink() {
+  periodBytes = (size_t)(rx.format.rate * periodTime) * rx.frameBytes;
+  if(!periodBytes) periodBytes = rx.frameBytes;
+
+  // like pulse-receiver's writes, a period takes at most a quarter of the playout buffer
+  size_t limit = frameAlign(rx.playout.size / 4, rx.frameBytes);
+  if(periodBytes > limit) {
+    periodBytes = limit;
+    fprintf(stderr, "Period capped at %.1f ms by the playout buffer.\n",
+        1000.0 * periodBytes / bytesPerSecond(&rx.format));
+  }
+
+  free(periodBuffer);
+  periodBuffer = malloc(periodBytes);
+  if(!periodBuffer) {
+    fprintf(stderr, "Failed to allocate period buffer.\n");
+    return -1;
+  }
+
+  clockStart = monotonicNow();
+  periods = 0;
+
+  if(wavFd >= 0) return wavStart();
+  return 0;
+}
+
+uint64_t periodDue(uint64_t period) {
+  double frames = periodBytes / rx.frameBytes;
+  return clockStart + period * frames * 1000000000 / rx.format.rate / (1 + skew / 1000000);
+}
+
+// logs the local time at which the first loud frame after ONSET_QUIET of
+// digital silence is heard, in ns
+void logOnsets(uint64_t heardAt) {
+  size_t frames = periodBytes / rx.frameBytes;
+
+  for(size_t f = 0; f < frames; ++f) {
+    if(silenceAllZero(periodBuffer + f * rx.frameBytes, rx.frameBytes)) {
+      ++quietFrames;
+      continue;
+    }
+
+    if(quietFrames >= ONSET_QUIET * rx.format.rate) {
+      uint64_t heard = heardAt + f * 1000000000ull / rx.format.rate;
+      fprintf(onsetFile, "%llu\n", (unsigned long long)heard);
+    }
+    quietFrames = 0;
+  }
+}
+
+void writeAudio() {
+  // the simulated device plays a period deviceDelay after it is due, however
+  // late the main loop gets around to rendering it, and says so like a real
+  // one would
+  uint64_t heardAt = 0;
+  if(rx.group || onsetFile) {
+    uint64_t now = realtimeNow();
+    heardAt = now + (int64_t)(periodDue(periods) - monotonicNow()) + (uint64_t)(deviceDelay * 1000000000);
+    receiverSetOutputDelay(&rx, heardAt > now? heardAt - now: 0);
+    if(mixing) mixerSetOutputDelay(&mix, rx.outputDelay);
+  }
+
+  if(mixing) {
+    mixerRender(&mix, periodBuffer, periodBytes);
+  } else {
+    receiverRender(&rx, periodBuffer, periodBytes);
+  }
+  ++periods;
+
+  if(onsetFile) logOnsets(heardAt);
+
+  if(wavFd < 0) return;
+
+  if(pwrite(wavFd, periodBuffer, periodBytes, WAV_HEADER_SIZE + wavBytes) != (ssize_t)periodBytes) {
+    fprintf(stderr, "Failed to write WAV data: %s\n", strerror(errno));
+    running = 0;
+    return;
+  }
+  wavBytes += periodBytes;
+}
+
+void followFormat() {
+  if(!receiverFollowFormat(&rx)) return;
+
+  if(wavFd >= 0) fprintf(stderr, "Stream format changed, starting the WAV file over.\n");
+  if(openSink()) running = 0;
+}
+
+void stop(int IGN(signal)) {
+  running = 0;
+}
+
+uint64_t cpuTime() {
+  struct timespec t;
+  if(clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t)) {
+    fprintf(stderr, "Failed to get cpu time: %s\n", strerror(errno));
+  }
+
+  return (uint64_t)(t.tv_sec) * 1000000000 + t.tv_nsec;
+}
+
+// summary for make bench, from the receiver's metrics
+void report(double seconds) {
+  const receiverMetrics *m = rx.metrics;
+  uint64_t error[METRICS_ERROR_BINS];
+  metricsLoadBins(error, m->playoutError, NULL, METRICS_ERROR_BINS);
+
+  fprintf(stderr, "Played %.1f s: CPU %.3f ms per audio second, %.1f wakeups per audio second, "
+      "playout error p50 %.2f ms p99 %.2f ms, %llu frames corrected for drift, %llu late, %llu resets\n",
+      seconds, cpuTime() / 1000000.0 / seconds, metricsLoad(&m->wakeups) / seconds,
+      metricsPercentile(error, METRICS_ERROR_BINS, 0.5) / 4, metricsPercentile(error, METRICS_ERROR_BINS, 0.99) / 4,
+      (unsigned long long)metricsLoad(&m->correctedFrames),
+      (unsigned long long)(metricsLoad(&m->latePackets) + metricsLoad(&m->tooLate)),
+      (unsigned long long)(metricsLoad(&m->resetsAhead) + metricsLoad(&m->resetsBehind)));
+}
+
+int main(int argc, char **argv) {
+  int reportWakeups = 0;
+  int reportBench = 0;
+  double stopAfter = 0;
+  char *listenAddress = NULL;
+  char *wavPath = NULL;
+  audioFormat format = defaultFormat;
+  int fixedFormat = 0;
+  lossSimulator loss;
+  int adaptive = 0;
+  char *metricsName = NULL;
+  char *tracePath = NULL;
+  int verbose = 0;
+  double latencyPercentile = 0.99, latencyMargin = 0.01;
+  int group = 0;
+  char *onsetPath = NULL;
+  int opt;
+
+  lossInit(&loss);
+  mixerInit(&mix, &rx);
+
+  while((opt = getopt(argc, argv, "wu:f:l:a:M:vo:p:k:s:rT:gd:e:xX:")) != -1) {
+    switch(opt) {
+      case 'l':
+        if(lossParse(&loss, optarg)) return 1;
+        break;
+      case 'M': metricsName = optarg; break;
+      case 'T': tracePath = optarg; break;
+      case 'v': verbose = 1; break;
+      case 'a':
+        if(parseJitterTarget(optarg, &latencyPercentile, &latencyMargin)) return 1;
+        adaptive = 1;
+        break;
+      case 'f':
+        if(parseFormat(optarg, &format)) return 1;
+        fixedFormat = 1;
+        break;
+      case 'o': wavPath = optarg; break;
+      case 'p': periodTime = atof(optarg) / 1000; break;
+      case 'k': skew = atof(optarg); break;
+      case 's': stopAfter = atof(optarg); break;
+      case 'r': reportBench = 1; break;
+      case 'w': reportWakeups = 1; break;
+      case 'u': listenAddress = optarg; break;
+      case 'g': group = 1; break;
+      case 'd': deviceDelay = atof(optarg) / 1000; break;
+      case 'e': onsetPath = optarg; break;
+      case 'x': mixing = 1; break;
+      case 'X':
+        if(mixerParseGain(&mix, optarg)) return 1;
+        break;
+      default:
+        fprintf(stderr, "Usage: ./null-receiver [-w] [-u [host:]port] [-f format] [-l loss] [-a percentile] [-M name] [-T file] [-v] [-o file] [-p ms] [-k ppm] [-s seconds] [-r] [-g] [-d ms] [-e file] [-x] [-X id:dB] [target latency]\n");
+        fprintf(stderr, "  -w  report main loop wakeups per second\n");
+        fprintf(stderr, "  -u  receive UDP datagrams on the given port instead of reading stdin\n");
+        fprintf(stderr, "  -f  play only format[:channels[:rate]] instead of following the stream\n");
+        fprintf(stderr, "  -l  drop percent[:mean burst length] of incoming packets, to test loss handling\n");
+        fprintf(stderr, "  -a  adapt the target latency to percentile[:margin ms] of the arrival delay, e.g. 99:10,\n");
+        fprintf(stderr, "      the target latency given becomes the upper limit\n");
+        fprintf(stderr, "  -M  publish metrics in shared memory under this name, for receiver-stats\n");
+        fprintf(stderr, "  -T  record incoming packets with their arrival times to this file, for trace-replay\n");
+        fprintf(stderr, "  -v  print a status line every 256 packets\n");
+        fprintf(stderr, "  -o  write what is played to this WAV file instead of dropping it\n");
+        fprintf(stderr, "  -p  period of the sink clock in ms, default 10\n");
+        fprintf(stderr, "  -k  run the sink clock this many ppm fast, or slow if negative\n");
+        fprintf(stderr, "  -s  stop after this many seconds of audio\n");
+        fprintf(stderr, "  -r  print CPU time, wakeups, playout error and drift corrections at exit\n");
+        fprintf(stderr, "  -g  group playout: be heard in step with other receivers of the stream, needs -u\n");
+        fprintf(stderr, "  -d  pretend the device plays audio this many ms after it is rendered\n");
+        fprintf(stderr, "  -e  log when audio resumes after silence to this file, for skew-meter\n");
+        fprintf(stderr, "  -x  mix every sender on the UDP port, each in the output format, needs -u,\n");
+        fprintf(stderr, "      -M publishes the sums and each stream's own metrics as name.0, name.1 and so on\n");
+        fprintf(stderr, "  -X  play stream id at this gain in dB when mixing, e.g. 2:-12, repeat it\n");
+        return 1;
+    }
+  }
+
+  if(argc - optind != 1 || periodTime <= 0 || deviceDelay < 0) {
+    fprintf(stderr, "Usage: ./null-receiver [-w] [-u [host:]port] [-f format] [-l loss] [-a percentile] [-M name] [-T file] [-v] [-o file] [-p ms] [-k ppm] [-s seconds] [-r] [-g] [-d ms] [-e file] [-x] [-X id:dB] [target latency]\n");
+    return 1;
+  }
+
+  if(group && (!listenAddress || adaptive)) {
+    fprintf(stderr, "Group playout needs UDP input for a shared clock and a fixed target latency.\n");
+    return 1;
+  }
+
+  if(mixing && (!listenAddress || tracePath)) {
+    fprintf(stderr, "Mixing needs UDP input and records no trace.\n");
+    return 1;
+  }
+
+  targetLatency = atof(argv[optind]);
+  fprintf(stderr, "Target latency: %f\n", targetLatency);
+
+  if(receiverInit(&rx, &format, targetLatency)) {
+    fprintf(stderr, "Failed to allocate playout buffer.\n");
+    return 1;
+  }
+  rx.loss = loss;
+  rx.adaptive = adaptive;
+  rx.latencyPercentile = latencyPercentile;
+  rx.latencyMargin = latencyMargin;
+  if(verbose) rx.debugRate = 256;
+  if(metricsName) receiverPublishMetrics(&rx, metricsName);
+  if(mixing && metricsName) mixerPublishMetrics(&mix, metricsName);
+  if(tracePath && receiverRecord(&rx, tracePath)) return 1;
+  rx.fixedFormat = fixedFormat;
+  rx.reportWakeups = reportWakeups;
+  rx.group = group;
+
+  if(wavPath) {
+    wavFd = open(wavPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(wavFd < 0) {
+      fprintf(stderr, "Failed to open %s: %s\n", wavPath, strerror(errno));
+      return 1;
+    }
+  }
+
+  if(onsetPath) {
+    onsetFile = fopen(onsetPath, "w");
+    if(!onsetFile) {
+      fprintf(stderr, "Failed to open %s: %s\n", onsetPath, strerror(errno));
+      return 1;
+    }
+  }
+
+  if(openSink()) return 1;
+
+  int inputFd = 0;
+  if(listenAddress) {
+    inputFd = udpOpen(listenAddress, 1);
+    if(inputFd < 0) return 1;
+
+    rx.datagrams = 1;
+  }
+
+  if(fcntl(inputFd, F_SETFL, O_NONBLOCK)) {
+    fprintf(stderr, "Could not enable non-blocking mode for input: %s\n", strerror(errno));
+    return 1;
+  }
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = stop;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  struct pollfd input;
+  input.fd = inputFd;
+  input.events = POLLIN;
+
+  double played = 0;
+  running = 1;
+
+  while(running) {
+    uint64_t due = periodDue(periods);
+    uint64_t now = monotonicNow();
+
+    if(now >= due) {
+      writeAudio();
+      played += (double)periodBytes / bytesPerSecond(&rx.format);
+      if(stopAfter && played >= stopAfter) running = 0;
+      continue;
+    }
+
+    if(poll(&input, 1, (due - now + 999999) / 1000000) < 0) {
+      if(errno == EINTR) continue;
+
+      fprintf(stderr, "Could not wait for events: %s\n", strerror(errno));
+      return 1;
+    }
+    receiverWakeup(&rx);
+
+    if(input.revents && mixing) {
+      mixerReceive(&mix, inputFd);
+    } else if(input.revents) {
+      if(!receiveInput(&rx, inputFd)) running = 0;
+      followFormat();
+    }
+  }
+
+  if(wavFd >= 0) {
+    wavFinish();
+    close(wavFd);
+  }
+
+  if(onsetFile) fclose(onsetFile);
+  if(reportBench && played > 0) report(played);
+
+  return 0;
+}
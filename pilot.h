@@ -0,0 +1,95 @@
+#ifndef H_A3F1C6D2_58B4_4E0F_9C27_D14E8B30A6F5
+#define H_A3F1C6D2_58B4_4E0F_9C27_D14E8B30A6F5
+
+#include "format.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define PILOT_REANCHOR 0.002 // in s, how far the audio clock may drift from the system clock
+
+// Pseudo-noise pilot for measuring latency while streaming. Every frame
+// captured at a given system time gets the chip of that time's frame index
+// since the epoch, so a listener with a synchronised clock can correlate
+// what it records against the chips it expects and read off the delay,
+// without talking to the sender. The sequence never repeats, any delay up to
+// the correlator's window is unambiguous.
+//
+// Indices follow the audio clock and only snap back to the system clock when
+// both have drifted apart by PILOT_REANCHOR.
+struct pilot_t {
+  float amplitude; // in the format's scale, see sampleScale
+  uint32_t rate;
+  int anchored;
+  int64_t index;   // chip of the next frame
+  uint64_t reanchored;
+};
+
+typedef struct pilot_t pilot;
+
+static inline void pilotInit(pilot *p, double level, const audioFormat *format) {
+  p->amplitude = sampleScale(format->format) * pow(10, level / 20);
+  p->rate = format->rate;
+  p->anchored = 0;
+  p->index = 0;
+  p->reanchored = 0;
+}
+
+// +1 or -1, 64 chips per hash
+static inline int pilotChip(int64_t index) {
+  uint64_t x = (uint64_t)(index >> 6) + 0x9E3779B97F4A7C15ull;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+  x ^= x >> 31;
+  return (x >> (index & 63)) & 1? 1: -1;
+}
+
+// frame index since the epoch of a system time in ns
+static inline int64_t pilotTimeIndex(uint64_t time, uint32_t rate) {
+  return (int64_t)(time / 1000000000 * rate + time % 1000000000 * rate / 1000000000);
+}
+
+// index of the first of frames captured at time, advances past them
+static inline int64_t pilotAdvance(pilot *p, uint64_t time, size_t frames) {
+  int64_t fromClock = pilotTimeIndex(time, p->rate);
+  if(!p->anchored || llabs(fromClock - p->index) > PILOT_REANCHOR * p->rate) {
+    if(p->anchored) ++p->reanchored;
+    p->anchored = 1;
+    p->index = fromClock;
+  }
+
+  int64_t start = p->index;
+  p->index += frames;
+  return start;
+}
+
+// adds the pilot to every channel of len bytes captured at time
+static inline void pilotMix(pilot *p, const audioFormat *format, char *data, size_t len, uint64_t time) {
+  size_t bytes = sampleBytes(format->format);
+  size_t frames = len / frameBytes(format);
+  int64_t index = pilotAdvance(p, time, frames);
+
+  for(size_t f = 0; f < frames; ++f) {
+    float x = pilotChip(index + f) * p->amplitude;
+    for(int c = 0; c < format->channels; ++c) {
+      storeSample(format->format, data, loadSample(format->format, data) + x);
+      data += bytes;
+    }
+  }
+}
+
+// parses a level in dBFS, e.g. "-55"
+static inline int parsePilotLevel(const char *spec, double *level) {
+  double l = atof(spec);
+  if(l >= 0 || l < -120) {
+    fprintf(stderr, "Invalid pilot level %s, expected a negative dBFS value such as -55.\n", spec);
+    return -1;
+  }
+
+  *level = l;
+  return 0;
+}
+
+#endif
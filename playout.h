@@ -0,0 +1,178 @@
+#ifndef H_44FE6AB0_E88E_44B0_B604_EBEC12CC06DC
+#define H_44FE6AB0_E88E_44B0_B604_EBEC12CC06DC
+
+#include "format.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PLAYOUT_BEEP_PERIOD 8 // frames per period of the failure beep
+
+// Ring buffer holding received audio until it is played.
+//
+// Bytes are addressed by their local position, i.e. the distance from the
+// read cursor, so senderOffset arithmetic maps directly onto it. Everything
+// below the write cursor has been received (or filled in), anything above it
+// is stale and gets replaced by failureSound before it can be played.
+//
+// The size is a whole number of frames, so no frame ever straddles the
+// wrap-around and both spans returned by playoutPeek hold complete frames.
+struct playoutBuffer_t {
+  char *data;
+  size_t size;      // frameBytes times a power of two
+  size_t readIndex; // storage index of local position 0
+  size_t written;   // write cursor, as local position
+  audioFormat format;
+  size_t frameBytes;
+  int beepOnFailure;
+};
+
+typedef struct playoutBuffer_t playoutBuffer;
+
+static inline int playoutInit(playoutBuffer *buffer, size_t minimumSize, const audioFormat *format) {
+  size_t frame = frameBytes(format);
+  size_t size = 1024 * frame;
+  while(size < minimumSize) size *= 2;
+
+  buffer->data = calloc(size, 1);
+  if(!buffer->data) return -1;
+
+  buffer->size = size;
+  buffer->readIndex = 0;
+  buffer->written = 0;
+  buffer->format = *format;
+  buffer->frameBytes = frame;
+  buffer->beepOnFailure = 0;
+  return 0;
+}
+
+static inline void playoutFree(playoutBuffer *buffer) {
+  free(buffer->data);
+  buffer->data = NULL;
+}
+
+// localPosition has to be at most buffer->size
+static inline size_t playoutIndex(const playoutBuffer *buffer, size_t localPosition) {
+  size_t index = buffer->readIndex + localPosition;
+  return index < buffer->size? index: index - buffer->size;
+}
+
+// fills a contiguous region with a repeating pattern by doubling what has
+// been written so far, which is a handful of memcpy calls for any frame size
+static inline void fillPattern(char *dst, size_t len, const char *pattern, size_t patternLen) {
+  size_t done = patternLen < len? patternLen: len;
+  memcpy(dst, pattern, done);
+
+  while(done < len) {
+    size_t piece = done < len - done? done: len - done;
+    memcpy(dst + done, dst, piece);
+    done += piece;
+  }
+}
+
+// fills local positions [localPosition, localPosition + len) with filler
+// derived from the frame right before them: that frame held, or a quiet
+// square wave around it if beepOnFailure is set
+static inline void failureSound(playoutBuffer *buffer, size_t localPosition, size_t len) {
+  size_t frame = buffer->frameBytes;
+  size_t start = playoutIndex(buffer, localPosition);
+  size_t previous = (start? start: buffer->size) - frame;
+
+  char pattern[PLAYOUT_BEEP_PERIOD * FORMAT_MAX_CHANNELS * 4];
+  size_t patternLen = frame;
+  memcpy(pattern, buffer->data + previous, frame);
+
+  if(buffer->beepOnFailure) {
+    int format = buffer->format.format;
+    size_t bytes = sampleBytes(format);
+    float step = sampleScale(format) / 64;
+
+    for(size_t i = 0; i < bytes * buffer->format.channels; i += bytes) {
+      float reference = loadSample(format, pattern + i);
+      float beep = reference > 0? reference - step: reference + step;
+      for(int f = 1; f < PLAYOUT_BEEP_PERIOD; ++f) {
+        storeSample(format, pattern + f * frame + i, f < PLAYOUT_BEEP_PERIOD / 2? reference: beep);
+      }
+    }
+    patternLen = PLAYOUT_BEEP_PERIOD * frame;
+  }
+
+  // the region wraps around at most once
+  size_t first = buffer->size - start;
+  if(first > len) first = len;
+
+  fillPattern(buffer->data + start, first, pattern, patternLen);
+  if(len > first) {
+    // keep the pattern's phase across the split
+    size_t shift = first % patternLen;
+    char rotated[sizeof(pattern)];
+    memcpy(rotated, pattern + shift, patternLen - shift);
+    memcpy(rotated + patternLen - shift, pattern, shift);
+    fillPattern(buffer->data, len - first, rotated, patternLen);
+  }
+}
+
+// forget all received data, the next read plays filler
+static inline void playoutReset(playoutBuffer *buffer) {
+  buffer->written = 0;
+}
+
+// caller guarantees localPosition + len <= buffer->size
+static inline void playoutWrite(playoutBuffer *buffer, size_t localPosition, const char *src, size_t len) {
+  if(localPosition > buffer->written) {
+    failureSound(buffer, buffer->written, localPosition - buffer->written);
+  }
+
+  size_t start = playoutIndex(buffer, localPosition);
+  size_t first = buffer->size - start;
+  if(first > len) first = len;
+
+  memcpy(buffer->data + start, src, first);
+  memcpy(buffer->data, src + first, len - first);
+
+  if(localPosition + len > buffer->written) buffer->written = localPosition + len;
+}
+
+// extends what has been received up to local position end, at most
+// buffer->size, with digital silence
+static inline void playoutSilence(playoutBuffer *buffer, size_t end) {
+  if(end <= buffer->written) return;
+
+  size_t start = playoutIndex(buffer, buffer->written);
+  size_t len = end - buffer->written;
+  size_t first = buffer->size - start;
+  if(first > len) first = len;
+
+  memset(buffer->data + start, 0, first);
+  memset(buffer->data, 0, len - first);
+  buffer->written = end;
+}
+
+// returns up to two contiguous spans covering the next len bytes of playout,
+// filling anything not yet received; *len2 is 0 if no wrap-around occurs
+static inline void playoutPeek(playoutBuffer *buffer, size_t len,
+    const char **span1, size_t *len1, const char **span2, size_t *len2) {
+  if(len > buffer->size) len = buffer->size;
+
+  if(buffer->written < len) {
+    failureSound(buffer, buffer->written, len - buffer->written);
+    buffer->written = len;
+  }
+
+  size_t first = buffer->size - buffer->readIndex;
+  if(first > len) first = len;
+
+  *span1 = buffer->data + buffer->readIndex;
+  *len1 = first;
+  *span2 = buffer->data;
+  *len2 = len - first;
+}
+
+// moves the read cursor, may differ from what was played to correct drift
+static inline void playoutAdvance(playoutBuffer *buffer, size_t len) {
+  buffer->readIndex = playoutIndex(buffer, len);
+  buffer->written = buffer->written > len? buffer->written - len: 0;
+}
+
+#endif
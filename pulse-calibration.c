@@ -1,8 +1,9 @@
 #include "common.h"
 
-#define __USE_BSD
-#define __USE_POSIX199309
-#define __USE_XOPEN_EXTENDED
+#define __USE_BSD 1
+#define __USE_POSIX199309 1
+#define __USE_XOPEN_EXTENDED 1
+#define __USE_POSIX2 1
 
 #include <pulse/pulseaudio.h>
 #include <stdio.h>
@@ -16,14 +17,21 @@
 #include <unistd.h>
 #include <math.h>
 #include <strings.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 
-#ifndef M_PI
-#define M_PI 3.14159265358979323846
-#endif
+#include "fft.h"
+#include "pilot.h"
 
 #define BUFFER_SIZE 400
 #define IGN(x) __##x __attribute__((unused))
 #define SAMPLE_RATE 44100
+#define CORRELATION_SIZE 131072 // power of two >= 2 * SAMPLE_RATE, so the correlation does not wrap
+#define PILOT_BLOCK 32768 // recorded frames correlated against the pilot at once
+#define PILOT_MAX_LAG (CORRELATION_SIZE - PILOT_BLOCK) // longest latency the pilot can show
+#define PILOT_DECAY 0.9   // per block, older blocks fade out of the accumulated correlation
+#define PILOT_THRESHOLD 8 // peak over rms of the accumulated correlation for a result
 
 int running;
 
@@ -32,12 +40,38 @@ pa_stream *playStream, *recordStream;
 int playReady = 0;
 // One second, two channels, with duplicate for module arithmetic
 short testTone[SAMPLE_RATE * 4];
-short recordBuffer[SAMPLE_RATE * 8];
+// capture fills one recording while the analysis thread works on the other
+short recordBuffers[2][SAMPLE_RATE * 8];
+short *recordBuffer = recordBuffers[0];
+short *analysisBuffer;
+atomic_int analysisBusy = 0;
+sem_t analysisRequested;
+unsigned long skippedAnalyses = 0;
 size_t playPosition = 0;
-size_t recordPosition = sizeof(recordBuffer) / sizeof(*recordBuffer);
+#define RECORD_SAMPLES (sizeof(recordBuffers[0]) / sizeof(*recordBuffers[0]))
+size_t recordPosition = RECORD_SAMPLES;
 
 uint64_t restartTime = 0;
 
+// spectra of the test tone channels, conjugated
+double complex toneSpectrum[2][CORRELATION_SIZE];
+double complex recordSpectrum[CORRELATION_SIZE];
+double complex correlation[CORRELATION_SIZE];
+
+// Streaming mode: rather than playing test tones, listen for the pilot which
+// pulse-sender -P mixes into a production stream, see pilot.h. Capture fills
+// one block while the analysis thread correlates the other and adds the
+// result to a decaying sum, so the pilot rises out of the programme over a
+// few blocks and a change in latency shows within seconds.
+int pilotMode = 0;
+uint32_t recordRate = SAMPLE_RATE;
+pilot recordPilot; // frame indices of the recording, on the system clock
+float pilotBlocks[2][PILOT_BLOCK];
+int64_t pilotBlockStarts[2];
+int pilotCurrent = 0;
+size_t pilotFill = 0;
+double pilotAccumulated[PILOT_MAX_LAG + 1];
+
 void streamStateChanged(pa_stream *stream, void *IGN(userdata)) {
   pa_stream_state_t state = pa_stream_get_state(stream);
   fprintf(stderr, "pulseaudio stream state changed: %d\n", state);
@@ -47,6 +81,22 @@ void streamStateChanged(pa_stream *stream, void *IGN(userdata)) {
   if(stream == playStream) playReady = 1;
 }
 
+void finishPilotBlock();
+
+// mixes the channels down and cuts the recording into blocks of contiguous indices
+void pilotCapture(const short *data, size_t frames, uint64_t time) {
+  uint64_t reanchored = recordPilot.reanchored;
+  int64_t index = pilotAdvance(&recordPilot, time, frames);
+  if(recordPilot.reanchored != reanchored) pilotFill = 0;
+
+  for(size_t f = 0; f < frames; ++f) {
+    if(!pilotFill) pilotBlockStarts[pilotCurrent] = index + f;
+
+    pilotBlocks[pilotCurrent][pilotFill++] = (float)data[2 * f] + data[2 * f + 1];
+    if(pilotFill == PILOT_BLOCK) finishPilotBlock();
+  }
+}
+
 void dataAvailable(pa_stream *stream, size_t IGN(bytes), void *IGN(userdata)) {
   size_t available;
   const void *data;
@@ -62,7 +112,10 @@ void dataAvailable(pa_stream *stream, size_t IGN(bytes), void *IGN(userdata)) {
     return;
   }
 
-  if(recordPosition + available / sizeof(*recordBuffer) < sizeof(recordBuffer) / sizeof(*recordBuffer)) {
+  // same convention as pulse-sender: the time of the callback is that of the first frame
+  if(pilotMode) {
+    if(data) pilotCapture(data, available / sizeof(*recordBuffer) / 2, (uint64_t)(t.tv_sec) * 1000000000 + t.tv_nsec);
+  } else if(recordPosition + available / sizeof(*recordBuffer) < RECORD_SAMPLES) {
     memcpy(recordBuffer + recordPosition, data, available);
     recordPosition += available / sizeof(*recordBuffer);
   }
@@ -73,25 +126,184 @@ void dataAvailable(pa_stream *stream, size_t IGN(bytes), void *IGN(userdata)) {
   }
 }
 
-void analyzeRecording() {
+void prepareCorrelation() {
+  for(int channel = 0; channel < 2; ++channel) {
+    for(size_t i = 0; i < CORRELATION_SIZE; ++i) {
+      toneSpectrum[channel][i] = i < SAMPLE_RATE? testTone[i * 2 + channel]: 0;
+    }
+
+    fft(toneSpectrum[channel], CORRELATION_SIZE, 0);
+
+    for(size_t i = 0; i < CORRELATION_SIZE; ++i) {
+      toneSpectrum[channel][i] = conj(toneSpectrum[channel][i]);
+    }
+  }
+}
+
+// refines an integer peak position via a parabola through its neighbours
+double interpolatePeak(size_t off) {
+  if(off == 0 || off + 1 >= SAMPLE_RATE) return off;
+
+  double left = fabs(creal(correlation[off - 1]));
+  double center = fabs(creal(correlation[off]));
+  double right = fabs(creal(correlation[off + 1]));
+
+  double curvature = left - 2 * center + right;
+  if(curvature >= 0) return off;
+
+  return off + 0.5 * (left - right) / curvature;
+}
+
+void analyzeRecording(const short *recording) {
   printf("---------------------------------\n");
+
+  // correlation[off] = sum over frames f of testTone[f] * recording[f + off], for both channels
+  for(size_t i = 0; i < CORRELATION_SIZE; ++i) {
+    correlation[i] = 0;
+  }
+
+  for(int channel = 0; channel < 2; ++channel) {
+    for(size_t i = 0; i < CORRELATION_SIZE; ++i) {
+      recordSpectrum[i] = i < 2 * SAMPLE_RATE? recording[i * 2 + channel]: 0;
+    }
+
+    fft(recordSpectrum, CORRELATION_SIZE, 0);
+
+    for(size_t i = 0; i < CORRELATION_SIZE; ++i) {
+      correlation[i] += toneSpectrum[channel][i] * recordSpectrum[i];
+    }
+  }
+
+  fft(correlation, CORRELATION_SIZE, 1);
+
+  for(size_t i = 0; i < CORRELATION_SIZE; ++i) {
+    correlation[i] /= CORRELATION_SIZE;
+  }
+
+  const double threshold = (double)SAMPLE_RATE * 2 * 500 * 500;
+
   for(size_t off = 0; off < SAMPLE_RATE; ++off) {
-    int64_t sum = 0;
-    for(size_t i = 0; i < SAMPLE_RATE * 2; ++i) {
-      sum += ((int64_t)testTone[i] * recordBuffer[i + off * 2]);
+    double sum = creal(correlation[off]);
+    if(fabs(sum) > threshold) {
+      printf("%2.5f: %lld\n", (float)off / SAMPLE_RATE, llround(sum));
     }
+  }
+
+  size_t peak = 0;
+  for(size_t off = 1; off < SAMPLE_RATE; ++off) {
+    if(fabs(creal(correlation[off])) > fabs(creal(correlation[peak]))) peak = off;
+  }
+
+  if(fabs(creal(correlation[peak])) > threshold) {
+    printf("Latency: %2.7fs\n", interpolatePeak(peak) / SAMPLE_RATE);
+  }
+
+  fflush(stdout);
+}
+
+// correlates a block with the pilot chips from PILOT_MAX_LAG frames before
+// it up to its end and reports the strongest lag of the accumulated result
+void analyzePilot(const float *block, int64_t start) {
+  for(size_t i = 0; i < CORRELATION_SIZE; ++i) {
+    recordSpectrum[i] = i < PILOT_BLOCK? block[i]: 0;
+    correlation[i] = pilotChip(start - PILOT_MAX_LAG + (int64_t)i);
+  }
+
+  fft(recordSpectrum, CORRELATION_SIZE, 0);
+  fft(correlation, CORRELATION_SIZE, 0);
+
+  // the pilot is white, whitening the recording keeps loud tones of the
+  // programme from burying it
+  for(size_t i = 0; i < CORRELATION_SIZE; ++i) {
+    double magnitude = cabs(recordSpectrum[i]);
+    correlation[i] *= magnitude > 0? conj(recordSpectrum[i]) / magnitude: 0;
+  }
+
+  fft(correlation, CORRELATION_SIZE, 1);
+
+  // correlation[k] = sum over frames f of block[f] * chip(start + f - (PILOT_MAX_LAG - k))
+  double sumSquares = 0;
+  size_t peak = 0;
+  for(size_t lag = 0; lag <= PILOT_MAX_LAG; ++lag) {
+    double c = creal(correlation[PILOT_MAX_LAG - lag]) / CORRELATION_SIZE;
+    pilotAccumulated[lag] = PILOT_DECAY * pilotAccumulated[lag] + c;
+
+    sumSquares += pilotAccumulated[lag] * pilotAccumulated[lag];
+    if(fabs(pilotAccumulated[lag]) > fabs(pilotAccumulated[peak])) peak = lag;
+  }
 
-    int64_t abssum = sum;
-    if(abssum < 0) abssum = -abssum;
+  double rms = sqrt(sumSquares / (PILOT_MAX_LAG + 1));
+  double ratio = rms > 0? fabs(pilotAccumulated[peak]) / rms: 0;
 
-    if(abssum > (int64_t)SAMPLE_RATE * 2 * 500 * 500) {
-      printf("%2.5f: %ld\n", (float)off / SAMPLE_RATE, sum);
+  if(ratio < PILOT_THRESHOLD) {
+    printf("No pilot found, peak %.1f times the rms\n", ratio);
+    fflush(stdout);
+    return;
+  }
+
+  double offset = peak;
+  if(peak > 0 && peak < PILOT_MAX_LAG) {
+    double left = fabs(pilotAccumulated[peak - 1]);
+    double center = fabs(pilotAccumulated[peak]);
+    double right = fabs(pilotAccumulated[peak + 1]);
+    double curvature = left - 2 * center + right;
+    if(curvature < 0) offset += 0.5 * (left - right) / curvature;
+  }
+
+  printf("Latency: %2.7fs (peak %.1f times the rms)\n", offset / recordRate, ratio);
+  fflush(stdout);
+}
+
+void *analysisThread(void *IGN(arg)) {
+  while(1) {
+    if(sem_wait(&analysisRequested)) {
+      if(errno == EINTR) continue;
+
+      fprintf(stderr, "Failed to wait for recordings: %s\n", strerror(errno));
+      return NULL;
+    }
+
+    if(pilotMode) {
+      int block = !pilotCurrent;
+      analyzePilot(pilotBlocks[block], pilotBlockStarts[block]);
+    } else {
+      analyzeRecording(analysisBuffer);
+      bzero(analysisBuffer, sizeof(recordBuffers[0]));
     }
+
+    atomic_store(&analysisBusy, 0);
+  }
+}
+
+// hands the current recording to the analysis thread, never waits for it
+void finishRecording() {
+  if(atomic_load(&analysisBusy)) {
+    fprintf(stderr, "Analysis still running, skipping recording (%lu skipped).\n", ++skippedAnalyses);
+    bzero(recordBuffer, sizeof(recordBuffers[0]));
+  } else {
+    analysisBuffer = recordBuffer;
+    recordBuffer = recordBuffer == recordBuffers[0]? recordBuffers[1]: recordBuffers[0];
+
+    atomic_store(&analysisBusy, 1);
+    sem_post(&analysisRequested);
   }
 
   recordPosition = 0;
 }
 
+void finishPilotBlock() {
+  if(atomic_load(&analysisBusy)) {
+    fprintf(stderr, "Analysis still running, skipping block (%lu skipped).\n", ++skippedAnalyses);
+  } else {
+    pilotCurrent = !pilotCurrent;
+
+    atomic_store(&analysisBusy, 1);
+    sem_post(&analysisRequested);
+  }
+
+  pilotFill = 0;
+}
+
 void contextStateChanged(pa_context *ctx, void *IGN(userdata)) {
   pa_context_state_t state = pa_context_get_state(ctx);
   fprintf(stderr, "pulseaudio context state changed: %d\n", state);
@@ -102,7 +314,7 @@ void contextStateChanged(pa_context *ctx, void *IGN(userdata)) {
     pa_sample_spec sample_spec;
     sample_spec.format = PA_SAMPLE_S16LE;
     sample_spec.channels = 2;
-    sample_spec.rate = SAMPLE_RATE;
+    sample_spec.rate = recordRate;
 
     recordStream = pa_stream_new(ctx, "receiving test tones", &sample_spec, NULL);
     if(!recordStream) {
@@ -181,35 +393,59 @@ void writeAudio() {
 
   playPosition += requested / sizeof(*testTone);
   if(playPosition > sizeof(testTone) / sizeof(*testTone) / 2) {
-    analyzeRecording();
-    bzero(recordBuffer, sizeof(recordBuffer));
-    recordPosition = 0;
+    finishRecording();
 
     playPosition -= sizeof(testTone) / sizeof(*testTone) / 2;
   }
 }
 
-int main(int IGN(argc), char **IGN(argv)) {
+int main(int argc, char **argv) {
+  int opt;
+
+  while((opt = getopt(argc, argv, "pr:")) != -1) {
+    switch(opt) {
+      case 'p': pilotMode = 1; break;
+      case 'r': recordRate = atoi(optarg); break;
+      default:
+        fprintf(stderr, "Usage: ./pulse-calibration [-p] [-r rate]\n");
+        fprintf(stderr, "  -p  do not play test tones, report the latency of a stream sent with pulse-sender -P\n");
+        fprintf(stderr, "  -r  record at this rate, for -p the rate of the stream, default 44100\n");
+        return 1;
+    }
+  }
+
+  if(argc - optind != 0 || recordRate < 8000) {
+    fprintf(stderr, "Usage: ./pulse-calibration [-p] [-r rate]\n");
+    return 1;
+  }
+
+  if(pilotMode) {
+    audioFormat format = { SAMPLE_S16LE, 2, recordRate };
+    pilotInit(&recordPilot, 0, &format); // only its clock is used
+  }
+
   pa_mainloop *mainloop = pa_mainloop_new();
   if(!mainloop) {
     fprintf(stderr, "Failed to get pulseaudio mainloop.\n");
     return 1;
   }
 
-  play = pa_context_new(
-    pa_mainloop_get_api(mainloop),
-    "Calibrator: Play"
-  );
-  if(!play) {
-    fprintf(stderr, "Failed to get pulseaudio context.\n");
-    return 1;
-  }
+  if(!pilotMode) {
+    play = pa_context_new(
+      pa_mainloop_get_api(mainloop),
+      "Calibrator: Play"
+    );
+    if(!play) {
+      fprintf(stderr, "Failed to get pulseaudio context.\n");
+      return 1;
+    }
 
-  pa_context_set_state_callback(play, contextStateChanged, NULL);
+    pa_context_set_state_callback(play, contextStateChanged, NULL);
 
-  if(pa_context_connect(play, NULL, PA_CONTEXT_NOFLAGS, NULL)) {
-    fprintf(stderr, "Failed to connect pulseaudio context: %s\n", pa_strerror(pa_context_errno(play))); 
-    return 1;
+    if(pa_context_connect(play, NULL, PA_CONTEXT_NOFLAGS, NULL)) {
+      fprintf(stderr, "Failed to connect pulseaudio context: %s\n", pa_strerror(pa_context_errno(play))); 
+      return 1;
+    }
   }
 
   record = pa_context_new(
@@ -245,6 +481,19 @@ int main(int IGN(argc), char **IGN(argv)) {
   bzero(testTone, SAMPLE_RATE);
   // memcpy(testTone + 2 * SAMPLE_RATE, testTone, sizeof(*testTone) * 2 * SAMPLE_RATE);
 
+  if(!pilotMode) prepareCorrelation();
+
+  if(sem_init(&analysisRequested, 0, 0)) {
+    fprintf(stderr, "Failed to create semaphore: %s\n", strerror(errno));
+    return 1;
+  }
+
+  pthread_t analyzer;
+  if(pthread_create(&analyzer, NULL, analysisThread, NULL)) {
+    fprintf(stderr, "Failed to start analysis thread.\n");
+    return 1;
+  }
+
   running = 1;
 
   while(running) {
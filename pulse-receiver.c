@@ -1,8 +1,11 @@
 #include "common.h"
 
-#define __USE_BSD
-#define __USE_POSIX199309
-#define __USE_XOPEN_EXTENDED
+#define __USE_BSD 1
+#define __USE_POSIX199309 1
+#define __USE_XOPEN_EXTENDED 1
+#define __USE_POSIX2 1
+#define __USE_XOPEN2K 1
+#define __USE_MISC 1
 
 #include <pulse/pulseaudio.h>
 #include <stdio.h>
@@ -14,88 +17,115 @@
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "format.h"
+#include "mixer.h"
+#include "receiver.h"
+#include "rtthread.h"
+#include "transport.h"
 
 #define IGN(x) __##x __attribute__((unused))
 
 int BUFFER_SIZE = 400;
 
-int running;
-float sampleRate = 44100;
-float localPositionAvg;
-float localPositionBlend = 0.0002;
-int32_t samplesTooMuch = 0;
+atomic_int running;
 
-uint64_t maximumDrift = 4;
 double targetLatency = 0.05;  // in s
-uint64_t senderOffset; // incoming packet offset which would start at audioBuffer[0]
-char audioBuffer[120000];
-
-char receiveBuffer[8000];
-uint64_t receivePos = 0;
-int debugRate = 256;
-int debugCounter = 0;
+receiver rx;
+int mixing;
+mixer mix;
 
 char *pulseaudioName = "unnamed";
 
+pa_mainloop *mainloop;
 pa_context *ctx;
 pa_stream *stream;
 
-int streamReady = 0;
-int beepOnFailure = 0;
+pthread_t audioThread;
+atomic_int audioRunning;
 
-// drop-in replacement for bzero on audioBuffer
-void failureSound(char *bufferPos, size_t len) {
-  char reference;
-  if(bufferPos == audioBuffer) {
-    reference = bufferPos[0];
-  } else {
-    reference = bufferPos[-1];
-  }
+atomic_int contextReady = 0;
+int streamReady = 0;
+int busyPoll = 0;
 
-  if(!beepOnFailure) {
-    for(size_t i = 0; i < len; ++i) {
-      bufferPos[i] = reference;
-    }
-  } else if(reference > 0) {
-    for(size_t i = 0; i < len; ++i) {
-      bufferPos[i] = reference - (i % 4? 0: 4);
-    }
-  } else {
-    for(size_t i = 0; i < len; ++i) {
-      bufferPos[i] = reference + (i % 4? 0: 4);
-    }
-  }
-}
+// The callbacks run on the audio thread in the split mode, so they report
+// through receiverReportDevice rather than printing.
 
 void streamStateChanged(pa_stream *IGN(stream), void *IGN(userdata)) {
   pa_stream_state_t state = pa_stream_get_state(stream);
-  fprintf(stderr, "pulseaudio stream state changed: %d\n", state);
+  receiverReportDevice(&rx, "pulseaudio stream state changed", state, NULL);
 
   if(state != PA_STREAM_READY) return;
 
   streamReady = 1;
 }
 
-void contextStateChanged(pa_context *IGN(ctx), void *IGN(userdata)) {
-  pa_context_state_t state = pa_context_get_state(ctx);
-  fprintf(stderr, "pulseaudio context state changed: %d\n", state);
+void writeAudio();
+void checkFormat();
 
-  if(state != PA_CONTEXT_READY) return;
+void streamUnderflow(pa_stream *IGN(stream), void *IGN(userdata)) {
+  metricsAdd(&rx.metrics->xruns, 1);
+}
+
+void writeRequested(pa_stream *IGN(stream), size_t IGN(bytes), void *IGN(userdata)) {
+  writeAudio();
+}
+
+// the mixer reads all senders on the socket itself
+int receive(int fd) {
+  if(!mixing) return receiveInput(&rx, fd);
+
+  mixerReceive(&mix, fd);
+  return 1;
+}
+
+void inputAvailable(pa_mainloop_api *api, pa_io_event *event, int fd, pa_io_event_flags_t IGN(flags), void *IGN(userdata)) {
+  if(!receive(fd)) {
+    api->io_free(event);
+    running = 0;
+  }
+  checkFormat();
+}
+
+pa_sample_format_t pulseFormat(int format) {
+  switch(format) {
+    case SAMPLE_S24LE: return PA_SAMPLE_S24LE;
+    case SAMPLE_FLOAT32LE: return PA_SAMPLE_FLOAT32LE;
+    default: return PA_SAMPLE_S16LE;
+  }
+}
+
+// (re)creates the playback stream in the receiver's current format
+void openStream() {
+  if(stream) {
+    pa_stream_set_state_callback(stream, NULL, NULL);
+    pa_stream_set_write_callback(stream, NULL, NULL);
+    pa_stream_set_underflow_callback(stream, NULL, NULL);
+    pa_stream_disconnect(stream);
+    pa_stream_unref(stream);
+    stream = NULL;
+    streamReady = 0;
+  }
 
   pa_sample_spec sample_spec;
-  sample_spec.format = PA_SAMPLE_S16LE;
-  sample_spec.channels = 2;
-  sample_spec.rate = sampleRate;
+  sample_spec.format = pulseFormat(rx.format.format);
+  sample_spec.channels = rx.format.channels;
+  sample_spec.rate = rx.format.rate;
 
   stream = pa_stream_new(ctx, "remoteplay-receiver", &sample_spec, NULL);
   if(!stream) {
-    fprintf(stderr, "Failed to create pulseaudio stream: %s\n", pa_strerror(pa_context_errno(ctx)));
+    receiverReportDevice(&rx, "Failed to create pulseaudio stream", pa_context_errno(ctx), pa_strerror);
     running = 0;
     return;
   }
 
   pa_stream_set_state_callback(stream, streamStateChanged, NULL);
-  // pa_stream_set_write_callback(stream, writeRequested, NULL);
+  pa_stream_set_write_callback(stream, writeRequested, NULL);
+  pa_stream_set_underflow_callback(stream, streamUnderflow, NULL);
 
   pa_buffer_attr buffer_spec;
   buffer_spec.maxlength = ~0u;
@@ -103,83 +133,55 @@ void contextStateChanged(pa_context *IGN(ctx), void *IGN(userdata)) {
   buffer_spec.prebuf = ~0u;
   buffer_spec.minreq = ~0u;
   
-  if(pa_stream_connect_playback(stream, NULL, &buffer_spec, PA_STREAM_PLAYBACK | PA_STREAM_ADJUST_LATENCY | PA_STREAM_NOT_MONOTONIC | PA_STREAM_VARIABLE_RATE, NULL, NULL)) {
-    fprintf(stderr, "Failed to connect playback stream: %s\n", pa_strerror(pa_context_errno(ctx)));
+  pa_stream_flags_t flags = PA_STREAM_PLAYBACK | PA_STREAM_ADJUST_LATENCY | PA_STREAM_NOT_MONOTONIC | PA_STREAM_VARIABLE_RATE;
+  if(rx.group) flags |= PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_AUTO_TIMING_UPDATE;
+
+  if(pa_stream_connect_playback(stream, NULL, &buffer_spec, flags, NULL, NULL)) {
+    receiverReportDevice(&rx, "Failed to connect playback stream", pa_context_errno(ctx), pa_strerror);
     running = 0;
     return;
   }
 }
 
-int frameAlign(float f) {
-  return ((int)f) / 4 * 4;
-}
-
-void receiveInput() {
-  while(1) {
-    int len = read(0, receiveBuffer + receivePos, sizeof(receiveBuffer) - receivePos);
-    if(len < 0) {
-      if(errno == EAGAIN || errno == EWOULDBLOCK) return;
-
-      fprintf(stderr, "Failed to receive packet: %s\n", strerror(errno));
-      return;
-    } else if(len == 0) {
-      running = 0;
-    } else {
-      receivePos += len;
-    }
-
-    dataPacket *packet = (dataPacket *)receiveBuffer;
-    if(receivePos < sizeof(packet->length) || receivePos < packet->length) continue;
-
-    struct timespec t;
-    if(clock_gettime(CLOCK_REALTIME, &t)) {
-      fprintf(stderr, "Failed to get current time: %s\n", strerror(errno));
-    }
-
-    uint64_t now = (uint64_t)(t.tv_sec) * 1000000000 + t.tv_nsec;
-    double packetToPlayIn = (packet->time + targetLatency * 1000000000 - now) / 1000000000;
+void contextStateChanged(pa_context *IGN(ctx), void *IGN(userdata)) {
+  pa_context_state_t state = pa_context_get_state(ctx);
+  receiverReportDevice(&rx, "pulseaudio context state changed", state, NULL);
 
-    int dataLen = packet->length - sizeof(*packet) + sizeof(packet->data);
-    int64_t localPosition = packet->position - senderOffset;
-    int64_t desiredLocalPosition = 4 * sampleRate * targetLatency;
+  if(state != PA_CONTEXT_READY) return;
 
-    if(packetToPlayIn < 0) {
-      fprintf(stderr, "Packet arrived too late.\n");
-    } else if(localPosition < 0) {
-      fprintf(stderr, "Playback is too far ahead.\n");
+  contextReady = 1;
+  if(!rx.threaded) receiverFollowFormat(&rx); // the network thread does that otherwise
+  openStream();
+}
 
-      failureSound(audioBuffer, sizeof(audioBuffer));
-      senderOffset = packet->position - frameAlign(desiredLocalPosition);
-      localPositionAvg = localPosition = packet->position - senderOffset;
-    } else if(localPosition + dataLen > (int)sizeof(audioBuffer)) {
-      fprintf(stderr, "Playback is too far behind.\n");
+// Audio thread of the split mode: runs the pulseaudio mainloop, which
+// renders from writeRequested. Packets arrive through the receiver's queue.
+void *audioLoop(void *IGN(arg)) {
+  while(running && atomic_load_explicit(&audioRunning, memory_order_relaxed)) {
+    pa_mainloop_iterate(mainloop, 1, NULL);
+  }
 
-      failureSound(audioBuffer, sizeof(audioBuffer));
-      senderOffset = packet->position - frameAlign(desiredLocalPosition);
-      localPositionAvg = localPosition = packet->position - senderOffset;
-    } else {
-      memcpy(audioBuffer + localPosition, packet->data, dataLen);
+  return NULL;
+}
 
-      localPositionAvg = (1 - localPositionBlend) * localPositionAvg + localPositionBlend * localPosition;
-    }
+int startAudio() {
+  atomic_store(&audioRunning, 1);
+  return startRealtimeThread(&audioThread, audioLoop, NULL);
+}
 
-    if(++debugCounter > debugRate) {
-      fprintf(stderr, "Packet for: +%lfs, buf pos: %lld, avg %f, delta %d\n", packetToPlayIn, (long long int)localPosition, localPositionAvg, samplesTooMuch);
-      debugCounter = 0;
-    }
+void stopAudio() {
+  atomic_store(&audioRunning, 0);
+  pa_mainloop_wakeup(mainloop);
+  pthread_join(audioThread, NULL);
+}
 
-    uint64_t shift = packet->length;
-    memmove(receiveBuffer, receiveBuffer + shift, receivePos - shift);
-    receivePos -= shift;
+// follows the stream format once the receiver adopted a new one
+void checkFormat() {
+  if(!rx.formatChanged || !contextReady) return;
 
-    if(localPositionAvg > desiredLocalPosition + maximumDrift) {
-      samplesTooMuch = frameAlign(localPositionAvg - desiredLocalPosition);
-      localPositionAvg = (0.1 * desiredLocalPosition + 0.9 * localPositionAvg);
-    } else if(localPositionAvg < desiredLocalPosition - maximumDrift) {
-      samplesTooMuch = frameAlign(localPositionAvg - desiredLocalPosition);
-      localPositionAvg = (0.1 * desiredLocalPosition + 0.9 * localPositionAvg);
-    }
-  }
+  if(rx.threaded) stopAudio();
+  if(receiverFollowFormat(&rx)) openStream();
+  if(rx.threaded && startAudio()) running = 0;
 }
 
 void writeAudio() {
@@ -187,51 +189,144 @@ void writeAudio() {
 
   size_t requested = pa_stream_writable_size(stream);
   if(!requested) return;
+  if(requested > rx.playout.size / 4) requested = frameAlign(rx.playout.size / 4, rx.frameBytes);
 
   if(pa_stream_is_corked(stream)) {
     pa_stream_cork(stream, 0, NULL, NULL);
   }
-    
-  if(pa_stream_write(stream, audioBuffer, requested, NULL, 0, PA_SEEK_RELATIVE)) {
-    fprintf(stderr, "Could not write to pulseaudio stream: %s\n", pa_strerror(pa_context_errno(ctx)));
+
+  void *data;
+  if(pa_stream_begin_write(stream, &data, &requested)) {
+    receiverReportDevice(&rx, "Could not get pulseaudio write buffer", pa_context_errno(ctx), pa_strerror);
     return;
   }
-
-  if(samplesTooMuch > 1) {
-    requested += samplesTooMuch;
-    samplesTooMuch = 0;
-  } else if(samplesTooMuch < -1) {
-    requested += samplesTooMuch;
-    samplesTooMuch = 0;
+  requested = frameAlign(requested, rx.frameBytes);
+
+  // for group playout: how long until what is written now gets heard
+  pa_usec_t latency;
+  int negative;
+  if(rx.group && !pa_stream_get_latency(stream, &latency, &negative)) {
+    receiverSetOutputDelay(&rx, negative? 0: latency * 1000);
+    if(mixing) mixerSetOutputDelay(&mix, rx.outputDelay);
   }
 
-  if(requested > (int)sizeof(audioBuffer) / 4) requested = sizeof(audioBuffer) / 4;
+  if(mixing) {
+    mixerRender(&mix, data, requested);
+  } else {
+    receiverRender(&rx, data, requested);
+  }
 
-  memmove(audioBuffer, audioBuffer + requested, sizeof(audioBuffer) - requested);
-  failureSound(audioBuffer + sizeof(audioBuffer) - requested, requested);
-  senderOffset += requested;
+  if(pa_stream_write(stream, data, requested, NULL, 0, PA_SEEK_RELATIVE)) {
+    receiverReportDevice(&rx, "Could not write to pulseaudio stream", pa_context_errno(ctx), pa_strerror);
+    return;
+  }
 
   // printf("Played %lld samples.\n", (long long int)requested);
 }
 
 int main(int argc, char **argv) {
-  if(argc != 2 && argc != 3) {
-    fprintf(stderr, "Usage: ./pulse-receiver [target latency] [name]\n");
+  int reportWakeups = 0;
+  int threaded = 0;
+  char *listenAddress = NULL;
+  audioFormat format = defaultFormat;
+  int fixedFormat = 0;
+  lossSimulator loss;
+  int adaptive = 0;
+  char *metricsName = NULL;
+  char *tracePath = NULL;
+  int verbose = 0;
+  double latencyPercentile = 0.99, latencyMargin = 0.01;
+  int group = 0;
+  int opt;
+
+  lossInit(&loss);
+  mixerInit(&mix, &rx);
+
+  while((opt = getopt(argc, argv, "wbtu:f:l:a:M:vT:gxX:")) != -1) {
+    switch(opt) {
+      case 't': threaded = 1; break;
+      case 'l':
+        if(lossParse(&loss, optarg)) return 1;
+        break;
+      case 'M': metricsName = optarg; break;
+      case 'T': tracePath = optarg; break;
+      case 'v': verbose = 1; break;
+      case 'a':
+        if(parseJitterTarget(optarg, &latencyPercentile, &latencyMargin)) return 1;
+        adaptive = 1;
+        break;
+      case 'f':
+        if(parseFormat(optarg, &format)) return 1;
+        fixedFormat = 1;
+        break;
+      case 'w': reportWakeups = 1; break;
+      case 'b': busyPoll = 1; break;
+      case 'u': listenAddress = optarg; break;
+      case 'g': group = 1; break;
+      case 'x': mixing = 1; break;
+      case 'X':
+        if(mixerParseGain(&mix, optarg)) return 1;
+        break;
+      default:
+        fprintf(stderr, "Usage: ./pulse-receiver [-w] [-b] [-t] [-u [host:]port] [-f format] [-l loss] [-a percentile] [-M name] [-T file] [-v] [-g] [-x] [-X id:dB] [target latency] [name]\n");
+        fprintf(stderr, "  -w  report main loop wakeups per second\n");
+        fprintf(stderr, "  -b  busy-poll instead of waiting for events\n");
+        fprintf(stderr, "  -t  run pulseaudio and playback on a separate real-time thread with memory locked\n");
+        fprintf(stderr, "  -u  receive UDP datagrams on the given port instead of reading stdin\n");
+        fprintf(stderr, "  -f  play only format[:channels[:rate]] instead of following the stream\n");
+        fprintf(stderr, "  -l  drop percent[:mean burst length] of incoming packets, to test loss handling\n");
+        fprintf(stderr, "  -a  adapt the target latency to percentile[:margin ms] of the arrival delay, e.g. 99:10,\n");
+        fprintf(stderr, "      the target latency given becomes the upper limit\n");
+        fprintf(stderr, "  -M  publish metrics in shared memory under this name, for receiver-stats\n");
+        fprintf(stderr, "  -T  record incoming packets with their arrival times to this file, for trace-replay\n");
+        fprintf(stderr, "  -v  print a status line every 256 packets\n");
+        fprintf(stderr, "  -g  group playout: be heard in step with other receivers of the stream, needs -u\n");
+        fprintf(stderr, "  -x  mix every sender on the UDP port, each in the output format, needs -u,\n");
+        fprintf(stderr, "      -M publishes the sums and each stream's own metrics as name.0, name.1 and so on\n");
+        fprintf(stderr, "  -X  play stream id at this gain in dB when mixing, e.g. 2:-12, repeat it\n");
+        return 1;
+    }
+  }
+
+  if(argc - optind != 1 && argc - optind != 2) {
+    fprintf(stderr, "Usage: ./pulse-receiver [-w] [-b] [-t] [-u [host:]port] [-f format] [-l loss] [-a percentile] [-M name] [-T file] [-v] [-g] [-x] [-X id:dB] [target latency] [name]\n");
     return 1;
   }
 
-  if(argc >= 2) {
-    targetLatency = atof(argv[1]);
+  if(group && (!listenAddress || adaptive)) {
+    fprintf(stderr, "Group playout needs UDP input for a shared clock and a fixed target latency.\n");
+    return 1;
   }
-  fprintf(stderr, "Target latency: %f\n", targetLatency);
 
-  if(argc == 3) {
-    pulseaudioName = argv[2];
+  if(mixing && (!listenAddress || threaded || tracePath)) {
+    fprintf(stderr, "Mixing needs UDP input, runs on one thread and records no trace.\n");
+    return 1;
   }
 
-  senderOffset = -1ull << 62;
+  targetLatency = atof(argv[optind]);
+  fprintf(stderr, "Target latency: %f\n", targetLatency);
+
+  if(argc - optind == 2) {
+    pulseaudioName = argv[optind + 1];
+  }
 
-  pa_mainloop *mainloop = pa_mainloop_new();
+  if(receiverInit(&rx, &format, targetLatency)) {
+    fprintf(stderr, "Failed to allocate playout buffer.\n");
+    return 1;
+  }
+  rx.loss = loss;
+  rx.adaptive = adaptive;
+  rx.latencyPercentile = latencyPercentile;
+  rx.latencyMargin = latencyMargin;
+  if(verbose) rx.debugRate = 256;
+  if(metricsName) receiverPublishMetrics(&rx, metricsName);
+  if(mixing && metricsName) mixerPublishMetrics(&mix, metricsName);
+  if(tracePath && receiverRecord(&rx, tracePath)) return 1;
+  rx.fixedFormat = fixedFormat;
+  rx.reportWakeups = reportWakeups;
+  rx.group = group;
+
+  mainloop = pa_mainloop_new();
   if(!mainloop) {
     fprintf(stderr, "Failed to get pulseaudio mainloop.\n");
     return 1;
@@ -257,20 +352,72 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  if(fcntl(0, F_SETFL, O_NONBLOCK)) {
-    fprintf(stderr, "Could not enable non-blocking mode for stdin: %s\n", strerror(errno));
+  int inputFd = 0;
+  if(listenAddress) {
+    inputFd = udpOpen(listenAddress, 1);
+    if(inputFd < 0) return 1;
+
+    rx.datagrams = 1;
+  }
+
+  if(fcntl(inputFd, F_SETFL, O_NONBLOCK)) {
+    fprintf(stderr, "Could not enable non-blocking mode for input: %s\n", strerror(errno));
     return 1;
   }
 
   running = 1;
 
-  while(running) {
-    pa_mainloop_iterate(mainloop, 0, NULL);
+  if(threaded) {
+    if(receiverStartQueues(&rx)) {
+      fprintf(stderr, "Failed to allocate packet queues.\n");
+      return 1;
+    }
+    if(startAudio()) return 1;
+
+    // the network thread only waits for input, with a timeout to keep
+    // reporting what the audio thread has to say
+    struct pollfd input;
+    input.fd = inputFd;
+    input.events = POLLIN;
+
+    while(running) {
+      if(poll(&input, 1, 100) < 0) {
+        if(errno == EINTR) continue;
+
+        fprintf(stderr, "Could not wait for events: %s\n", strerror(errno));
+        return 1;
+      }
+      receiverWakeup(&rx);
+
+      if(input.revents && !receiveInput(&rx, inputFd)) running = 0;
+      checkFormat();
+      receiverPrintEvents(&rx);
+    }
 
-    writeAudio();
-    receiveInput();
+    stopAudio();
+    receiverPrintEvents(&rx);
+  } else if(busyPoll) {
+    while(running) {
+      pa_mainloop_iterate(mainloop, 0, NULL);
 
-    usleep(50);
+      writeAudio();
+      if(!receive(inputFd)) running = 0;
+      checkFormat();
+      receiverWakeup(&rx);
+
+      usleep(50);
+    }
+  } else {
+    pa_mainloop_api *api = pa_mainloop_get_api(mainloop);
+    if(!api->io_new(api, inputFd, PA_IO_EVENT_INPUT | PA_IO_EVENT_HANGUP, inputAvailable, NULL)) {
+      fprintf(stderr, "Failed to watch input.\n");
+      return 1;
+    }
+
+    while(running) {
+      pa_mainloop_iterate(mainloop, 1, NULL);
+      receiverWakeup(&rx);
+    }
   }
 
   return 0;
@@ -1,8 +1,12 @@
 #include "common.h"
 
-#define __USE_BSD
-#define __USE_POSIX199309
-#define __USE_XOPEN_EXTENDED
+#define __USE_BSD 1
+#define __USE_POSIX199309 1
+#define __USE_XOPEN_EXTENDED 1
+#define __USE_XOPEN2K 1
+#define __USE_POSIX2 1
+#define __USE_GNU 1
+#define __USE_MISC 1
 
 #include <pulse/pulseaudio.h>
 #include <stdio.h>
@@ -14,6 +18,12 @@
 #include <string.h>
 #include <netinet/ip.h>
 #include <unistd.h>
+#include <stdlib.h>
+
+#include "format.h"
+#include "pilot.h"
+#include "sender.h"
+#include "transport.h"
 
 #define BUFFER_SIZE 400
 #define IGN(x) __##x __attribute__((unused))
@@ -22,12 +32,32 @@ int running;
 
 pa_context *ctx;
 pa_stream *stream;
-uint64_t position;
+sender tx;
+int reportSyscalls = 0;
+uint64_t nextSyscallReport = 0;
 
 char *pulseaudioName = "unnamed";
+audioFormat format;
+
+int pilotEnabled = 0;
+pilot latencyPilot;
+char *pilotBuffer; // captured audio with the pilot mixed in
+size_t pilotBufferSize;
+
+void backChannelAvailable(pa_mainloop_api *IGN(api), pa_io_event *IGN(event), int IGN(fd), pa_io_event_flags_t IGN(flags), void *userdata) {
+  senderReceiveFrom(&tx, userdata);
+}
+
+pa_sample_format_t pulseFormat(int format) {
+  switch(format) {
+    case SAMPLE_S24LE: return PA_SAMPLE_S24LE;
+    case SAMPLE_FLOAT32LE: return PA_SAMPLE_FLOAT32LE;
+    default: return PA_SAMPLE_S16LE;
+  }
+}
 
 void streamStateChanged(pa_stream *IGN(stream), void *IGN(userdata)) {
-  pa_stream_state_t state = pa_context_get_state(ctx);
+  pa_stream_state_t state = pa_stream_get_state(stream);
   fprintf(stderr, "pulseaudio stream state changed: %d\n", state);
 }
 
@@ -40,22 +70,51 @@ void dataAvailable(pa_stream *IGN(stream), size_t IGN(bytes), void *IGN(userdata
     return;
   }
 
-  struct timespec t;
-  if(clock_gettime(CLOCK_REALTIME, &t)) {
-    fprintf(stderr, "Failed to get current time: %s\n", strerror(errno));
-    return;
-  }
+  if(!available) return;
 
-  dataPacket packet;
-  packet.length = available + 3 * sizeof(uint64_t);
-  packet.position = position;
-  packet.time = (uint64_t)(t.tv_sec) * 1000000000 + t.tv_nsec;
-  memcpy(packet.data, data, available);
+  if(!data) {
+    // hole in the capture, keep positions in sync with the audio clock
+    senderSkip(&tx, available);
+  } else {
+    struct timespec t;
+    if(clock_gettime(CLOCK_REALTIME, &t)) {
+      fprintf(stderr, "Failed to get current time: %s\n", strerror(errno));
+      return;
+    }
 
-  write(1, &packet, sizeof(packet) - sizeof(packet.data) + available);
+    uint64_t time = (uint64_t)(t.tv_sec) * 1000000000 + t.tv_nsec;
 
-  position += available;
-  // fprintf(stderr, "Data transmitted. Position now at: %llu\n", (long long unsigned int)position);
+    if(pilotEnabled) {
+      if(available > pilotBufferSize) {
+        char *grown = realloc(pilotBuffer, available);
+        if(!grown) {
+          fprintf(stderr, "Failed to allocate pilot buffer.\n");
+          pa_stream_drop(stream);
+          return;
+        }
+        pilotBuffer = grown;
+        pilotBufferSize = available;
+      }
+
+      memcpy(pilotBuffer, data, available);
+      pilotMix(&latencyPilot, &format, pilotBuffer, available, time);
+      data = pilotBuffer;
+    }
+
+    senderSend(&tx, data, available, time);
+    senderFlush(&tx);
+    if(tx.broken) running = 0;
+  }
+
+  // fprintf(stderr, "Data transmitted. Position now at: %llu\n", (long long unsigned int)tx.position);
+
+  if(reportSyscalls && tx.position >= nextSyscallReport) {
+    fprintf(stderr, "Syscalls per second of audio: %.1f\n", tx.syscalls * (double)bytesPerSecond(&format) / tx.position);
+    if(tx.codec) fprintf(stderr, "Compressed to %.1f%%\n", 100.0 * tx.codedBytes / tx.bytesSent);
+    if(tx.silenceThreshold >= 0) fprintf(stderr, "Suppressed %.1f%% as silence\n", 100.0 * tx.suppressedBytes / tx.position);
+    if(tx.datagrams) senderReportDestinations(&tx);
+    nextSyscallReport = tx.position + 10 * bytesPerSecond(&format);
+  }
 
   if(pa_stream_drop(stream)) {
     fprintf(stderr, "Failed to acknowledge stream data: %s\n", pa_strerror(pa_context_errno(ctx)));
@@ -70,9 +129,9 @@ void contextStateChanged(pa_context *IGN(ctx), void *IGN(userdata)) {
   if(state != PA_CONTEXT_READY) return;
 
   pa_sample_spec sample_spec;
-  sample_spec.format = PA_SAMPLE_S16LE;
-  sample_spec.channels = 2;
-  sample_spec.rate = 44100;
+  sample_spec.format = pulseFormat(format.format);
+  sample_spec.channels = format.channels;
+  sample_spec.rate = format.rate;
 
   stream = pa_stream_new(ctx, "forwarding", &sample_spec, NULL);
   if(!stream) {
@@ -96,16 +155,131 @@ void contextStateChanged(pa_context *IGN(ctx), void *IGN(userdata)) {
 }
 
 int main(int argc, char **argv) {
-  if(argc != 1 && argc != 2) {
-    fprintf(stderr, "Usage: ./pulse-sender [name]\n");
+  char *destinations[SENDER_MAX_DESTINATIONS];
+  int destinationCount = 0;
+  size_t combineBytes = 0;
+  size_t maxPayload = 0;
+  int legacy = 0;
+  int fecData = 0, fecParities = 1;
+  double historyTime = 0.5;
+  double pilotLevel = 0;
+  int codecEnabled = 0;
+  char *silenceLevel = NULL;
+  float silenceThreshold = 0;
+  int streamId = 0;
+  int opt;
+
+  format = defaultFormat;
+
+  while((opt = getopt(argc, argv, "u:c:m:f:F:R:P:CZ:i:sL")) != -1) {
+    switch(opt) {
+      case 'u':
+        if(destinationCount == SENDER_MAX_DESTINATIONS) {
+          fprintf(stderr, "At most %d destinations are supported.\n", SENDER_MAX_DESTINATIONS);
+          return 1;
+        }
+        destinations[destinationCount++] = optarg;
+        break;
+      case 'c': combineBytes = atoi(optarg); break;
+      case 'm': maxPayload = atoi(optarg); break;
+      case 'f':
+        if(parseFormat(optarg, &format)) return 1;
+        break;
+      case 'F':
+        fecData = atoi(optarg);
+        if(strchr(optarg, ':')) fecParities = atoi(strchr(optarg, ':') + 1);
+        if(fecData < 1 || fecData > FEC_MAX_DATA || fecParities < 1 || fecParities > FEC_MAX_PARITY) {
+          fprintf(stderr, "Invalid FEC spec, use 1 to %d packets and 1 to %d parities per group.\n", FEC_MAX_DATA, FEC_MAX_PARITY);
+          return 1;
+        }
+        break;
+      case 'R': historyTime = atof(optarg) / 1000; break;
+      case 'P':
+        if(parsePilotLevel(optarg, &pilotLevel)) return 1;
+        pilotEnabled = 1;
+        break;
+      case 'C': codecEnabled = 1; break;
+      case 'Z': silenceLevel = optarg; break;
+      case 'i': streamId = atoi(optarg); break;
+      case 's': reportSyscalls = 1; break;
+      case 'L': legacy = 1; break;
+      default:
+        fprintf(stderr, "Usage: ./pulse-sender [-u host:port] [-c bytes] [-m bytes] [-f format] [-F data:parities] [-R ms] [-P dBFS] [-C] [-Z dBFS] [-i id] [-s] [-L] [name]\n");
+        fprintf(stderr, "  -u  send UDP datagrams to host:port instead of writing to stdout, repeat it\n");
+        fprintf(stderr, "      for more receivers; multicast groups are sent to through one socket\n");
+        fprintf(stderr, "  -c  combine fragments until at least this many bytes are pending\n");
+        fprintf(stderr, "  -m  maximum payload per packet\n");
+        fprintf(stderr, "  -f  capture format[:channels[:rate]], format one of s16le, s24le, float32le\n");
+        fprintf(stderr, "  -F  send parities parity packets per data audio packets, e.g. 8:2 for 25%% overhead\n");
+        fprintf(stderr, "  -R  keep this much audio for answering NACKs over UDP, default 500, 0 to disable\n");
+        fprintf(stderr, "  -P  mix a pseudo-noise pilot at this level into the audio, e.g. -55,\n");
+        fprintf(stderr, "      for measuring latency with pulse-calibration -p while streaming\n");
+        fprintf(stderr, "  -C  compress the audio losslessly, for s16le and s24le\n");
+        fprintf(stderr, "  -Z  stop sending audio which stays at or below this level, e.g. -70, or zero\n");
+        fprintf(stderr, "      for digital silence only; receivers play silence meanwhile\n");
+        fprintf(stderr, "  -i  stream ID, for per-stream gains in mixing receivers, default 0\n");
+        fprintf(stderr, "  -s  report syscalls per second of audio\n");
+        fprintf(stderr, "  -L  use the legacy wire format\n");
+        return 1;
+    }
+  }
+
+  if((argc - optind != 0 && argc - optind != 1) || streamId < 0 || streamId > 65535) {
+    fprintf(stderr, "Usage: ./pulse-sender [-u host:port] [-c bytes] [-m bytes] [-f format] [-F data:parities] [-R ms] [-P dBFS] [-C] [-Z dBFS] [-i id] [-s] [-L] [name]\n");
     return 1;
   }
 
-  if(argc == 2) {
-    pulseaudioName = argv[1];
+  if(argc - optind == 1) {
+    pulseaudioName = argv[optind];
   }
 
-  position = 0;
+  if(legacy && !formatEqual(&format, &defaultFormat)) {
+    fprintf(stderr, "The legacy wire format can only carry s16le:2:44100.\n");
+    return 1;
+  }
+
+  if(legacy && fecData) {
+    fprintf(stderr, "The legacy wire format has no parity packets.\n");
+    return 1;
+  }
+
+  if(silenceLevel && parseSilenceLevel(silenceLevel, format.format, &silenceThreshold)) return 1;
+
+  if(streamId && legacy) {
+    fprintf(stderr, "The legacy wire format carries no stream ID.\n");
+    return 1;
+  }
+
+  if(silenceLevel && legacy) {
+    fprintf(stderr, "The legacy wire format cannot announce silence.\n");
+    return 1;
+  }
+
+  if(codecEnabled && (legacy || fecData || format.format == SAMPLE_FLOAT32LE)) {
+    fprintf(stderr, "Compression needs the current wire format, no parity packets and an integer sample format.\n");
+    return 1;
+  }
+
+  senderInit(&tx, destinationCount? -1: 1, destinationCount != 0, &format);
+  for(int i = 0; i < destinationCount; ++i) {
+    struct sockaddr_storage group;
+    socklen_t groupLength;
+    int fd = udpOpenGroup(destinations[i], 0, &group, &groupLength);
+    if(fd < 0 || senderAddDestination(&tx, fd, destinations[i], &group, groupLength)) return 1;
+  }
+
+  tx.combineBytes = combineBytes;
+  tx.stream.stream = streamId;
+  tx.legacy = legacy;
+  if(maxPayload && maxPayload < tx.maxPayload) senderSetMaxPayload(&tx, maxPayload);
+  if(pilotEnabled) pilotInit(&latencyPilot, pilotLevel, &format);
+  if(codecEnabled) senderSetCodec(&tx);
+  if(silenceLevel) senderSetSilence(&tx, silenceThreshold);
+  if(fecData) senderSetFec(&tx, fecData, fecParities);
+  if(destinationCount && historyTime > 0 && senderSetHistory(&tx, bytesPerSecond(&format) * historyTime)) {
+    fprintf(stderr, "Failed to allocate retransmission history.\n");
+    return 1;
+  }
 
   pa_mainloop *mainloop = pa_mainloop_new();
   if(!mainloop) {
@@ -113,6 +287,15 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  // receivers ask for our clock over the same sockets
+  for(int i = 0; i < destinationCount; ++i) {
+    pa_mainloop_api *api = pa_mainloop_get_api(mainloop);
+    if(!api->io_new(api, tx.destinations[i].fd, PA_IO_EVENT_INPUT, backChannelAvailable, &tx.destinations[i])) {
+      fprintf(stderr, "Failed to watch back channel.\n");
+      return 1;
+    }
+  }
+
   char nameBuf[1024];
   snprintf(nameBuf, 1024, "Remoteplay to %s", pulseaudioName);
   nameBuf[sizeof(nameBuf) - 1] = '\0';
@@ -139,5 +322,5 @@ int main(int argc, char **argv) {
     pa_mainloop_iterate(mainloop, 1, NULL);
   }
 
-  return 0;
+  return tx.broken? 1: 0;
 }
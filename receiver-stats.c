@@ -0,0 +1,109 @@
+#include "common.h"
+
+#define __USE_POSIX199309 1
+#define __USE_POSIX2 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+#define COUNTER(field) printf("%-20s %llu\n", #field, (unsigned long long)metricsLoad(&m->field))
+#define GAUGE(field) printf("%-20s %lld\n", #field, (long long)metricsGet(&m->field))
+
+int main(int argc, char **argv) {
+  double interval = 0;
+  int opt;
+
+  while((opt = getopt(argc, argv, "i:")) != -1) {
+    switch(opt) {
+      case 'i': interval = atof(optarg); break;
+      default:
+        fprintf(stderr, "Usage: ./receiver-stats [-i seconds] name\n");
+        fprintf(stderr, "  -i  print again every this many seconds, histograms then cover the interval\n");
+        return 1;
+    }
+  }
+
+  if(argc - optind != 1) {
+    fprintf(stderr, "Usage: ./receiver-stats [-i seconds] name\n");
+    return 1;
+  }
+
+  const receiverMetrics *m = metricsAttach(argv[optind]);
+  if(!m) return 1;
+
+  uint64_t previousDelay[METRICS_DELAY_BINS], previousFill[METRICS_FILL_BINS], previousSizes[METRICS_SIZE_BINS];
+  uint64_t previousError[METRICS_ERROR_BINS];
+  int havePrevious = 0;
+
+  while(1) {
+    COUNTER(packets);
+    COUNTER(bytes);
+    COUNTER(placed);
+    COUNTER(latePackets);
+    COUNTER(tooLate);
+    COUNTER(resetsAhead);
+    COUNTER(resetsBehind);
+    COUNTER(queueDropped);
+    COUNTER(xruns);
+    COUNTER(wakeups);
+    COUNTER(fecRecovered);
+    COUNTER(fecUnrecovered);
+    COUNTER(simulatedLoss);
+    COUNTER(nackRequested);
+    COUNTER(retransmitted);
+    COUNTER(retransmitTooLate);
+    COUNTER(gapsExpired);
+    COUNTER(silenceMarkers);
+    COUNTER(silenceFrames);
+    GAUGE(latencyUs);
+    GAUGE(localPosition);
+    GAUGE(localPositionAvg);
+    GAUGE(desiredPositionAvg);
+    GAUGE(ratioPpb);
+    GAUGE(driftFrames);
+    GAUGE(outputDelayUs);
+    COUNTER(correctedFrames);
+    COUNTER(writes);
+
+    uint64_t delay[METRICS_DELAY_BINS], fill[METRICS_FILL_BINS], sizes[METRICS_SIZE_BINS];
+    uint64_t error[METRICS_ERROR_BINS];
+    metricsLoadBins(delay, m->arrivalDelay, havePrevious? previousDelay: NULL, METRICS_DELAY_BINS);
+    metricsLoadBins(fill, m->bufferFill, havePrevious? previousFill: NULL, METRICS_FILL_BINS);
+    metricsLoadBins(sizes, m->writeSizes, havePrevious? previousSizes: NULL, METRICS_SIZE_BINS);
+    metricsLoadBins(error, m->playoutError, havePrevious? previousError: NULL, METRICS_ERROR_BINS);
+
+    printf("%-20s p50 %.0f ms, p99 %.0f ms, p99.9 %.0f ms\n", "arrivalDelay",
+        metricsPercentile(delay, METRICS_DELAY_BINS, 0.5), metricsPercentile(delay, METRICS_DELAY_BINS, 0.99),
+        metricsPercentile(delay, METRICS_DELAY_BINS, 0.999));
+    printf("%-20s p1 %.0f ms, p50 %.0f ms, p99 %.0f ms\n", "bufferFill",
+        2 * metricsPercentile(fill, METRICS_FILL_BINS, 0.01), 2 * metricsPercentile(fill, METRICS_FILL_BINS, 0.5),
+        2 * metricsPercentile(fill, METRICS_FILL_BINS, 0.99));
+    printf("%-20s p50 %.2f ms, p99 %.2f ms\n", "playoutError",
+        metricsPercentile(error, METRICS_ERROR_BINS, 0.5) / 4, metricsPercentile(error, METRICS_ERROR_BINS, 0.99) / 4);
+    printf("%-20s", "writeSizes");
+    for(int i = 0; i < METRICS_SIZE_BINS; ++i) {
+      if(sizes[i]) printf(" <%d: %llu", 1 << i, (unsigned long long)sizes[i]);
+    }
+    printf("\n");
+
+    if(interval <= 0) break;
+
+    metricsLoadBins(previousDelay, m->arrivalDelay, NULL, METRICS_DELAY_BINS);
+    metricsLoadBins(previousFill, m->bufferFill, NULL, METRICS_FILL_BINS);
+    metricsLoadBins(previousSizes, m->writeSizes, NULL, METRICS_SIZE_BINS);
+    metricsLoadBins(previousError, m->playoutError, NULL, METRICS_ERROR_BINS);
+    havePrevious = 1;
+
+    printf("\n");
+    fflush(stdout);
+    struct timespec wait = { (time_t)interval, (long)((interval - (time_t)interval) * 1000000000) };
+    nanosleep(&wait, NULL);
+  }
+
+  return 0;
+}
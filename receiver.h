@@ -0,0 +1,1066 @@
+#ifndef H_8B141906_9E44_4DC8_8656_CE103A54D86E
+#define H_8B141906_9E44_4DC8_8656_CE103A54D86E
+
+#include "common.h"
+#include "clocksync.h"
+#include "codec.h"
+#include "fec.h"
+#include "format.h"
+#include "playout.h"
+#include "framing.h"
+#include "jitter.h"
+#include "losssim.h"
+#include "metrics.h"
+#include "nack.h"
+#include "resampler.h"
+#include "silence.h"
+#include "spsc.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define RECEIVER_QUEUE_PACKETS 512 // about a second of full size packets at 48kHz stereo
+#define RECEIVER_QUEUE_EVENTS 64
+
+// an audio packet ready for placement, its time already on the local clock
+struct audioPacket_t {
+  uint64_t position;
+  uint64_t time;  // local nanoseconds since the epoch at which it was captured
+  int synced;     // time was mapped through a clock estimate
+  double latency; // target latency in force when it arrived, in s
+  size_t silence; // bytes of silence announced from position, instead of a payload
+};
+
+typedef struct audioPacket_t audioPacket;
+
+// handed from the network thread to the audio thread
+struct queuedPacket_t {
+  audioPacket packet;
+  size_t length;
+  char data[MAX_PAYLOAD];
+};
+
+typedef struct queuedPacket_t queuedPacket;
+
+enum receiverEventType {
+  RECEIVER_TOO_LATE,
+  RECEIVER_TOO_FAR_AHEAD,
+  RECEIVER_TOO_FAR_BEHIND,
+  RECEIVER_STATUS,
+  RECEIVER_DEVICE, // a message from the device code, see receiverReportDevice
+};
+
+// what placement or the device has to report, printed by a thread which may do I/O
+struct receiverEvent_t {
+  int type; // enum receiverEventType
+  double packetToPlayIn;
+  int64_t localPosition;
+  float localPositionAvg;
+  double ratio;
+  uint64_t latePackets;
+
+  const char *message;            // RECEIVER_DEVICE: a string literal
+  int value;                      // an error code or state
+  const char *(*describe)(int);   // turns value into text, e.g. snd_strerror, or NULL to print it as is
+};
+
+typedef struct receiverEvent_t receiverEvent;
+
+// Device independent part of a receiver: packet parsing, placement into the
+// playout buffer and drift tracking.
+//
+// By default everything runs on one thread. With receiverStartQueues,
+// parsing and clock synchronisation stay on the network thread while
+// placement, drift tracking and rendering move to the audio thread, which
+// then never allocates, locks or prints: packets reach it through one queue
+// and its reports leave through another.
+struct receiver_t {
+  audioFormat format; // of the playout buffer and the device
+  size_t frameBytes;
+  float bytesPerSecond;
+  int fixedFormat;    // set by the user, streams in other formats are dropped
+  int formatChanged;  // the stream switched to pendingFormat, see receiverFollowFormat
+  audioFormat pendingFormat;
+  double targetLatency;  // in s, as configured; sizes the playout buffer and caps latency
+  double latency;        // current target in s, owned by the network thread
+  int adaptive;          // latency follows a percentile of the measured arrival delay
+  double latencyPercentile;
+  double latencyMargin;  // in s, on top of the percentile
+  double latencyReported;
+  uint64_t latencyUpdated; // monotonic nanoseconds
+  jitterHistogram jitter;
+  float localPositionBlend;
+  double driftCorrectionTime; // in s, how quickly buffer fill errors are corrected
+  double maximumCorrection;   // largest deviation of the resampling ratio from 1
+
+  uint64_t senderOffset; // incoming packet offset which would start at the playout read cursor
+  float localPositionAvg;
+  float desiredPositionAvg; // where packets should have landed, averaged the same way
+
+  int group;             // group playout, see receiverSetOutputDelay
+  int groupAnchored;     // placement has been reset onto the shared clock once
+  uint64_t outputDelay;  // ns from rendering a frame until it is heard, as the device last reported
+  uint64_t cursorDue;    // local time at which the frame at the read cursor will be heard, 0 if unknown
+  double clockRateError; // learned device clock rate error in group mode, part of the resampling ratio
+
+  resampler rs;
+
+  playoutBuffer playout;
+  framingBuffer input;
+
+  int datagrams; // input is a UDP socket, one packet per datagram
+  char datagram[sizeof(dataPacket)];
+
+  struct sockaddr_storage peer; // where datagrams come from, for the back channel
+  socklen_t peerLength;
+  clockSync clock;
+
+  int haveStreamHeader; // version 3 streams need one before audio can be placed
+  int legacyStream;     // version 0 packets arrive, which are in defaultFormat
+  int streamUsable;     // its sample spec matches the device
+  streamHeader stream;
+  uint64_t newestPosition; // network thread, references for receiverUnwrap
+  uint64_t newestTime;
+
+  uint64_t nextPosition; // end of the newest packet placed so far
+  uint64_t latePackets;  // reordered or duplicate packets which missed playout
+  uint64_t silenceEnd;   // sender position up to which silence was announced, 0 for none
+
+  fecDecoder fec;
+  char parity[MAX_PAYLOAD]; // parity payload made contiguous
+  codec codec;              // network thread, decodes PACKET_CODED
+  uint8_t coded[MAX_PAYLOAD]; // coded payload made contiguous
+  char decoded[MAX_PAYLOAD];
+  lossSimulator loss;       // drops incoming packets for testing, see lossParse
+  nackTracker nack;         // network thread, asks UDP senders for lost packets
+  traceWriter trace;        // network thread, records incoming packets, see receiverRecord
+  uint64_t lossReportedAt;  // monotonic nanoseconds
+  uint64_t lossCountersReported; // sum of all counters printed by receiverReportLoss
+
+  int threaded;
+  spscQueue packets; // network to audio thread
+  spscQueue events;  // audio to network thread
+  uint64_t droppedPackets; // queue overflows, network thread only
+  uint64_t droppedPacketsReported;
+
+  int debugRate; // packets between status lines, 0 for none
+  int debugCounter;
+
+  receiverMetrics *metrics; // ownMetrics unless published, see receiverPublishMetrics
+  receiverMetrics ownMetrics;
+
+  int reportWakeups;
+  uint64_t wakeups;
+  uint64_t wakeupsSince; // monotonic nanoseconds
+};
+
+typedef struct receiver_t receiver;
+
+static inline int frameAlign(float f, size_t frameBytes) {
+  return ((int)f) / (int)frameBytes * (int)frameBytes;
+}
+
+static inline uint64_t monotonicNow() {
+  struct timespec t;
+  if(clock_gettime(CLOCK_MONOTONIC, &t)) {
+    fprintf(stderr, "Failed to get current time: %s\n", strerror(errno));
+  }
+
+  return (uint64_t)(t.tv_sec) * 1000000000 + t.tv_nsec;
+}
+
+// switches playout to another format, forgetting everything buffered
+static inline int receiverSetFormat(receiver *rx, const audioFormat *format) {
+  playoutBuffer playout;
+  if(playoutInit(&playout, 4 * bytesPerSecond(format) * rx->targetLatency, format)) return -1;
+
+  if(rx->playout.data) {
+    playout.beepOnFailure = rx->playout.beepOnFailure;
+    playoutFree(&rx->playout);
+  }
+  rx->playout = playout;
+
+  rx->format = *format;
+  rx->frameBytes = frameBytes(format);
+  rx->bytesPerSecond = bytesPerSecond(format);
+  rx->senderOffset = -1ull << 62;
+  rx->localPositionAvg = 0;
+  rx->desiredPositionAvg = 0;
+  rx->silenceEnd = 0;
+  rx->groupAnchored = 0;
+  rx->cursorDue = 0;
+  rx->clockRateError = 0;
+  resamplerSetFormat(&rx->rs, format);
+  return 0;
+}
+
+static inline int receiverInit(receiver *rx, const audioFormat *format, double targetLatency) {
+  rx->targetLatency = targetLatency;
+  rx->latency = targetLatency;
+  rx->adaptive = 0;
+  rx->latencyPercentile = 0.99;
+  rx->latencyMargin = 0.01;
+  rx->latencyReported = targetLatency;
+  rx->latencyUpdated = 0;
+  jitterInit(&rx->jitter);
+  rx->localPositionBlend = 0.002;
+  rx->driftCorrectionTime = 5;
+  rx->maximumCorrection = 0.005;
+  rx->group = 0;
+  rx->outputDelay = 0;
+
+  rx->fixedFormat = 0;
+  rx->formatChanged = 0;
+
+  rx->datagrams = 0;
+  rx->peerLength = 0;
+  clockSyncInit(&rx->clock);
+  rx->haveStreamHeader = 0;
+  rx->legacyStream = 0;
+  rx->streamUsable = 0;
+  rx->newestPosition = 0;
+  rx->newestTime = 0;
+  rx->nextPosition = 0;
+  rx->latePackets = 0;
+  rx->silenceEnd = 0;
+
+  fecDecoderInit(&rx->fec);
+  lossInit(&rx->loss);
+  nackInit(&rx->nack);
+  traceInit(&rx->trace);
+  rx->lossReportedAt = 0;
+  rx->lossCountersReported = 0;
+
+  rx->threaded = 0;
+  rx->droppedPackets = 0;
+  rx->droppedPacketsReported = 0;
+
+  rx->debugRate = 0;
+  rx->debugCounter = 0;
+
+  metricsInit(&rx->ownMetrics);
+  rx->metrics = &rx->ownMetrics;
+  metricsSet(&rx->metrics->latencyUs, targetLatency * 1000000);
+
+  rx->reportWakeups = 0;
+  rx->wakeups = 0;
+  rx->wakeupsSince = 0;
+
+  framingInit(&rx->input);
+  rx->playout.data = NULL;
+  return receiverSetFormat(rx, format);
+}
+
+// moves the metrics into shared memory, before any thread is running
+static inline int receiverPublishMetrics(receiver *rx, const char *name) {
+  receiverMetrics *m = metricsPublish(name);
+  if(!m) return -1;
+
+  metricsSet(&m->latencyUs, rx->latency * 1000000);
+  rx->metrics = m;
+  return 0;
+}
+
+// records every incoming packet with its arrival time to a trace file for
+// trace-replay, before any thread is running
+static inline int receiverRecord(receiver *rx, const char *path) {
+  return traceCreate(&rx->trace, path);
+}
+
+// a packet as it arrived, before the loss simulator
+static inline void receiverTrace(receiver *rx, const char *packet, size_t len) {
+  if(!rx->trace.file) return;
+
+  uint64_t now = realtimeNow();
+  traceWrite(&rx->trace, now, clockSyncOffset(&rx->clock, now), packet, len);
+}
+
+// switches to split network and audio threads, before either is running
+static inline int receiverStartQueues(receiver *rx) {
+  if(spscInit(&rx->packets, sizeof(queuedPacket), RECEIVER_QUEUE_PACKETS)) return -1;
+  if(spscInit(&rx->events, sizeof(receiverEvent), RECEIVER_QUEUE_EVENTS)) return -1;
+
+  rx->threaded = 1;
+  return 0;
+}
+
+static inline void receiverPrintEvent(const receiverEvent *event) {
+  switch(event->type) {
+    case RECEIVER_TOO_LATE:
+      fprintf(stderr, "Packet arrived too late.\n");
+      break;
+    case RECEIVER_TOO_FAR_AHEAD:
+      fprintf(stderr, "Playback is too far ahead.\n");
+      break;
+    case RECEIVER_TOO_FAR_BEHIND:
+      fprintf(stderr, "Playback is too far behind.\n");
+      break;
+    case RECEIVER_DEVICE:
+      if(event->describe) {
+        fprintf(stderr, "%s: %s\n", event->message, event->describe(event->value));
+      } else {
+        fprintf(stderr, "%s: %d\n", event->message, event->value);
+      }
+      break;
+    default:
+      fprintf(stderr, "Packet for: +%lfs, buf pos: %lld, avg %f, ratio %.6f, late %llu\n", event->packetToPlayIn,
+          (long long int)event->localPosition, event->localPositionAvg, event->ratio, (unsigned long long)event->latePackets);
+      break;
+  }
+}
+
+// prints right away, or leaves it to receiverPrintEvents when on the audio thread
+static inline void receiverReport(receiver *rx, int type, double packetToPlayIn, int64_t localPosition) {
+  receiverEvent local;
+  receiverEvent *event = rx->threaded? spscWriteSlot(&rx->events): &local;
+  if(!event) return;
+
+  event->type = type;
+  event->packetToPlayIn = packetToPlayIn;
+  event->localPosition = localPosition;
+  event->localPositionAvg = rx->localPositionAvg;
+  event->ratio = rx->rs.ratio;
+  event->latePackets = rx->latePackets;
+
+  if(rx->threaded) {
+    spscPush(&rx->events);
+  } else {
+    receiverPrintEvent(event);
+  }
+}
+
+// like receiverReport for the device code, which may run on the audio
+// thread too; message has to outlive the event
+static inline void receiverReportDevice(receiver *rx, const char *message, int value, const char *(*describe)(int)) {
+  receiverEvent local;
+  receiverEvent *event = rx->threaded? spscWriteSlot(&rx->events): &local;
+  if(!event) return;
+
+  event->type = RECEIVER_DEVICE;
+  event->message = message;
+  event->value = value;
+  event->describe = describe;
+
+  if(rx->threaded) {
+    spscPush(&rx->events);
+  } else {
+    receiverPrintEvent(event);
+  }
+}
+
+// network thread: prints what the audio thread reported
+static inline void receiverPrintEvents(receiver *rx) {
+  if(!rx->threaded) return;
+
+  receiverEvent *event;
+  while((event = spscReadSlot(&rx->events))) {
+    receiverPrintEvent(event);
+    spscPop(&rx->events);
+  }
+
+  if(rx->droppedPackets != rx->droppedPacketsReported) {
+    fprintf(stderr, "Audio thread is not keeping up, dropped %llu packets.\n",
+        (unsigned long long)(rx->droppedPackets - rx->droppedPacketsReported));
+    rx->droppedPacketsReported = rx->droppedPackets;
+  }
+}
+
+// copies a payload into the playout buffer, skipping whatever lies before the read cursor
+static inline void receiverStore(receiver *rx, int64_t localPosition,
+    const char *payload1, size_t len1, const char *payload2, size_t len2) {
+  if(localPosition < 0) {
+    size_t skip = -localPosition;
+    if(skip >= len1) {
+      payload2 += skip - len1;
+      len2 -= skip - len1;
+      len1 = 0;
+    } else {
+      payload1 += skip;
+      len1 -= skip;
+    }
+    localPosition = 0;
+  }
+
+  if(len1) playoutWrite(&rx->playout, localPosition, payload1, len1);
+  if(len2) playoutWrite(&rx->playout, localPosition + len1, payload2, len2);
+}
+
+// audio thread: turns announced silence into zeros up to local position
+// end, only right before it is needed so that audio arriving for the same
+// positions still takes precedence
+static inline void receiverSynthesizeSilence(receiver *rx, int64_t end) {
+  if(!rx->silenceEnd) return;
+
+  int64_t silenceEnd = rx->silenceEnd - rx->senderOffset;
+  if(silenceEnd <= 0) {
+    rx->silenceEnd = 0;
+    return;
+  }
+
+  if(end > silenceEnd) end = silenceEnd;
+  if(end > (int64_t)rx->playout.size) end = rx->playout.size;
+  end = end / rx->frameBytes * rx->frameBytes;
+  if(end <= (int64_t)rx->playout.written) return;
+
+  metricsAdd(&rx->metrics->silenceFrames, (end - rx->playout.written) / rx->frameBytes);
+  playoutSilence(&rx->playout, end);
+}
+
+// seconds until audio captured at a local time is due for playout
+static inline double receiverPlayIn(uint64_t time, double latency, uint64_t now) {
+  return ((double)time + latency * 1000000000 - now) / 1000000000;
+}
+
+// Group playout: receivers of one stream in different rooms should be
+// heard in step, not just render in step. With group set, a packet is due
+// to be heard latency after its capture on the sender's clock, which every
+// receiver shares through clock synchronisation, and placement measures from
+// when the frame at the read cursor will be heard rather than from now. That
+// takes the device's own buffering into account, which backends report here
+// before rendering, and the time until the next render, which otherwise
+// differs with the device period. Audio thread only.
+static inline void receiverSetOutputDelay(receiver *rx, uint64_t delay) {
+  rx->outputDelay = delay;
+  metricsSet(&rx->metrics->outputDelayUs, delay / 1000);
+}
+
+// forgets buffered audio and places the packet where it should land,
+// returns its new local position
+static inline int64_t receiverReanchor(receiver *rx, const audioPacket *packet, int64_t desiredLocalPosition) {
+  playoutReset(&rx->playout);
+  rx->senderOffset = packet->position - frameAlign(desiredLocalPosition, rx->frameBytes);
+  rx->localPositionAvg = packet->position - rx->senderOffset;
+  rx->desiredPositionAvg = desiredLocalPosition;
+  rx->nextPosition = packet->position;
+  resamplerReset(&rx->rs);
+  return packet->position - rx->senderOffset;
+}
+
+// places a packet and updates the drift correction, runs on the audio thread
+static inline void receivePacket(receiver *rx, const audioPacket *packet,
+    const char *payload1, size_t len1, const char *payload2, size_t len2) {
+  // With a clock estimate the sender's timestamps can be trusted, so the
+  // packet is due targetLatency after its capture and should land that far
+  // ahead of the read cursor. Without one, assume the network is instant.
+  uint64_t now = realtimeNow();
+  double packetToPlayIn = receiverPlayIn(packet->time, packet->latency, now);
+  int grouped = rx->group && packet->synced && rx->cursorDue;
+  double cursorToPacket = grouped? receiverPlayIn(packet->time, packet->latency, rx->cursorDue): packetToPlayIn;
+
+  int64_t dataLen = len1 + len2;
+  int64_t localPosition = packet->position - rx->senderOffset;
+  int64_t desiredLocalPosition = rx->bytesPerSecond * (packet->synced? cursorToPacket: packet->latency);
+
+  // the first packet on the shared clock jumps there, receivers joining a
+  // group should not take seconds of resampling to fall in step
+  if(grouped && !rx->groupAnchored) {
+    rx->groupAnchored = 1;
+    localPosition = receiverReanchor(rx, packet, desiredLocalPosition);
+  }
+
+  // Packets are placed by position, so reordering and loss need no special
+  // handling as long as the packet still lies ahead of the read cursor. An
+  // older packet than the newest one seen which has already (partially) been
+  // played out is just late, only in-order packets can tell that playback
+  // itself is off.
+  int inOrder = packet->position >= rx->nextPosition;
+  int recent = localPosition > -(int64_t)rx->playout.size;
+
+  receiverMetrics *m = rx->metrics;
+  metricsAdd(&m->placed, 1);
+
+  if(packetToPlayIn < 0) {
+    metricsAdd(&m->tooLate, 1);
+    receiverReport(rx, RECEIVER_TOO_LATE, packetToPlayIn, localPosition);
+  } else if(localPosition < 0 && !inOrder && recent) {
+    ++rx->latePackets;
+    metricsAdd(&m->latePackets, 1);
+
+    if(localPosition + dataLen > 0) {
+      receiverStore(rx, localPosition, payload1, len1, payload2, len2);
+    }
+  } else if(localPosition < 0) {
+    metricsAdd(&m->resetsAhead, 1);
+    receiverReport(rx, RECEIVER_TOO_FAR_AHEAD, packetToPlayIn, localPosition);
+
+    localPosition = receiverReanchor(rx, packet, desiredLocalPosition);
+  } else if(localPosition + dataLen > (int64_t)rx->playout.size) {
+    metricsAdd(&m->resetsBehind, 1);
+    receiverReport(rx, RECEIVER_TOO_FAR_BEHIND, packetToPlayIn, localPosition);
+
+    localPosition = receiverReanchor(rx, packet, desiredLocalPosition);
+  } else {
+    receiverSynthesizeSilence(rx, localPosition);
+    receiverStore(rx, localPosition, payload1, len1, payload2, len2);
+
+    if(inOrder) {
+      rx->nextPosition = packet->position + dataLen;
+      rx->localPositionAvg = (1 - rx->localPositionBlend) * rx->localPositionAvg + rx->localPositionBlend * localPosition;
+      rx->desiredPositionAvg = (1 - rx->localPositionBlend) * rx->desiredPositionAvg + rx->localPositionBlend * desiredLocalPosition;
+
+      // Correcting in proportion to the error alone leaves a device whose
+      // clock is off by some ppm that many ppm times driftCorrectionTime
+      // away from where it should be, which rooms with different devices
+      // would hear. Group playout integrates the error into the device's
+      // rate error as well, at a critically damped pace.
+      if(rx->group) {
+        double integration = 2 * rx->driftCorrectionTime;
+        double excess = (rx->localPositionAvg - rx->desiredPositionAvg) / rx->bytesPerSecond;
+        rx->clockRateError += excess * (dataLen / rx->bytesPerSecond) / (integration * integration);
+        if(rx->clockRateError > rx->maximumCorrection) rx->clockRateError = rx->maximumCorrection;
+        if(rx->clockRateError < -rx->maximumCorrection) rx->clockRateError = -rx->maximumCorrection;
+      }
+
+      metricsSet(&m->localPosition, localPosition);
+      metricsSet(&m->localPositionAvg, rx->localPositionAvg);
+      metricsSet(&m->desiredPositionAvg, rx->desiredPositionAvg);
+      metricsBin(m->bufferFill, METRICS_FILL_BINS, localPosition * 500 / rx->bytesPerSecond);
+      metricsBin(m->playoutError, METRICS_ERROR_BINS,
+          llabs(localPosition - desiredLocalPosition) * 4000 / rx->bytesPerSecond);
+    }
+  }
+
+  // a marker extends announced silence, fresh audio ends it
+  if(packet->silence) {
+    rx->silenceEnd = packet->position + packet->silence;
+  } else if(inOrder && dataLen) {
+    rx->silenceEnd = 0;
+  }
+
+  if(rx->debugRate && ++rx->debugCounter > rx->debugRate) {
+    receiverReport(rx, RECEIVER_STATUS, packetToPlayIn, localPosition);
+    rx->debugCounter = 0;
+  }
+
+  // play slightly faster while the buffer is too full, slower while it is too empty
+  double excess = (rx->localPositionAvg - rx->desiredPositionAvg) / rx->bytesPerSecond;
+  double correction = excess / rx->driftCorrectionTime + rx->clockRateError;
+  if(correction > rx->maximumCorrection) correction = rx->maximumCorrection;
+  if(correction < -rx->maximumCorrection) correction = -rx->maximumCorrection;
+  rx->rs.ratio = 1 + correction;
+  metricsSet(&m->ratioPpb, correction * 1000000000);
+}
+
+// adopts the stream's format unless the user asked for a specific one, the
+// switch itself is left to the backend which has to reopen the device
+static inline void receiverStreamFormat(receiver *rx, const audioFormat *format) {
+  rx->streamUsable = formatValid(format) && formatEqual(format, &rx->format);
+  rx->formatChanged = !rx->streamUsable && formatValid(format) && !rx->fixedFormat;
+  rx->pendingFormat = *format;
+
+  fprintf(stderr, "Stream format %s, %d channels, %u Hz%s\n", formatName(format->format), format->channels,
+      format->rate, rx->streamUsable || rx->formatChanged? "": " is not supported, dropping audio");
+}
+
+static inline void receiveStreamHeader(receiver *rx, const char *payload1, size_t len1, const char *payload2, size_t len2) {
+  streamHeader header;
+  if(len1 + len2 < sizeof(header)) {
+    fprintf(stderr, "Stream header too short, ignoring it.\n");
+    return;
+  }
+
+  if(len1 > sizeof(header)) len1 = sizeof(header);
+  memcpy(&header, payload1, len1);
+  memcpy((char *)&header + len1, payload2, sizeof(header) - len1);
+
+  int changed = !rx->haveStreamHeader || header.format != rx->stream.format ||
+    header.channels != rx->stream.channels || header.rate != rx->stream.rate;
+
+  rx->stream = header;
+  rx->haveStreamHeader = 1;
+  rx->legacyStream = 0;
+  rx->newestPosition = header.position; // also after a sender restart
+  rx->newestTime = header.time;
+
+  if(!changed) return;
+
+  audioFormat format = { header.format, header.channels, header.rate };
+  receiverStreamFormat(rx, &format);
+}
+
+// Switches to a format announced by the stream, returns 1 if the device has
+// to be reopened. In threaded mode the audio thread must not be running.
+static inline int receiverFollowFormat(receiver *rx) {
+  if(!rx->formatChanged) return 0;
+  rx->formatChanged = 0;
+
+  if(rx->threaded) {
+    while(spscReadSlot(&rx->packets)) spscPop(&rx->packets);
+  }
+
+  if(receiverSetFormat(rx, &rx->pendingFormat)) {
+    fprintf(stderr, "Failed to allocate playout buffer.\n");
+    return 0;
+  }
+
+  rx->streamUsable = 1;
+  return 1;
+}
+
+// converts a sender timestamp to the local clock
+static inline uint64_t receiverLocalTime(const receiver *rx, uint64_t time) {
+  return time - clockSyncOffset(&rx->clock, realtimeNow());
+}
+
+// places a packet right away, or queues it for the audio thread
+static inline void receiverPlace(receiver *rx, const audioPacket *packet,
+    const char *payload1, size_t len1, const char *payload2, size_t len2) {
+  if(!rx->threaded) {
+    receivePacket(rx, packet, payload1, len1, payload2, len2);
+    return;
+  }
+
+  queuedPacket *slot = spscWriteSlot(&rx->packets);
+  if(!slot || len1 + len2 > sizeof(slot->data)) {
+    ++rx->droppedPackets;
+    metricsAdd(&rx->metrics->queueDropped, 1);
+    return;
+  }
+
+  slot->packet = *packet;
+  slot->length = len1 + len2;
+  if(len1) memcpy(slot->data, payload1, len1);
+  if(len2) memcpy(slot->data + len1, payload2, len2);
+  spscPush(&rx->packets);
+}
+
+// hands a packet to placement, converting its time to the local clock
+static inline void receiverDeliver(receiver *rx, uint64_t position, uint64_t time,
+    const char *payload1, size_t len1, const char *payload2, size_t len2) {
+  audioPacket packet;
+  packet.position = position;
+  packet.synced = clockSyncValid(&rx->clock);
+  packet.time = receiverLocalTime(rx, time);
+  packet.latency = rx->latency;
+  packet.silence = 0;
+
+  receiverPlace(rx, &packet, payload1, len1, payload2, len2);
+}
+
+// like receiverDeliver for announced silence, which placement tracks drift
+// with like audio but only writes out while it is being played
+static inline void receiverDeliverSilence(receiver *rx, uint64_t position, uint64_t time, size_t silence) {
+  audioPacket packet;
+  packet.position = position;
+  packet.synced = clockSyncValid(&rx->clock);
+  packet.time = receiverLocalTime(rx, time);
+  packet.latency = rx->latency;
+  packet.silence = silence;
+
+  receiverPlace(rx, &packet, NULL, 0, NULL, 0);
+}
+
+// audio thread: places everything the network thread queued
+static inline void receiverDrain(receiver *rx) {
+  if(!rx->threaded) return;
+
+  queuedPacket *slot;
+  while((slot = spscReadSlot(&rx->packets))) {
+    receivePacket(rx, &slot->packet, slot->data, slot->length, NULL, 0);
+    spscPop(&rx->packets);
+  }
+}
+
+// network thread: notes which stream bytes arrived, for NACKs
+static inline void receiverTrackGaps(receiver *rx, uint64_t position, size_t len, uint64_t time) {
+  uint64_t deadline = receiverLocalTime(rx, time) + rx->latency * 1000000000;
+  nackArrived(&rx->nack, position, len, deadline, rx->bytesPerSecond, rx->playout.size);
+}
+
+// network thread: measures how late a fresh packet arrived and once a
+// second moves the target latency towards the chosen percentile. The change
+// is slewed at half the drift correction limit, so placement follows it by
+// resampling rather than by jumping.
+static inline void receiverAdaptLatency(receiver *rx, uint64_t time) {
+  if(!rx->adaptive || !clockSyncValid(&rx->clock)) return;
+
+  uint64_t local = receiverLocalTime(rx, time);
+  jitterAdd(&rx->jitter, ((double)realtimeNow() - local) / 1000000000);
+
+  uint64_t now = monotonicNow();
+  if(!rx->latencyUpdated) rx->latencyUpdated = now;
+  if(now - rx->latencyUpdated < 1000000000) return;
+
+  double elapsed = (now - rx->latencyUpdated) / 1000000000.0;
+  rx->latencyUpdated = now;
+
+  double goal = jitterPercentile(&rx->jitter, rx->latencyPercentile) + rx->latencyMargin;
+  if(goal > rx->targetLatency) goal = rx->targetLatency;
+  jitterDecay(&rx->jitter);
+
+  double step = rx->maximumCorrection / 2 * elapsed;
+  if(goal > rx->latency + step) goal = rx->latency + step;
+  if(goal < rx->latency - step) goal = rx->latency - step;
+  rx->latency = goal;
+  metricsSet(&rx->metrics->latencyUs, goal * 1000000);
+
+  double change = rx->latency - rx->latencyReported;
+  if(change >= 0.005 || change <= -0.005) {
+    fprintf(stderr, "Target latency: %f\n", rx->latency);
+    rx->latencyReported = rx->latency;
+  }
+}
+
+// places the packets the last FEC call rebuilt
+static inline void receiverDeliverRecovered(receiver *rx, int count) {
+  for(int i = 0; i < count; ++i) {
+    nackFill(&rx->nack, rx->fec.recoveredPositions[i], rx->fec.recoveredLengths[i]);
+    receiverDeliver(rx, rx->fec.recoveredPositions[i], rx->fec.recoveredTime,
+        (const char *)rx->fec.recoveredData[i], rx->fec.recoveredLengths[i], NULL, 0);
+  }
+}
+
+// asks the sender for missing packets which can still make their deadline
+static inline void receiverSendNacks(receiver *rx, int fd) {
+  // gaps keep their tries until a request can actually go out
+  if(!rx->peerLength || !clockSyncValid(&rx->clock)) return;
+
+  nackRange ranges[NACK_MAX_RANGES];
+  int n = nackDue(&rx->nack, realtimeNow(), ranges, NACK_MAX_RANGES);
+  if(!n) return;
+
+  packetHeader header;
+  memset(&header, 0, sizeof(header));
+  header.length = sizeof(header) + n * sizeof(nackRange);
+  header.type = PACKET_NACK;
+  header.version = PROTOCOL_VERSION;
+
+  char request[sizeof(header) + sizeof(ranges)];
+  memcpy(request, &header, sizeof(header));
+  memcpy(request + sizeof(header), ranges, n * sizeof(nackRange));
+
+  if(sendto(fd, request, header.length, 0, (struct sockaddr *)&rx->peer, rx->peerLength) < 0) {
+    fprintf(stderr, "Failed to send NACK: %s\n", strerror(errno));
+  }
+}
+
+// prints loss and recovery counts when they changed, at most every few seconds
+static inline void receiverReportLoss(receiver *rx) {
+  receiverMetrics *m = rx->metrics;
+  metricsStore(&m->fecRecovered, rx->fec.recovered);
+  metricsStore(&m->fecUnrecovered, rx->fec.unrecovered);
+  metricsStore(&m->simulatedLoss, rx->loss.dropped);
+  metricsStore(&m->nackRequested, rx->nack.requested);
+  metricsStore(&m->retransmitted, rx->nack.retransmitted);
+  metricsStore(&m->retransmitTooLate, rx->nack.tooLate);
+  metricsStore(&m->gapsExpired, rx->nack.expired);
+
+  uint64_t counters = rx->fec.recovered + rx->fec.unrecovered + rx->loss.dropped +
+    rx->nack.requested + rx->nack.retransmitted + rx->nack.tooLate + rx->nack.expired;
+  if(counters == rx->lossCountersReported) return;
+
+  uint64_t now = monotonicNow();
+  if(now - rx->lossReportedAt < 5000000000ull) return;
+
+  if(rx->fec.active || rx->loss.dropped) {
+    fprintf(stderr, "FEC recovered %llu packets, %llu unrecoverable, %llu dropped by the loss simulator\n",
+        (unsigned long long)rx->fec.recovered, (unsigned long long)rx->fec.unrecovered,
+        (unsigned long long)rx->loss.dropped);
+  }
+  if(rx->nack.requested) {
+    fprintf(stderr, "NACKed %llu ranges, %llu retransmissions in time, %llu too late, %llu gaps expired\n",
+        (unsigned long long)rx->nack.requested, (unsigned long long)rx->nack.retransmitted,
+        (unsigned long long)rx->nack.tooLate, (unsigned long long)rx->nack.expired);
+  }
+  rx->lossReportedAt = now;
+  rx->lossCountersReported = counters;
+}
+
+// network thread: the absolute position and time of a version 3 packet from
+// the low 32 bits in its header, nearest to the newest ones seen. The stream
+// header only provides the first references, so packets keep their place
+// when headers are lost or reordered; nextPosition belongs to the audio
+// thread in threaded mode.
+static inline void receiverUnwrap(receiver *rx, const framedPacket *frame, uint64_t *position, uint64_t *time) {
+  *position = unwrap32(rx->newestPosition, frame->position);
+  *time = unwrap32(rx->newestTime / 1000, frame->time) * 1000;
+
+  if((int64_t)(*position - rx->newestPosition) > 0) rx->newestPosition = *position;
+  if((int64_t)(*time - rx->newestTime) > 0) rx->newestTime = *time;
+}
+
+// network thread: a PACKET_AUDIO payload, or a PACKET_CODED one after
+// decoding; placement copies it into the playout buffer like any other
+static inline void receiveAudio(receiver *rx, const framedPacket *frame,
+    const char *payload1, size_t len1, const char *payload2, size_t len2) {
+  uint64_t position, time;
+  receiverUnwrap(rx, frame, &position, &time);
+  if(clockSyncValid(&rx->clock)) {
+    metricsBin(rx->metrics->arrivalDelay, METRICS_DELAY_BINS,
+        ((double)realtimeNow() - receiverLocalTime(rx, time)) / 1000000);
+  }
+  receiverTrackGaps(rx, position, len1 + len2, time);
+  receiverAdaptLatency(rx, time);
+  receiverDeliver(rx, position, time, payload1, len1, payload2, len2);
+  receiverDeliverRecovered(rx, fecRemember(&rx->fec, position, payload1, len1, payload2, len2));
+}
+
+// dispatches a packet in either wire format
+static inline void receiveFrame(receiver *rx, const framedPacket *frame,
+    const char *payload1, size_t len1, const char *payload2, size_t len2) {
+  if(frame->version == 0) {
+    if(!rx->legacyStream) {
+      // the first legacy packet, or one after a version 3 stream
+      rx->legacyStream = 1;
+      rx->haveStreamHeader = 0;
+      receiverStreamFormat(rx, &defaultFormat);
+    }
+    if(lossDrop(&rx->loss) || !rx->streamUsable) return;
+    receiverDeliver(rx, frame->position, frame->time, payload1, len1, payload2, len2);
+    return;
+  }
+
+  switch(frame->type) {
+    case PACKET_STREAM_HEADER:
+      if(lossDrop(&rx->loss)) break;
+
+      receiveStreamHeader(rx, payload1, len1, payload2, len2);
+      break;
+    case PACKET_TIME_RESPONSE:
+      if(len1 == sizeof(timeSync)) {
+        timeSync sync;
+        memcpy(&sync, payload1, sizeof(sync));
+        clockSyncSample(&rx->clock, sync.requestSent, sync.requestReceived, sync.responseSent, realtimeNow());
+      }
+      break;
+    case PACKET_AUDIO:
+      metricsAdd(&rx->metrics->packets, 1);
+      metricsAdd(&rx->metrics->bytes, len1 + len2);
+      if(lossDrop(&rx->loss) || !rx->streamUsable) break;
+
+      receiveAudio(rx, frame, payload1, len1, payload2, len2);
+      break;
+    case PACKET_CODED: {
+      metricsAdd(&rx->metrics->packets, 1);
+      metricsAdd(&rx->metrics->bytes, len1 + len2);
+      if(lossDrop(&rx->loss) || !rx->streamUsable || len1 + len2 > sizeof(rx->coded)) break;
+
+      memcpy(rx->coded, payload1, len1);
+      memcpy(rx->coded + len1, payload2, len2);
+      ssize_t len = codecDecode(&rx->codec, rx->format.format, rx->format.channels, rx->coded, len1 + len2,
+          rx->decoded, sizeof(rx->decoded));
+      if(len < 0) {
+        fprintf(stderr, "Invalid coded packet, dropping it.\n");
+        break;
+      }
+
+      receiveAudio(rx, frame, rx->decoded, len, NULL, 0);
+      break;
+    }
+    case PACKET_RETRANSMIT: {
+      retransmitHeader header;
+      if(lossDrop(&rx->loss) || !rx->streamUsable || len1 < sizeof(header)) break;
+
+      memcpy(&header, payload1, sizeof(header));
+      payload1 += sizeof(header);
+      len1 -= sizeof(header);
+
+      // the audio thread would only report it as late
+      if(receiverPlayIn(receiverLocalTime(rx, header.time), rx->latency, realtimeNow()) < 0) {
+        ++rx->nack.tooLate;
+        break;
+      }
+
+      ++rx->nack.retransmitted;
+      nackFill(&rx->nack, header.position, len1 + len2);
+      receiverDeliver(rx, header.position, header.time, payload1, len1, payload2, len2);
+      receiverDeliverRecovered(rx, fecRemember(&rx->fec, header.position, payload1, len1, payload2, len2));
+      break;
+    }
+    case PACKET_SILENCE: {
+      silenceMarker marker;
+      if(lossDrop(&rx->loss) || !rx->streamUsable || len1 + len2 < sizeof(marker)) break;
+
+      size_t first = len1 < sizeof(marker)? len1: sizeof(marker);
+      memcpy(&marker, payload1, first);
+      memcpy((char *)&marker + first, payload2, sizeof(marker) - first);
+
+      uint64_t position, time;
+      receiverUnwrap(rx, frame, &position, &time);
+      metricsAdd(&rx->metrics->silenceMarkers, 1);
+      receiverTrackGaps(rx, position - marker.skipped, marker.skipped + marker.length, time);
+      receiverDeliverSilence(rx, position, time,
+          marker.length + frameAlign(SILENCE_HOLD * rx->bytesPerSecond, rx->frameBytes));
+      break;
+    }
+    case PACKET_PARITY: {
+      if(lossDrop(&rx->loss) || !rx->streamUsable || len1 + len2 > sizeof(rx->parity)) break;
+
+      memcpy(rx->parity, payload1, len1);
+      memcpy(rx->parity + len1, payload2, len2);
+      uint64_t position, time;
+      receiverUnwrap(rx, frame, &position, &time);
+      int recovered = fecReceiveParity(&rx->fec, position, time, rx->parity, len1 + len2);
+      receiverDeliverRecovered(rx, recovered);
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+static inline void receiverRequestTime(receiver *rx, int fd) {
+  packetHeader header;
+  memset(&header, 0, sizeof(header));
+  header.length = sizeof(header) + sizeof(timeSync);
+  header.type = PACKET_TIME_REQUEST;
+  header.version = PROTOCOL_VERSION;
+
+  timeSync sync;
+  memset(&sync, 0, sizeof(sync));
+
+  char request[sizeof(header) + sizeof(sync)];
+  sync.requestSent = realtimeNow();
+  memcpy(request, &header, sizeof(header));
+  memcpy(request + sizeof(header), &sync, sizeof(sync));
+
+  if(sendto(fd, request, sizeof(request), 0, (struct sockaddr *)&rx->peer, rx->peerLength) < 0) {
+    fprintf(stderr, "Failed to send time request: %s\n", strerror(errno));
+  }
+}
+
+// a datagram which came from rx->peer
+static inline void receiveDatagram(receiver *rx, const char *data, size_t len) {
+  framedPacket packet;
+  const char *payload;
+  size_t payloadLen;
+
+  if(framingParseDatagram(data, len, &packet, &payload, &payloadLen) < 0) {
+    fprintf(stderr, "Invalid packet length, dropping datagram.\n");
+    return;
+  }
+
+  receiverTrace(rx, data, len);
+  receiveFrame(rx, &packet, payload, payloadLen, payload + payloadLen, 0);
+}
+
+// clock synchronisation requests, NACKs and loss reports, once the
+// datagrams which were waiting have been handled
+static inline void receiverServeBackChannel(receiver *rx, int fd) {
+  if(rx->peerLength && clockSyncDue(&rx->clock, realtimeNow())) {
+    receiverRequestTime(rx, fd);
+  }
+
+  receiverSendNacks(rx, fd);
+  receiverReportLoss(rx);
+}
+
+static inline void receiveDatagrams(receiver *rx, int fd) {
+  while(1) {
+    rx->peerLength = sizeof(rx->peer);
+    ssize_t len = recvfrom(fd, rx->datagram, sizeof(rx->datagram), 0, (struct sockaddr *)&rx->peer, &rx->peerLength);
+    if(len < 0) {
+      if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+
+      fprintf(stderr, "Failed to receive packet: %s\n", strerror(errno));
+      rx->peerLength = 0;
+      break;
+    }
+
+    receiveDatagram(rx, rx->datagram, len);
+  }
+
+  receiverServeBackChannel(rx, fd);
+}
+
+// processes everything readable on the (non-blocking) fd,
+// returns 0 once the input has been closed
+static inline int receiveInput(receiver *rx, int fd) {
+  if(rx->datagrams) {
+    receiveDatagrams(rx, fd);
+    return 1;
+  }
+
+  while(1) {
+    ssize_t len = framingFill(&rx->input, fd);
+    if(len < 0) {
+      if(errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+
+      fprintf(stderr, "Failed to receive packet: %s\n", strerror(errno));
+      return 1;
+    }
+
+    framedPacket packet;
+    const char *payload1, *payload2;
+    size_t len1, len2;
+    int status;
+
+    while((status = framingNext(&rx->input, &packet, &payload1, &len1, &payload2, &len2)) > 0) {
+      if(rx->trace.file) {
+        framingCopyOut(&rx->input, rx->input.readPos, rx->datagram, packet.length);
+        receiverTrace(rx, rx->datagram, packet.length);
+      }
+      receiveFrame(rx, &packet, payload1, len1, payload2, len2);
+      framingConsume(&rx->input, &packet);
+    }
+
+    if(status < 0) {
+      fprintf(stderr, "Invalid packet header, discarding buffered input.\n");
+    }
+
+    receiverReportLoss(rx);
+
+    if(len == 0) return 0;
+  }
+}
+
+// renders len bytes of audio for the device and advances the read cursor,
+// runs on the audio thread
+static inline void receiverRender(receiver *rx, char *out, size_t len) {
+  uint64_t renderedAt = rx->group? realtimeNow(): 0;
+  receiverDrain(rx);
+
+  size_t frames = len / rx->frameBytes;
+  metricsAdd(&rx->metrics->writes, 1);
+  metricsAdd(&rx->metrics->writeSizes[metricsSizeBin(len)], 1);
+
+  // a chunk peeks at up to RESAMPLER_MAX_RATIO times its frames plus the
+  // interpolation's lookahead, which all has to fit the playout ring
+  size_t maxChunk = (rx->playout.size / rx->frameBytes - 4) / RESAMPLER_MAX_RATIO;
+  if(maxChunk > RESAMPLER_MAX_FRAMES) maxChunk = RESAMPLER_MAX_FRAMES;
+
+  while(frames) {
+    size_t chunk = frames < maxChunk? frames: maxChunk;
+    receiverSynthesizeSilence(rx, ((size_t)(chunk * RESAMPLER_MAX_RATIO) + 4) * rx->frameBytes);
+    size_t consumed = resample(&rx->rs, &rx->playout, out, chunk);
+
+    playoutAdvance(&rx->playout, consumed * rx->frameBytes);
+    rx->senderOffset += consumed * rx->frameBytes;
+    if(consumed != chunk) {
+      int64_t drift = (int64_t)consumed - (int64_t)chunk;
+      metricsSet(&rx->metrics->driftFrames, metricsGet(&rx->metrics->driftFrames) + drift);
+      metricsAdd(&rx->metrics->correctedFrames, drift < 0? -drift: drift);
+    }
+
+    out += chunk * rx->frameBytes;
+    frames -= chunk;
+  }
+
+  // the read cursor is next in line after what was just rendered
+  if(rx->group) {
+    rx->cursorDue = renderedAt + rx->outputDelay + (uint64_t)(len / rx->frameBytes) * 1000000000 / rx->format.rate;
+  }
+}
+
+// to be called once per main loop wakeup
+static inline void receiverWakeup(receiver *rx) {
+  metricsAdd(&rx->metrics->wakeups, 1);
+  if(!rx->reportWakeups) return;
+
+  ++rx->wakeups;
+
+  uint64_t now = monotonicNow();
+  if(!rx->wakeupsSince) {
+    rx->wakeupsSince = now;
+  } else if(now - rx->wakeupsSince >= 1000000000) {
+    fprintf(stderr, "Wakeups per second: %.1f\n", rx->wakeups * 1e9 / (now - rx->wakeupsSince));
+    rx->wakeups = 0;
+    rx->wakeupsSince = now;
+  }
+}
+
+#endif
@@ -0,0 +1,89 @@
+#include "common.h"
+
+#define __USE_POSIX199309 1
+#define __USE_POSIX2 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <math.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "format.h"
+#include "playout.h"
+#include "resampler.h"
+
+#define PERIOD_FRAMES 512
+
+playoutBuffer playout;
+resampler rs;
+char period[PERIOD_FRAMES * FORMAT_MAX_CHANNELS * 4];
+
+uint64_t cpuTime() {
+  struct timespec t;
+  if(clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t)) {
+    fprintf(stderr, "Failed to get cpu time: %s\n", strerror(errno));
+  }
+
+  return (uint64_t)(t.tv_sec) * 1000000000 + t.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+  double seconds = 600;
+  double ratio = 1.0003;
+  audioFormat format = defaultFormat;
+  int opt;
+
+  while((opt = getopt(argc, argv, "s:r:f:")) != -1) {
+    switch(opt) {
+      case 's': seconds = atof(optarg); break;
+      case 'r': ratio = atof(optarg); break;
+      case 'f':
+        if(parseFormat(optarg, &format)) return 1;
+        break;
+      default:
+        fprintf(stderr, "Usage: ./resampler-bench [-s seconds of audio] [-r ratio] [-f format[:channels[:rate]]]\n");
+        return 1;
+    }
+  }
+
+  size_t frame = frameBytes(&format);
+  if(playoutInit(&playout, 16 * 1024 * frame, &format)) {
+    fprintf(stderr, "Failed to allocate playout buffer.\n");
+    return 1;
+  }
+
+  resamplerSetFormat(&rs, &format);
+  rs.ratio = ratio;
+
+  // noise at a fixed fill level, the content does not matter for the cost
+  static char noise[1024 * FORMAT_MAX_CHANNELS * 4];
+  size_t bytes = sampleBytes(format.format);
+  float scale = sampleScale(format.format);
+  for(size_t i = 0; i < 1024 * frame; i += bytes) {
+    storeSample(format.format, noise + i, (rand() / (float)RAND_MAX * 2 - 1) * scale);
+  }
+
+  uint64_t frames = seconds * format.rate;
+  uint64_t rendered = 0;
+  uint64_t start = cpuTime();
+
+  while(rendered < frames) {
+    while(playout.written < 8 * 1024 * frame) {
+      playoutWrite(&playout, playout.written, noise, 1024 * frame);
+    }
+
+    size_t consumed = resample(&rs, &playout, period, PERIOD_FRAMES);
+    playoutAdvance(&playout, consumed * frame);
+    rendered += PERIOD_FRAMES;
+  }
+
+  double cpu = (cpuTime() - start) / 1e9;
+  double audio = (double)rendered / format.rate;
+  printf("Resampled %.0fs of %s, %d channels, %u Hz in %.3fs cpu: %.3fms cpu per second of audio\n",
+      audio, formatName(format.format), format.channels, format.rate, cpu, cpu / audio * 1000);
+
+  return 0;
+}
@@ -0,0 +1,151 @@
+#ifndef H_F58C8084_0248_4E45_B740_EAED6374DF1C
+#define H_F58C8084_0248_4E45_B740_EAED6374DF1C
+
+#include "playout.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define RESAMPLER_MAX_FRAMES 8192 // output frames per call
+#define RESAMPLER_MAX_INPUT (RESAMPLER_MAX_FRAMES + RESAMPLER_MAX_FRAMES / 64 + 8)
+#define RESAMPLER_MAX_RATIO (1 + 1.0 / 64)
+
+// Variable-ratio cubic (Catmull-Rom) resampler reading interleaved audio
+// from the playout buffer. Drift is corrected by running slightly faster or
+// slower than the device instead of skipping or repeating whole chunks.
+//
+// Each call works in passes over plain float arrays (deinterleave, compute
+// positions and weights, interpolate, convert) so the compiler can vectorize
+// all of them but the gather. The passes are instantiated for every sample
+// format and channel count, resamplerSetFormat picks the matching one.
+struct resampler_t;
+typedef size_t (*resampleKernel)(struct resampler_t *rs, playoutBuffer *playout, char *out, size_t outFrames);
+
+struct resampler_t {
+  double ratio; // input frames consumed per output frame
+  double phase; // position of the next output frame, in input frames after the read cursor
+
+  resampleKernel kernel;
+  float history[FORMAT_MAX_CHANNELS]; // the frame right before the read cursor
+
+  float input[FORMAT_MAX_CHANNELS][RESAMPLER_MAX_INPUT];
+  int32_t index[RESAMPLER_MAX_FRAMES];
+  float weights[4][RESAMPLER_MAX_FRAMES];
+  float output[FORMAT_MAX_CHANNELS][RESAMPLER_MAX_FRAMES];
+};
+
+typedef struct resampler_t resampler;
+
+static inline void resamplerReset(resampler *rs) {
+  rs->ratio = 1;
+  rs->phase = 0;
+  memset(rs->history, 0, sizeof(rs->history));
+}
+
+// the generic body, only ever called with constant format and channels
+static inline __attribute__((always_inline)) size_t resampleFormat(resampler *rs, playoutBuffer *playout,
+    char *out, size_t outFrames, const int format, const int channels) {
+  const size_t bytes = sampleBytes(format);
+  const size_t frame = bytes * channels;
+
+  if(rs->ratio > RESAMPLER_MAX_RATIO) rs->ratio = RESAMPLER_MAX_RATIO;
+
+  double end = rs->phase + outFrames * rs->ratio;
+  size_t consumed = (size_t)end;
+  size_t inFrames = consumed + 3; // interpolation looks two frames ahead
+
+  const char *span1, *span2;
+  size_t len1, len2;
+  playoutPeek(playout, inFrames * frame, &span1, &len1, &span2, &len2);
+
+  for(int c = 0; c < channels; ++c) {
+    rs->input[c][0] = rs->history[c];
+  }
+
+  size_t frames1 = len1 / frame;
+  for(size_t i = 0; i < frames1; ++i) {
+    for(int c = 0; c < channels; ++c) {
+      rs->input[c][i + 1] = loadSample(format, span1 + i * frame + c * bytes);
+    }
+  }
+
+  for(size_t i = 0; i < len2 / frame; ++i) {
+    for(int c = 0; c < channels; ++c) {
+      rs->input[c][frames1 + i + 1] = loadSample(format, span2 + i * frame + c * bytes);
+    }
+  }
+
+  // input[.][i + 1] holds frame i after the read cursor, so output frame k
+  // interpolates between input[.][index[k] + 1] and input[.][index[k] + 2]
+  for(size_t k = 0; k < outFrames; ++k) {
+    double pos = rs->phase + k * rs->ratio;
+    int32_t i = (int32_t)pos;
+    float f = pos - i;
+
+    rs->index[k] = i;
+    rs->weights[0][k] = 0.5f * f * (-1 + f * (2 - f));
+    rs->weights[1][k] = 1 + 0.5f * f * f * (-5 + 3 * f);
+    rs->weights[2][k] = 0.5f * f * (1 + f * (4 - 3 * f));
+    rs->weights[3][k] = 0.5f * f * f * (-1 + f);
+  }
+
+  for(int c = 0; c < channels; ++c) {
+    const float *in = rs->input[c];
+    float *o = rs->output[c];
+    for(size_t k = 0; k < outFrames; ++k) {
+      const float *x = in + rs->index[k];
+      o[k] = rs->weights[0][k] * x[0] + rs->weights[1][k] * x[1] + rs->weights[2][k] * x[2] + rs->weights[3][k] * x[3];
+    }
+  }
+
+  for(size_t k = 0; k < outFrames; ++k) {
+    for(int c = 0; c < channels; ++c) {
+      storeSample(format, out + k * frame + c * bytes, rs->output[c][k]);
+    }
+  }
+
+  for(int c = 0; c < channels; ++c) {
+    rs->history[c] = rs->input[c][consumed];
+  }
+  rs->phase = end - consumed;
+  return consumed;
+}
+
+#define RESAMPLER_KERNEL(name, format, channels) \
+  static size_t name##channels(resampler *rs, playoutBuffer *playout, char *out, size_t outFrames) { \
+    return resampleFormat(rs, playout, out, outFrames, format, channels); \
+  }
+
+#define RESAMPLER_KERNELS(name, format) \
+  RESAMPLER_KERNEL(name, format, 1) RESAMPLER_KERNEL(name, format, 2) \
+  RESAMPLER_KERNEL(name, format, 3) RESAMPLER_KERNEL(name, format, 4) \
+  RESAMPLER_KERNEL(name, format, 5) RESAMPLER_KERNEL(name, format, 6) \
+  RESAMPLER_KERNEL(name, format, 7) RESAMPLER_KERNEL(name, format, 8)
+
+RESAMPLER_KERNELS(resampleS16LE, SAMPLE_S16LE)
+RESAMPLER_KERNELS(resampleS24LE, SAMPLE_S24LE)
+RESAMPLER_KERNELS(resampleFloat32LE, SAMPLE_FLOAT32LE)
+
+#define RESAMPLER_KERNEL_ROW(name) { name##1, name##2, name##3, name##4, name##5, name##6, name##7, name##8 }
+
+// indexed by enum sampleFormat - 1 and channels - 1
+static const resampleKernel resampleKernels[][FORMAT_MAX_CHANNELS] = {
+  RESAMPLER_KERNEL_ROW(resampleS16LE),
+  RESAMPLER_KERNEL_ROW(resampleS24LE),
+  RESAMPLER_KERNEL_ROW(resampleFloat32LE),
+};
+
+// format has to be valid, see formatValid
+static inline void resamplerSetFormat(resampler *rs, const audioFormat *format) {
+  rs->kernel = resampleKernels[format->format - 1][format->channels - 1];
+  resamplerReset(rs);
+}
+
+// Renders outFrames (at most RESAMPLER_MAX_FRAMES) frames into out and
+// returns how many input frames were consumed, i.e. by how many frames the
+// playout read cursor has to advance.
+static inline size_t resample(resampler *rs, playoutBuffer *playout, char *out, size_t outFrames) {
+  return rs->kernel(rs, playout, out, outFrames);
+}
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef H_B3F0A2E8_5D61_4C9A_A7E4_0C8D2F61B95A
+#define H_B3F0A2E8_5D61_4C9A_A7E4_0C8D2F61B95A
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define AUDIO_THREAD_PRIORITY 70
+
+// Locks all current and future memory and starts fn on a SCHED_FIFO
+// thread. Missing privileges only cost the guarantees, so both fall back
+// with a warning instead of failing.
+static inline int startRealtimeThread(pthread_t *thread, void *(*fn)(void *), void *arg) {
+  if(mlockall(MCL_CURRENT | MCL_FUTURE)) {
+    fprintf(stderr, "Could not lock memory, page faults may cause xruns: %s\n", strerror(errno));
+  }
+
+  pthread_attr_t attr;
+  struct sched_param param;
+  memset(&param, 0, sizeof(param));
+  param.sched_priority = AUDIO_THREAD_PRIORITY;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+  pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+  pthread_attr_setschedparam(&attr, &param);
+
+  int err = pthread_create(thread, &attr, fn, arg);
+  pthread_attr_destroy(&attr);
+  if(err == EPERM) {
+    fprintf(stderr, "Not allowed to use SCHED_FIFO, running the audio thread with normal priority.\n");
+    err = pthread_create(thread, NULL, fn, arg);
+  }
+
+  if(err) {
+    fprintf(stderr, "Could not start audio thread: %s\n", strerror(err));
+    return -1;
+  }
+
+  return 0;
+}
+
+#endif
@@ -0,0 +1,662 @@
+#ifndef H_09DE4A89_ADDF_4110_809B_BF54A7EC89A3
+#define H_09DE4A89_ADDF_4110_809B_BF54A7EC89A3
+
+#include "common.h"
+#include "clocksync.h"
+#include "codec.h"
+#include "fec.h"
+#include "format.h"
+#include "framing.h"
+#include "nack.h"
+#include "silence.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <linux/sockios.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define SENDER_MAX_BATCH 16
+#define SENDER_MAX_DESTINATIONS 16
+#define UDP_MAX_PAYLOAD 1448 // 1500 byte MTU minus IPv4, UDP and dataPacket headers
+
+// A receiver, or a multicast group of them, fed with the same packets as
+// every other destination of a sender.
+struct senderDestination_t {
+  int fd;
+  const char *name;
+  struct sockaddr_storage address; // where datagrams go if fd is not connected
+  socklen_t addressLength; // 0 for connected sockets and streams
+  int failing; // only the first of consecutive send failures is reported
+
+  uint64_t packets;
+  uint64_t failures; // packets which could not be sent
+  int backlog; // bytes still queued in the socket, sampled with every stream header
+  int maxBacklog;
+};
+
+typedef struct senderDestination_t senderDestination;
+
+// Packet emission for a sender. Headers are kept apart from the payload, so
+// packets can be sent straight from the capture buffer with writev/sendmmsg.
+// Payloads larger than maxPayload are split, small payloads can optionally
+// be combined (which costs a copy) to save syscalls. Packets are built
+// once and sent to every destination with one sendmmsg per batch.
+struct sender_t {
+  senderDestination destinations[SENDER_MAX_DESTINATIONS]; // just the stream unless datagrams
+  int destinationCount;
+  int datagrams; // output is a UDP socket, one packet per datagram
+  int broken; // a stream output failed mid-packet and lost its framing, nothing more is sent
+  int legacy; // send version 0 packets
+  size_t frameBytes;
+  size_t maxPayload; // whole frames
+  size_t combineBytes; // 0 to send every fragment immediately
+
+  uint64_t position;
+
+  streamHeader stream; // last one sent
+  int streamHeaderQueued;
+  uint64_t streamInterval; // bytes of audio between stream headers
+
+  union {
+    dataPacketHeader legacy;
+    packetHeader compact;
+  } headers[SENDER_MAX_BATCH];
+  struct iovec iovecs[2 * SENDER_MAX_BATCH];
+  struct mmsghdr messages[SENDER_MAX_BATCH];
+  int batched;
+
+  char pending[MAX_PAYLOAD];
+  size_t pendingLen;
+  uint64_t pendingTime;
+
+  fecEncoder fec; // fec.data is 0 unless enabled with senderSetFec
+  uint64_t lastTime;
+
+  senderHistory history; // history.data is NULL unless enabled with senderSetHistory
+  uint64_t retransmissions;
+
+  int codec; // compress audio, see senderSetCodec
+  codec coder;
+  uint8_t coded[SENDER_MAX_BATCH][MAX_PAYLOAD]; // per batch slot, sent from here
+  uint64_t codedBytes;
+
+  float silenceThreshold; // in the format's scale, negative unless enabled with senderSetSilence
+  uint64_t silenceHangover;  // bytes
+  uint64_t silenceKeepalive; // bytes
+  uint64_t quietBytes;       // captured in a row below the threshold
+  int suppressing;
+  uint64_t silencePending;   // suppressed since the last marker
+  uint64_t suppressedBytes;
+
+  uint64_t syscalls;
+  uint64_t bytesSent;
+};
+
+typedef struct sender_t sender;
+
+// payloads are split at frame boundaries only
+static inline void senderSetMaxPayload(sender *tx, size_t maxPayload) {
+  if(maxPayload > sizeof(tx->pending)) maxPayload = sizeof(tx->pending);
+  tx->maxPayload = maxPayload / tx->frameBytes * tx->frameBytes;
+  if(!tx->maxPayload) tx->maxPayload = tx->frameBytes;
+}
+
+// Sends packets to a connected socket, or to a multicast group (or any
+// other address) through an unconnected one if addressLength is not 0.
+static inline int senderAddDestination(sender *tx, int fd, const char *name, const struct sockaddr_storage *address, socklen_t addressLength) {
+  if(tx->destinationCount == SENDER_MAX_DESTINATIONS) {
+    fprintf(stderr, "Too many destinations, at most %d are supported.\n", SENDER_MAX_DESTINATIONS);
+    return -1;
+  }
+
+  senderDestination *d = &tx->destinations[tx->destinationCount++];
+  memset(d, 0, sizeof(*d));
+  d->fd = fd;
+  d->name = name;
+  if(addressLength) memcpy(&d->address, address, addressLength);
+  d->addressLength = addressLength;
+  return 0;
+}
+
+// outputFd is a stream, or the first of the UDP sockets; -1 to add them all
+// with senderAddDestination
+static inline void senderInit(sender *tx, int outputFd, int datagrams, const audioFormat *format) {
+  tx->destinationCount = 0;
+  if(outputFd >= 0) senderAddDestination(tx, outputFd, "output", NULL, 0);
+  tx->datagrams = datagrams;
+  tx->broken = 0;
+  tx->legacy = 0;
+  tx->frameBytes = frameBytes(format);
+  tx->combineBytes = 0;
+  tx->position = 0;
+  senderSetMaxPayload(tx, datagrams? UDP_MAX_PAYLOAD: sizeof(tx->pending));
+
+  memset(&tx->stream, 0, sizeof(tx->stream));
+  tx->stream.format = format->format;
+  tx->stream.channels = format->channels;
+  tx->stream.rate = format->rate;
+  tx->streamHeaderQueued = 0;
+  tx->streamInterval = bytesPerSecond(format);
+
+  tx->batched = 0;
+  tx->pendingLen = 0;
+  tx->pendingTime = 0;
+  tx->fec.data = 0;
+  tx->lastTime = 0;
+  tx->history.data = NULL;
+  tx->retransmissions = 0;
+  tx->codec = 0;
+  tx->codedBytes = 0;
+  tx->silenceThreshold = -1;
+  tx->quietBytes = 0;
+  tx->suppressing = 0;
+  tx->silencePending = 0;
+  tx->suppressedBytes = 0;
+  tx->syscalls = 0;
+  tx->bytesSent = 0;
+}
+
+// Adds parity packets for every group of data audio packets. Audio
+// payloads shrink by the parity prefix, so parity packets still fit into a
+// datagram.
+static inline void senderSetFec(sender *tx, int data, int parities) {
+  size_t prefix = fecPrefixLength(data);
+  fecEncoderInit(&tx->fec, data, parities);
+  senderSetMaxPayload(tx, tx->maxPayload > prefix? tx->maxPayload - prefix: 0);
+}
+
+// largest audio payload of a PACKET_RETRANSMIT, so it fits where the
+// original did
+static inline size_t senderRetransmitLimit(const sender *tx) {
+  size_t limit = tx->datagrams? UDP_MAX_PAYLOAD + sizeof(dataPacketHeader) - sizeof(packetHeader): MAX_PAYLOAD;
+  return (limit - sizeof(retransmitHeader)) / tx->frameBytes * tx->frameBytes;
+}
+
+// keeps at least bytes of recent audio for answering NACKs; packets shrink
+// slightly so retransmissions need not be split
+static inline int senderSetHistory(sender *tx, size_t bytes) {
+  if(tx->maxPayload > senderRetransmitLimit(tx)) senderSetMaxPayload(tx, senderRetransmitLimit(tx));
+  return historyInit(&tx->history, bytes);
+}
+
+// Sends PACKET_CODED instead of PACKET_AUDIO. Payloads are handed to the
+// codec in pieces of up to MAX_PAYLOAD bytes, maxPayload then only limits
+// the compressed size. Retransmissions stay uncompressed, which is why the
+// history keeps PCM; parity packets would be as large as the PCM and are
+// not supported.
+static inline void senderSetCodec(sender *tx) {
+  tx->codec = 1;
+}
+
+// Discontinuous transmission: once captured audio has stayed at or below
+// threshold for SILENCE_HANGOVER, it is no longer sent. A PACKET_SILENCE
+// marker goes out when suppression starts, then every SILENCE_KEEPALIVE
+// and once more right before audio resumes, so receivers can play silence
+// and know that the positions in between were not lost.
+static inline void senderSetSilence(sender *tx, float threshold) {
+  uint64_t perSecond = (uint64_t)tx->stream.rate * tx->frameBytes;
+  tx->silenceThreshold = threshold;
+  tx->silenceHangover = SILENCE_HANGOVER * perSecond;
+  tx->silenceKeepalive = SILENCE_KEEPALIVE * perSecond;
+}
+
+// largest piece of audio for senderQueue
+static inline size_t senderPieceLimit(const sender *tx) {
+  return tx->codec? sizeof(tx->pending) / tx->frameBytes * tx->frameBytes: tx->maxPayload;
+}
+
+// writes all iovecs to a stream, coping with short writes and waiting while
+// a non-blocking fd is full; *written counts the bytes which went out, also
+// when an error ends it early
+static inline int writeAll(int fd, struct iovec *iov, int count, size_t *written) {
+  *written = 0;
+  while(count) {
+    ssize_t len = writev(fd, iov, count);
+    if(len < 0) {
+      if(errno == EINTR) continue;
+      if(errno == EAGAIN || errno == EWOULDBLOCK) {
+        struct pollfd out = { fd, POLLOUT, 0 };
+        if(poll(&out, 1, -1) >= 0 || errno == EINTR) continue;
+      }
+      return -1;
+    }
+    *written += len;
+
+    while(count && (size_t)len >= iov->iov_len) {
+      len -= iov->iov_len;
+      ++iov;
+      --count;
+    }
+
+    if(count) {
+      iov->iov_base = (char *)iov->iov_base + len;
+      iov->iov_len -= len;
+    }
+  }
+
+  return 0;
+}
+
+// Sends the queued batch to one destination. A failing packet is dropped
+// for this destination only, e.g. on a late ICMP error from a receiver
+// which is not up, and the rest of the batch still goes out.
+static inline void senderSendBatch(sender *tx, senderDestination *d) {
+  for(int i = 0; i < tx->batched; ++i) {
+    tx->messages[i].msg_hdr.msg_name = d->addressLength? &d->address: NULL;
+    tx->messages[i].msg_hdr.msg_namelen = d->addressLength;
+  }
+
+  int sent = 0;
+  while(sent < tx->batched) {
+    ++tx->syscalls;
+    int len = sendmmsg(d->fd, tx->messages + sent, tx->batched - sent, 0);
+    if(len < 0) {
+      if(errno == EINTR) continue;
+
+      if(!d->failing) fprintf(stderr, "Failed to send packet to %s: %s\n", d->name, strerror(errno));
+      d->failing = 1;
+      ++d->failures;
+      ++sent;
+      continue;
+    }
+
+    d->failing = 0;
+    d->packets += len;
+    sent += len;
+  }
+
+  if(tx->streamHeaderQueued) {
+    int queued;
+    if(!ioctl(d->fd, SIOCOUTQ, &queued)) {
+      d->backlog = queued;
+      if(queued > d->maxBacklog) d->maxBacklog = queued;
+    }
+  }
+}
+
+// whether the first written bytes of the queued batch end on a packet boundary
+static inline int senderWholePackets(const sender *tx, size_t written) {
+  size_t end = 0;
+  for(int i = 0; i < tx->batched && end < written; ++i) {
+    end += tx->legacy? tx->headers[i].legacy.length: tx->headers[i].compact.length;
+  }
+  return end == written;
+}
+
+// sends all queued packets, must happen before queued payload memory is released
+static inline void senderFlush(sender *tx) {
+  if(!tx->batched) return;
+  if(tx->broken) {
+    tx->batched = 0;
+    tx->streamHeaderQueued = 0;
+    return;
+  }
+
+  if(tx->datagrams) {
+    for(int i = 0; i < tx->destinationCount; ++i) senderSendBatch(tx, &tx->destinations[i]);
+  } else {
+    senderDestination *d = &tx->destinations[0];
+    ++tx->syscalls;
+    size_t written;
+    if(writeAll(d->fd, tx->iovecs, 2 * tx->batched, &written)) {
+      // the receiver's parser cannot find the next packet after a partial one
+      if(!senderWholePackets(tx, written)) tx->broken = 1;
+      fprintf(stderr, "Failed to send packet: %s%s\n", strerror(errno),
+          tx->broken? ", the stream is broken off mid-packet": "");
+      ++d->failures;
+    } else {
+      d->packets += tx->batched;
+    }
+  }
+
+  tx->batched = 0;
+  tx->streamHeaderQueued = 0;
+}
+
+static inline void senderQueuePacket(sender *tx, int type, const void *data, size_t len, uint64_t time) {
+  if(tx->batched == SENDER_MAX_BATCH) senderFlush(tx);
+
+  int i = tx->batched++;
+  size_t headerLength;
+
+  if(tx->legacy) {
+    dataPacketHeader *header = &tx->headers[i].legacy;
+    header->length = sizeof(*header) + len;
+    header->position = tx->position;
+    header->time = time;
+    headerLength = sizeof(*header);
+  } else {
+    packetHeader *header = &tx->headers[i].compact;
+    header->length = sizeof(*header) + len;
+    header->type = type;
+    header->version = PROTOCOL_VERSION;
+    header->position = tx->position;
+    header->time = time / 1000;
+    headerLength = sizeof(*header);
+  }
+
+  tx->iovecs[2 * i].iov_base = &tx->headers[i];
+  tx->iovecs[2 * i].iov_len = headerLength;
+  tx->iovecs[2 * i + 1].iov_base = (void *)data;
+  tx->iovecs[2 * i + 1].iov_len = len;
+
+  memset(&tx->messages[i], 0, sizeof(tx->messages[i]));
+  tx->messages[i].msg_hdr.msg_iov = tx->iovecs + 2 * i;
+  tx->messages[i].msg_hdr.msg_iovlen = 2;
+}
+
+// announces sample spec, position and time
+static inline void senderQueueStreamHeader(sender *tx, uint64_t time) {
+  if(tx->streamHeaderQueued) senderFlush(tx);
+
+  tx->stream.position = tx->position;
+  tx->stream.time = time;
+  senderQueuePacket(tx, PACKET_STREAM_HEADER, &tx->stream, sizeof(tx->stream), time);
+  tx->streamHeaderQueued = 1;
+}
+
+// sends the parities of the current group, even if it is not full yet
+static inline void senderQueueParity(sender *tx, uint64_t time) {
+  if(!tx->fec.count) return;
+
+  for(int j = 0; j < tx->fec.parities; ++j) {
+    size_t len;
+    const uint8_t *parity = fecParity(&tx->fec, j, tx->position, &len);
+    senderQueuePacket(tx, PACKET_PARITY, parity, len, time);
+  }
+
+  senderFlush(tx); // the parity buffers are reused by the next group
+  fecNextGroup(&tx->fec);
+}
+
+// sends a stream header when the last one is a streamInterval or a minute old
+static inline void senderCheckStreamHeader(sender *tx, uint64_t time) {
+  if(!tx->legacy && (!tx->stream.time || tx->position - tx->stream.position >= tx->streamInterval ||
+        time - tx->stream.time >= 1000000000ull * 60)) {
+    senderQueueStreamHeader(tx, time);
+  }
+}
+
+static inline void senderQueue(sender *tx, const void *data, size_t len, uint64_t time) {
+  senderCheckStreamHeader(tx, time);
+
+  if(!tx->codec) {
+    senderQueuePacket(tx, PACKET_AUDIO, data, len, time);
+  } else {
+    // the coded payload goes into the slot it will be sent from
+    if(tx->batched == SENDER_MAX_BATCH) senderFlush(tx);
+    uint8_t *coded = tx->coded[tx->batched];
+    size_t codedLen = codecEncode(&tx->coder, tx->stream.format, tx->stream.channels, data, len / tx->frameBytes,
+        coded, tx->maxPayload);
+
+    if(!codedLen && len > tx->maxPayload) {
+      // did not compress enough to fit, try in halves
+      size_t half = len / tx->frameBytes / 2 * tx->frameBytes;
+      senderQueue(tx, data, half, time);
+      senderQueue(tx, (const char *)data + half, len - half, time);
+      return;
+    }
+
+    if(codedLen) {
+      senderQueuePacket(tx, PACKET_CODED, coded, codedLen, time);
+      tx->codedBytes += codedLen;
+    } else {
+      senderQueuePacket(tx, PACKET_AUDIO, data, len, time);
+    }
+  }
+
+  uint64_t position = tx->position;
+  tx->position += len;
+  tx->bytesSent += len;
+  tx->lastTime = time;
+
+  if(tx->history.data) historyAdd(&tx->history, position, data, len, time);
+
+  if(!tx->legacy && tx->fec.data && fecAdd(&tx->fec, position, data, len)) {
+    senderQueueParity(tx, time);
+  }
+}
+
+static inline void senderFlushPending(sender *tx) {
+  if(!tx->pendingLen) return;
+
+  senderQueue(tx, tx->pending, tx->pendingLen, tx->pendingTime);
+  senderFlush(tx);
+  tx->pendingLen = 0;
+}
+
+// announces skipped bytes of silence before the current position and
+// length bytes from it, time being that of the current position
+static inline void senderQueueSilence(sender *tx, uint64_t skipped, uint64_t length, uint64_t time) {
+  tx->position += skipped;
+  senderCheckStreamHeader(tx, time);
+
+  silenceMarker marker = { skipped, length };
+  senderQueuePacket(tx, PACKET_SILENCE, &marker, sizeof(marker), time);
+  senderFlush(tx); // the marker lives on the stack
+  tx->position += length;
+  tx->lastTime = time;
+}
+
+// returns 1 if the captured fragment is to be left out, see senderSetSilence
+static inline int senderSuppress(sender *tx, const char *data, size_t len, uint64_t time) {
+  if(!silenceQuiet(tx->stream.format, data, len, tx->silenceThreshold)) {
+    tx->quietBytes = 0;
+    if(tx->suppressing) {
+      senderQueueSilence(tx, tx->silencePending, 0, time);
+      tx->silencePending = 0;
+      tx->suppressing = 0;
+    }
+    return 0;
+  }
+
+  tx->quietBytes += len;
+  if(tx->quietBytes <= tx->silenceHangover) return 0;
+
+  tx->suppressedBytes += len;
+  if(!tx->suppressing) {
+    // whatever is pending goes out before positions start to jump
+    senderFlushPending(tx);
+    if(tx->fec.data) senderQueueParity(tx, tx->lastTime);
+    tx->suppressing = 1;
+    senderQueueSilence(tx, 0, len, time);
+  } else if(tx->silencePending >= tx->silenceKeepalive) {
+    senderQueueSilence(tx, tx->silencePending, len, time);
+    tx->silencePending = 0;
+  } else {
+    tx->silencePending += len;
+  }
+
+  return 1;
+}
+
+// queues captured audio, the caller has to senderFlush before releasing data
+static inline void senderSend(sender *tx, const char *data, size_t len, uint64_t time) {
+  if(tx->silenceThreshold >= 0 && senderSuppress(tx, data, len, time)) return;
+
+  size_t limit = senderPieceLimit(tx);
+
+  if(!tx->combineBytes) {
+    while(len) {
+      size_t piece = len < limit? len: limit;
+      senderQueue(tx, data, piece, time);
+      data += piece;
+      len -= piece;
+    }
+    return;
+  }
+
+  while(len) {
+    if(!tx->pendingLen) tx->pendingTime = time;
+
+    size_t piece = limit - tx->pendingLen;
+    if(piece > len) piece = len;
+
+    memcpy(tx->pending + tx->pendingLen, data, piece);
+    tx->pendingLen += piece;
+    data += piece;
+    len -= piece;
+
+    if(tx->pendingLen >= tx->combineBytes || tx->pendingLen == limit) {
+      senderFlushPending(tx);
+    }
+  }
+}
+
+// Answers a back channel request of peer through destination d. Connected
+// sockets only talk to their receiver; the members of a multicast group
+// are answered individually, not through the group.
+static inline int senderReply(sender *tx, senderDestination *d, const struct sockaddr_storage *peer, socklen_t peerLength, struct iovec *iov, int count) {
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_name = d->addressLength? (void *)peer: NULL;
+  message.msg_namelen = d->addressLength? peerLength: 0;
+  message.msg_iov = iov;
+  message.msg_iovlen = count;
+
+  ++tx->syscalls;
+  if(sendmsg(d->fd, &message, 0) < 0 && errno != ECONNREFUSED) return -1;
+  return 0;
+}
+
+// resends len bytes of history at position, split so it fits a packet
+static inline void senderRetransmitEntry(sender *tx, senderDestination *d, const struct sockaddr_storage *peer, socklen_t peerLength,
+    uint64_t position, size_t len, uint64_t time) {
+  size_t limit = senderRetransmitLimit(tx);
+
+  while(len) {
+    size_t piece = len < limit? len: limit;
+    size_t offset = position & (tx->history.size - 1);
+    size_t first = piece < tx->history.size - offset? piece: tx->history.size - offset;
+
+    packetHeader header;
+    memset(&header, 0, sizeof(header));
+    header.length = sizeof(header) + sizeof(retransmitHeader) + piece;
+    header.type = PACKET_RETRANSMIT;
+    header.version = PROTOCOL_VERSION;
+
+    retransmitHeader retransmit;
+    retransmit.position = position;
+    retransmit.time = time;
+
+    struct iovec iov[4] = {
+      { &header, sizeof(header) },
+      { &retransmit, sizeof(retransmit) },
+      { tx->history.data + offset, first },
+      { tx->history.data, piece - first },
+    };
+
+    if(senderReply(tx, d, peer, peerLength, iov, 4)) {
+      fprintf(stderr, "Failed to retransmit packet: %s\n", strerror(errno));
+      return;
+    }
+
+    ++tx->retransmissions;
+    position += piece;
+    len -= piece;
+  }
+}
+
+// resends every packet still in the history which overlaps a NACKed range
+static inline void senderRetransmit(sender *tx, senderDestination *d, const struct sockaddr_storage *peer, socklen_t peerLength,
+    const nackRange *range) {
+  if(!tx->history.data) return;
+
+  for(int i = 0; i < HISTORY_PACKETS; ++i) {
+    const historyEntry *e = &tx->history.entries[i];
+    if(!historyValid(&tx->history, e, tx->position)) continue;
+    if(e->position + e->length <= range->position || e->position >= range->position + range->length) continue;
+
+    senderRetransmitEntry(tx, d, peer, peerLength, e->position, e->length, e->time);
+  }
+}
+
+static inline void senderAnswerTime(sender *tx, senderDestination *d, const struct sockaddr_storage *peer, socklen_t peerLength,
+    const char *payload, uint64_t received) {
+  timeSync sync;
+  memcpy(&sync, payload, sizeof(sync));
+  sync.requestReceived = received;
+
+  packetHeader header;
+  memset(&header, 0, sizeof(header));
+  header.length = sizeof(header) + sizeof(sync);
+  header.type = PACKET_TIME_RESPONSE;
+  header.version = PROTOCOL_VERSION;
+
+  struct iovec iov[2] = {
+    { &header, sizeof(header) },
+    { &sync, sizeof(sync) },
+  };
+
+  sync.responseSent = realtimeNow();
+  if(senderReply(tx, d, peer, peerLength, iov, 2)) {
+    fprintf(stderr, "Failed to answer time request: %s\n", strerror(errno));
+  }
+}
+
+// answers pending clock synchronisation requests and NACKs on the socket of
+// a UDP destination
+static inline void senderReceiveFrom(sender *tx, senderDestination *d) {
+  char buffer[sizeof(packetHeader) + NACK_MAX_RANGES * sizeof(nackRange)];
+
+  while(1) {
+    struct sockaddr_storage peer;
+    socklen_t peerLength = sizeof(peer);
+    ssize_t len = recvfrom(d->fd, buffer, sizeof(buffer), MSG_DONTWAIT, (struct sockaddr *)&peer, &peerLength);
+    uint64_t received = realtimeNow();
+    if(len < 0) {
+      if(errno == EAGAIN || errno == EWOULDBLOCK) return;
+      if(errno == ECONNREFUSED || errno == EINTR) continue; // receiver not up yet
+
+      fprintf(stderr, "Failed to receive from back channel: %s\n", strerror(errno));
+      return;
+    }
+
+    framedPacket packet;
+    const char *payload;
+    size_t payloadLen;
+    if(framingParseDatagram(buffer, len, &packet, &payload, &payloadLen) < 0) continue;
+    if(packet.version != PROTOCOL_VERSION) continue;
+
+    if(packet.type == PACKET_TIME_REQUEST && payloadLen == sizeof(timeSync)) {
+      senderAnswerTime(tx, d, &peer, peerLength, payload, received);
+    } else if(packet.type == PACKET_NACK) {
+      for(size_t i = 0; i + sizeof(nackRange) <= payloadLen; i += sizeof(nackRange)) {
+        nackRange range;
+        memcpy(&range, payload + i, sizeof(range));
+        senderRetransmit(tx, d, &peer, peerLength, &range);
+      }
+    }
+  }
+}
+
+static inline void senderReceive(sender *tx) {
+  for(int i = 0; i < tx->destinationCount; ++i) senderReceiveFrom(tx, &tx->destinations[i]);
+}
+
+static inline void senderReportDestinations(const sender *tx) {
+  for(int i = 0; i < tx->destinationCount; ++i) {
+    const senderDestination *d = &tx->destinations[i];
+    fprintf(stderr, "%s: %llu packets sent, %llu failed, %d bytes backlog, at most %d\n", d->name,
+        (unsigned long long)d->packets, (unsigned long long)d->failures, d->backlog, d->maxBacklog);
+  }
+}
+
+// skips len bytes of stream positions, e.g. for holes in the capture
+static inline void senderSkip(sender *tx, size_t len) {
+  if(tx->suppressing) {
+    // receivers play the announced silence over it anyway
+    tx->silencePending += len;
+    return;
+  }
+
+  senderFlushPending(tx);
+  if(tx->fec.data) senderQueueParity(tx, tx->lastTime);
+  tx->position += len;
+}
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef H_10C68928_E83D_4DEB_B008_EF5B0452018A
+#define H_10C68928_E83D_4DEB_B008_EF5B0452018A
+
+#include "format.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SILENCE_HANGOVER 0.2   // in s of quiet audio still sent before suppression starts
+#define SILENCE_KEEPALIVE 0.25 // in s of suppressed audio between PACKET_SILENCE markers
+#define SILENCE_HOLD 1.0       // in s, how long receivers play silence past the latest marker
+#define SILENCE_BLOCK 256      // bytes scanned between early exits
+
+// Detection of captured audio not worth sending, for discontinuous
+// transmission. The loops are plain enough for the compiler to vectorise,
+// and they stop at the first block with a loud sample, which is what
+// almost every fragment of music has.
+
+// every byte zero, i.e. digital silence in all formats
+static inline int silenceAllZero(const char *data, size_t len) {
+  size_t i = 0;
+
+  while(i + SILENCE_BLOCK <= len) {
+    uint64_t any = 0;
+    for(size_t j = 0; j < SILENCE_BLOCK; j += sizeof(any)) {
+      uint64_t word;
+      memcpy(&word, data + i + j, sizeof(word));
+      any |= word;
+    }
+    if(any) return 0;
+    i += SILENCE_BLOCK;
+  }
+
+  unsigned char rest = 0;
+  for(; i < len; ++i) rest |= data[i];
+  return !rest;
+}
+
+static inline int silenceQuietS16(const char *data, size_t len, int32_t threshold) {
+  size_t samples = len / 2, i = 0;
+
+  while(i < samples) {
+    size_t end = i + SILENCE_BLOCK / 2 < samples? i + SILENCE_BLOCK / 2: samples;
+    int loud = 0;
+    for(; i < end; ++i) {
+      int16_t x;
+      memcpy(&x, data + 2 * i, sizeof(x));
+      loud |= x > threshold || x < -threshold;
+    }
+    if(loud) return 0;
+  }
+
+  return 1;
+}
+
+static inline int silenceQuietFloat(const char *data, size_t len, float threshold) {
+  size_t samples = len / 4, i = 0;
+
+  while(i < samples) {
+    size_t end = i + SILENCE_BLOCK / 4 < samples? i + SILENCE_BLOCK / 4: samples;
+    int loud = 0;
+    for(; i < end; ++i) {
+      float x;
+      memcpy(&x, data + 4 * i, sizeof(x));
+      loud |= fabsf(x) > threshold;
+    }
+    if(loud) return 0;
+  }
+
+  return 1;
+}
+
+// whether no sample of len bytes exceeds threshold in magnitude, in the
+// format's scale; a threshold of 0 looks for digital silence
+static inline int silenceQuiet(int format, const char *data, size_t len, float threshold) {
+  if(threshold <= 0) return silenceAllZero(data, len);
+
+  switch(format) {
+    case SAMPLE_S16LE:
+      return silenceQuietS16(data, len, threshold);
+    case SAMPLE_FLOAT32LE:
+      return silenceQuietFloat(data, len, threshold);
+    default:
+      for(size_t i = 0; i + 3 <= len; i += 3) {
+        if(fabsf(loadSample(format, data + i)) > threshold) return 0;
+      }
+      return 1;
+  }
+}
+
+// parses a level in dBFS below which audio is suppressed, e.g. "-70", or
+// "zero" for digital silence only; returns the threshold in the format's scale
+static inline int parseSilenceLevel(const char *spec, int format, float *threshold) {
+  if(!strcmp(spec, "zero")) {
+    *threshold = 0;
+    return 0;
+  }
+
+  double level = atof(spec);
+  if(level >= 0 || level < -140) {
+    fprintf(stderr, "Invalid silence level %s, expected a negative dBFS value such as -70, or zero.\n", spec);
+    return -1;
+  }
+
+  *threshold = sampleScale(format) * pow(10, level / 20);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,134 @@
+#include "common.h"
+
+#define __USE_POSIX2 1
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Compares when several receivers of one stream were heard, from the onset
+// logs null-receiver -e writes while the sender gates its tone: every onset
+// of the first log is matched with the nearest one of each other log, the
+// distance between them is the skew between the two rooms at that moment.
+
+#define SKEW_MAX_LOGS 16
+
+struct onsetLog_t {
+  const char *path;
+  uint64_t *times; // local ns, ascending
+  size_t count;
+};
+
+typedef struct onsetLog_t onsetLog;
+
+int readLog(onsetLog *log, const char *path) {
+  FILE *file = fopen(path, "r");
+  if(!file) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  size_t size = 256;
+  log->path = path;
+  log->times = malloc(size * sizeof(*log->times));
+  log->count = 0;
+
+  unsigned long long time;
+  while(log->times && fscanf(file, "%llu", &time) == 1) {
+    if(log->count == size) {
+      uint64_t *grown = realloc(log->times, 2 * size * sizeof(*log->times));
+      if(!grown) free(log->times);
+      log->times = grown;
+      size *= 2;
+      if(!grown) break;
+    }
+    log->times[log->count++] = time;
+  }
+
+  fclose(file);
+  if(!log->times) {
+    fprintf(stderr, "Failed to allocate onset buffer.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+int compareSkew(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+  double window = 0.25; // in s, onsets further apart are not the same one
+  double limit = 0;     // in ms, fail if any skew is larger
+  int opt;
+
+  while((opt = getopt(argc, argv, "w:l:")) != -1) {
+    switch(opt) {
+      case 'w': window = atof(optarg); break;
+      case 'l': limit = atof(optarg); break;
+      default:
+        fprintf(stderr, "Usage: ./skew-meter [-w seconds] [-l ms] reference log...\n");
+        fprintf(stderr, "  -w  largest distance between matching onsets, default 0.25\n");
+        fprintf(stderr, "  -l  exit with an error if any skew exceeds this many ms\n");
+        return 1;
+    }
+  }
+
+  int logs = argc - optind;
+  if(logs < 2 || logs > SKEW_MAX_LOGS || window <= 0) {
+    fprintf(stderr, "Usage: ./skew-meter [-w seconds] [-l ms] reference log...\n");
+    return 1;
+  }
+
+  onsetLog log[SKEW_MAX_LOGS];
+  for(int i = 0; i < logs; ++i) {
+    if(readLog(&log[i], argv[optind + i])) return 1;
+  }
+
+  const onsetLog *reference = &log[0];
+  double *skews = malloc((reference->count + 1) * sizeof(*skews));
+  if(!skews) {
+    fprintf(stderr, "Failed to allocate skew buffer.\n");
+    return 1;
+  }
+
+  int failed = 0;
+  for(int i = 1; i < logs; ++i) {
+    size_t matched = 0, j = 0;
+    double sum = 0;
+
+    for(size_t r = 0; r < reference->count && log[i].count; ++r) {
+      uint64_t t = reference->times[r];
+      while(j + 1 < log[i].count && log[i].times[j + 1] <= t) ++j;
+
+      // the nearest onset is the last one up to t, or the one after it
+      double skew = (int64_t)(log[i].times[j] - t) / 1000000.0;
+      if(j + 1 < log[i].count && (log[i].times[j + 1] - t) / 1000000.0 < (skew < 0? -skew: skew)) {
+        skew = (log[i].times[j + 1] - t) / 1000000.0;
+      }
+      if(skew > window * 1000 || skew < -window * 1000) continue;
+
+      skews[matched++] = skew;
+      sum += skew;
+    }
+
+    if(!matched) {
+      printf("%s: no onsets match %s\n", log[i].path, reference->path);
+      failed = 1;
+      continue;
+    }
+
+    qsort(skews, matched, sizeof(*skews), compareSkew);
+    double worst = -skews[0] > skews[matched - 1]? skews[0]: skews[matched - 1];
+    printf("%s: %zu onsets, skew to %s mean %+.3f ms, p50 %+.3f ms, from %+.3f to %+.3f ms\n", log[i].path, matched,
+        reference->path, sum / matched, skews[matched / 2], skews[0], skews[matched - 1]);
+
+    if(limit > 0 && (worst > limit || worst < -limit)) failed = 1;
+  }
+
+  return failed;
+}
@@ -0,0 +1,68 @@
+#ifndef H_2D9C61F4_7B0E_4A35_8E1C_5F3A90B2D6E7
+#define H_2D9C61F4_7B0E_4A35_8E1C_5F3A90B2D6E7
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+// Lock-free single-producer/single-consumer queue of fixed-size slots.
+//
+// All memory is allocated up front, so neither side ever allocates, locks
+// or makes a syscall. The producer fills the slot returned by spscWriteSlot
+// in place and publishes it with spscPush, the consumer reads the slot
+// returned by spscReadSlot and releases it with spscPop. head and tail only
+// ever grow, their difference is the fill level.
+struct spscQueue_t {
+  char *slots;
+  size_t slotSize;
+  size_t capacity; // a power of two
+
+  _Alignas(64) atomic_size_t head; // next slot to be written, owned by the producer
+  _Alignas(64) atomic_size_t tail; // next slot to be read, owned by the consumer
+};
+
+typedef struct spscQueue_t spscQueue;
+
+static inline int spscInit(spscQueue *q, size_t slotSize, size_t minimumCapacity) {
+  size_t capacity = 1;
+  while(capacity < minimumCapacity) capacity *= 2;
+
+  q->slots = calloc(capacity, slotSize);
+  if(!q->slots) return -1;
+
+  q->slotSize = slotSize;
+  q->capacity = capacity;
+  atomic_init(&q->head, 0);
+  atomic_init(&q->tail, 0);
+  return 0;
+}
+
+// producer side, NULL if the queue is full
+static inline void *spscWriteSlot(spscQueue *q) {
+  size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+  if(head - tail == q->capacity) return NULL;
+
+  return q->slots + (head & (q->capacity - 1)) * q->slotSize;
+}
+
+static inline void spscPush(spscQueue *q) {
+  size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  atomic_store_explicit(&q->head, head + 1, memory_order_release);
+}
+
+// consumer side, NULL if the queue is empty
+static inline void *spscReadSlot(spscQueue *q) {
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+  if(head == tail) return NULL;
+
+  return q->slots + (tail & (q->capacity - 1)) * q->slotSize;
+}
+
+static inline void spscPop(spscQueue *q) {
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+}
+
+#endif
@@ -0,0 +1,218 @@
+#include "common.h"
+
+#define __USE_BSD 1
+#define __USE_POSIX199309 1
+#define __USE_MISC 1
+#define __USE_POSIX2 1
+#define __USE_XOPEN2K 1
+#define __USE_XOPEN_EXTENDED 1
+#define __USE_XOPEN2K8 1
+#define __USE_GNU 1
+
+#include <stdio.h>
+#include <time.h>
+#include <math.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <stdlib.h>
+
+#include "format.h"
+#include "pilot.h"
+#include "sender.h"
+#include "transport.h"
+
+// Sender without a sound server: captures a sine tone from a clock which can
+// be made to run fast or slow, for benchmarks and tests.
+
+sender tx;
+audioFormat format;
+pilot latencyPilot;
+
+double periodTime = 0.01; // in s
+double skew = 0;          // capture clock deviation, in ppm
+double phase = 0;
+double gate = 0;          // in s, the tone alternates with digital silence this often
+uint64_t synthesized = 0; // frames
+
+uint64_t monotonicNow() {
+  struct timespec t;
+  if(clock_gettime(CLOCK_MONOTONIC, &t)) {
+    fprintf(stderr, "Failed to get current time: %s\n", strerror(errno));
+  }
+
+  return (uint64_t)(t.tv_sec) * 1000000000 + t.tv_nsec;
+}
+
+// a 440 Hz tone at half scale on every channel
+void synthesize(char *out, size_t frames) {
+  size_t bytes = sampleBytes(format.format);
+  float scale = sampleScale(format.format) / 2;
+
+  for(size_t i = 0; i < frames; ++i) {
+    int on = !gate || (uint64_t)(synthesized++ / (gate * format.rate)) % 2 == 0;
+    float x = on? scale * sin(phase): 0;
+    phase += 2 * M_PI * 440 / format.rate;
+    if(phase > 2 * M_PI) phase -= 2 * M_PI;
+
+    for(int c = 0; c < format.channels; ++c) {
+      storeSample(format.format, out, x);
+      out += bytes;
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  char *destinations[SENDER_MAX_DESTINATIONS];
+  int destinationCount = 0;
+  double seconds = 0;
+  int fecData = 0, fecParities = 1;
+  double historyTime = 0.5;
+  int pilotEnabled = 0;
+  double pilotLevel = 0;
+  int codecEnabled = 0;
+  char *silenceLevel = NULL;
+  float silenceThreshold = 0;
+  int streamId = 0;
+  int opt;
+
+  format = defaultFormat;
+
+  while((opt = getopt(argc, argv, "u:f:F:R:P:CZ:i:G:p:k:s:")) != -1) {
+    switch(opt) {
+      case 'u':
+        if(destinationCount == SENDER_MAX_DESTINATIONS) {
+          fprintf(stderr, "At most %d destinations are supported.\n", SENDER_MAX_DESTINATIONS);
+          return 1;
+        }
+        destinations[destinationCount++] = optarg;
+        break;
+      case 'f':
+        if(parseFormat(optarg, &format)) return 1;
+        break;
+      case 'F':
+        fecData = atoi(optarg);
+        if(strchr(optarg, ':')) fecParities = atoi(strchr(optarg, ':') + 1);
+        if(fecData < 1 || fecData > FEC_MAX_DATA || fecParities < 1 || fecParities > FEC_MAX_PARITY) {
+          fprintf(stderr, "Invalid FEC spec, use 1 to %d packets and 1 to %d parities per group.\n", FEC_MAX_DATA, FEC_MAX_PARITY);
+          return 1;
+        }
+        break;
+      case 'R': historyTime = atof(optarg) / 1000; break;
+      case 'P':
+        if(parsePilotLevel(optarg, &pilotLevel)) return 1;
+        pilotEnabled = 1;
+        break;
+      case 'C': codecEnabled = 1; break;
+      case 'Z': silenceLevel = optarg; break;
+      case 'i': streamId = atoi(optarg); break;
+      case 'G': gate = atof(optarg); break;
+      case 'p': periodTime = atof(optarg) / 1000; break;
+      case 'k': skew = atof(optarg); break;
+      case 's': seconds = atof(optarg); break;
+      default:
+        fprintf(stderr, "Usage: ./synth-sender [-u host:port] [-f format] [-F data:parities] [-R ms] [-P dBFS] [-C] [-Z dBFS] [-i id] [-G seconds] [-p ms] [-k ppm] [-s seconds]\n");
+        fprintf(stderr, "  -u  send UDP datagrams to host:port instead of writing to stdout, repeat it\n");
+        fprintf(stderr, "      for more receivers; multicast groups are sent to through one socket\n");
+        fprintf(stderr, "  -f  capture format[:channels[:rate]], format one of s16le, s24le, float32le\n");
+        fprintf(stderr, "  -F  send parities parity packets per data audio packets, e.g. 8:2 for 25%% overhead\n");
+        fprintf(stderr, "  -R  keep this much audio for answering NACKs over UDP, default 500, 0 to disable\n");
+        fprintf(stderr, "  -P  mix a pseudo-noise pilot at this level into the audio, e.g. -55\n");
+        fprintf(stderr, "  -C  compress the audio losslessly, for s16le and s24le\n");
+        fprintf(stderr, "  -Z  stop sending audio which stays at or below this level, e.g. -70, or zero\n");
+        fprintf(stderr, "  -i  stream ID, for per-stream gains in mixing receivers, default 0\n");
+        fprintf(stderr, "  -G  switch the tone off and on again every this many seconds\n");
+        fprintf(stderr, "  -p  capture period in ms, default 10\n");
+        fprintf(stderr, "  -k  run the capture clock this many ppm fast, or slow if negative\n");
+        fprintf(stderr, "  -s  stop after this many seconds of audio, default never\n");
+        return 1;
+    }
+  }
+
+  if(argc - optind != 0 || periodTime <= 0 || gate < 0 || streamId < 0 || streamId > 65535) {
+    fprintf(stderr, "Usage: ./synth-sender [-u host:port] [-f format] [-F data:parities] [-R ms] [-P dBFS] [-C] [-Z dBFS] [-i id] [-G seconds] [-p ms] [-k ppm] [-s seconds]\n");
+    return 1;
+  }
+
+  if(silenceLevel && parseSilenceLevel(silenceLevel, format.format, &silenceThreshold)) return 1;
+
+  if(codecEnabled && (fecData || format.format == SAMPLE_FLOAT32LE)) {
+    fprintf(stderr, "Compression needs no parity packets and an integer sample format.\n");
+    return 1;
+  }
+
+  senderInit(&tx, destinationCount? -1: 1, destinationCount != 0, &format);
+  tx.stream.stream = streamId;
+  for(int i = 0; i < destinationCount; ++i) {
+    struct sockaddr_storage group;
+    socklen_t groupLength;
+    int fd = udpOpenGroup(destinations[i], 0, &group, &groupLength);
+    if(fd < 0 || senderAddDestination(&tx, fd, destinations[i], &group, groupLength)) return 1;
+  }
+
+  if(codecEnabled) senderSetCodec(&tx);
+  if(silenceLevel) senderSetSilence(&tx, silenceThreshold);
+  if(fecData) senderSetFec(&tx, fecData, fecParities);
+  if(destinationCount && historyTime > 0 && senderSetHistory(&tx, bytesPerSecond(&format) * historyTime)) {
+    fprintf(stderr, "Failed to allocate retransmission history.\n");
+    return 1;
+  }
+
+  size_t periodFrames = format.rate * periodTime;
+  if(!periodFrames) periodFrames = 1;
+  size_t periodBytes = periodFrames * frameBytes(&format);
+  char *period = malloc(periodBytes);
+  if(!period) {
+    fprintf(stderr, "Failed to allocate period buffer.\n");
+    return 1;
+  }
+
+  if(pilotEnabled) pilotInit(&latencyPilot, pilotLevel, &format);
+
+  double periodNs = periodFrames * 1e9 / format.rate / (1 + skew / 1000000);
+  uint64_t start = monotonicNow();
+  uint64_t periods = 0;
+
+  struct pollfd backChannels[SENDER_MAX_DESTINATIONS];
+  for(int i = 0; i < destinationCount; ++i) {
+    backChannels[i].fd = tx.destinations[i].fd;
+    backChannels[i].events = POLLIN;
+  }
+
+  while(!seconds || periods * periodTime < seconds) {
+    uint64_t due = start + periods * periodNs;
+    uint64_t now = monotonicNow();
+
+    if(now >= due) {
+      uint64_t time = realtimeNow();
+      synthesize(period, periodFrames);
+      if(pilotEnabled) pilotMix(&latencyPilot, &format, period, periodBytes, time);
+      senderSend(&tx, period, periodBytes, time);
+      senderFlush(&tx);
+      if(tx.broken) return 1;
+      ++periods;
+      continue;
+    }
+
+    if(!destinationCount) {
+      struct timespec wait = { (due - now) / 1000000000, (due - now) % 1000000000 };
+      nanosleep(&wait, NULL);
+      continue;
+    }
+
+    // receivers ask for our clock and for retransmissions over the same socket
+    if(poll(backChannels, destinationCount, (due - now + 999999) / 1000000) < 0 && errno != EINTR) {
+      fprintf(stderr, "Could not wait for events: %s\n", strerror(errno));
+      return 1;
+    }
+    for(int i = 0; i < destinationCount; ++i) {
+      if(backChannels[i].revents) senderReceiveFrom(&tx, &tx.destinations[i]);
+    }
+  }
+
+  if(destinationCount) senderReportDestinations(&tx);
+
+  return 0;
+}
@@ -0,0 +1,313 @@
+#include "common.h"
+
+#define __USE_BSD 1
+#define __USE_POSIX199309 1
+#define __USE_MISC 1
+#define __USE_POSIX2 1
+#define __USE_XOPEN2K 1
+
+#include <stdio.h>
+#include <time.h>
+#include <math.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#include "clocksync.h"
+#include "losssim.h"
+#include "trace.h"
+#include "transport.h"
+
+// Feeds a trace recorded with a receiver's -T option back into a receiver,
+// on the original schedule or faster, with added delay, jitter, loss,
+// duplication and reordering. Timestamps are moved to the replay's clock,
+// so the receiver sees the capture to arrival delays of the recording plus
+// the impairments. Random choices come from a seeded generator, the same
+// trace and options always produce the same packet sequence.
+
+struct pendingPacket_t {
+  uint64_t due;      // realtime nanoseconds
+  uint64_t sequence; // ties go in trace order
+  uint32_t length;
+  char data[sizeof(dataPacket)];
+};
+
+typedef struct pendingPacket_t pendingPacket;
+
+double speed = 1;
+double delay = 0;        // in s, added to every packet
+double jitter = 0;       // in s, mean of an exponentially distributed extra delay
+double reorderRate = 0;  // fraction of packets held back
+double reorderHold = 0.005; // in s
+double duplicateRate = 0;
+lossSimulator loss;
+
+uint64_t traceStart;  // arrival time of the first packet in the trace
+uint64_t replayStart; // realtime at which it is replayed
+
+pendingPacket **pending; // binary min-heap by due time
+size_t pendingCount;
+size_t pendingSize;
+uint64_t sequence;
+
+uint64_t sent, skipped, duplicated, reordered;
+
+static int earlier(const pendingPacket *a, const pendingPacket *b) {
+  return a->due < b->due || (a->due == b->due && a->sequence < b->sequence);
+}
+
+int pendingPush(pendingPacket *p) {
+  if(pendingCount == pendingSize) {
+    size_t size = pendingSize? 2 * pendingSize: 256;
+    pendingPacket **grown = realloc(pending, size * sizeof(*pending));
+    if(!grown) {
+      fprintf(stderr, "Failed to allocate replay queue.\n");
+      return -1;
+    }
+    pending = grown;
+    pendingSize = size;
+  }
+
+  size_t i = pendingCount++;
+  while(i && earlier(p, pending[(i - 1) / 2])) {
+    pending[i] = pending[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  pending[i] = p;
+  return 0;
+}
+
+pendingPacket *pendingPop() {
+  pendingPacket *top = pending[0];
+  pendingPacket *last = pending[--pendingCount];
+
+  size_t i = 0;
+  while(1) {
+    size_t child = 2 * i + 1;
+    if(child >= pendingCount) break;
+    if(child + 1 < pendingCount && earlier(pending[child + 1], pending[child])) ++child;
+    if(!earlier(pending[child], last)) break;
+
+    pending[i] = pending[child];
+    i = child;
+  }
+  if(pendingCount) pending[i] = last;
+
+  return top;
+}
+
+// a sender clock timestamp of the trace on the replay's clock
+uint64_t mapTime(uint64_t time, int64_t offset) {
+  int64_t sinceStart = (int64_t)(time - offset - traceStart);
+  return replayStart + (int64_t)(sinceStart / speed);
+}
+
+// moves the packet's timestamps to the replay's clock, returns -1 for
+// packets which only made sense to the original receiver
+int retime(char *packet, size_t len, uint64_t arrival, int64_t offset) {
+  if(len < sizeof(packetHeader)) return -1;
+
+  if(!packet[3]) {
+    dataPacketHeader header;
+    if(len < sizeof(header)) return -1;
+
+    memcpy(&header, packet, sizeof(header));
+    header.time = mapTime(header.time, offset);
+    memcpy(packet, &header, sizeof(header));
+    return 0;
+  }
+
+  packetHeader header;
+  memcpy(&header, packet, sizeof(header));
+  char *payload = packet + sizeof(header);
+  size_t payloadLen = len - sizeof(header);
+
+  switch(header.type) {
+    case PACKET_STREAM_HEADER: {
+      streamHeader stream;
+      if(payloadLen < sizeof(stream)) return -1;
+
+      memcpy(&stream, payload, sizeof(stream));
+      stream.time = mapTime(stream.time, offset);
+      memcpy(payload, &stream, sizeof(stream));
+      return 0;
+    }
+    case PACKET_AUDIO:
+    case PACKET_CODED:
+    case PACKET_SILENCE:
+    case PACKET_PARITY: {
+      // only the low bits are sent, the capture was shortly before arrival
+      uint64_t time = unwrap32((arrival + offset) / 1000, header.time) * 1000;
+      header.time = mapTime(time, offset) / 1000;
+      memcpy(packet, &header, sizeof(header));
+      return 0;
+    }
+    case PACKET_RETRANSMIT: {
+      retransmitHeader retransmit;
+      if(payloadLen < sizeof(retransmit)) return -1;
+
+      memcpy(&retransmit, payload, sizeof(retransmit));
+      retransmit.time = mapTime(retransmit.time, offset);
+      memcpy(payload, &retransmit, sizeof(retransmit));
+      return 0;
+    }
+    default:
+      // clock sync answers and back channel traffic
+      return -1;
+  }
+}
+
+// queues a trace packet with its impairments applied
+int impair(const traceRecord *record, const char *packet) {
+  if(lossDrop(&loss)) return 0;
+
+  double extra = delay;
+  if(jitter > 0) {
+    double e = -jitter * log(1 - lossRandom(&loss));
+    extra += e < 20 * jitter? e: 20 * jitter;
+  }
+  if(reorderRate > 0 && lossRandom(&loss) < reorderRate) {
+    extra += reorderHold;
+    ++reordered;
+  }
+
+  int copies = 1;
+  if(duplicateRate > 0 && lossRandom(&loss) < duplicateRate) {
+    copies = 2;
+    ++duplicated;
+  }
+
+  for(int i = 0; i < copies; ++i) {
+    pendingPacket *p = malloc(sizeof(*p));
+    if(!p) {
+      fprintf(stderr, "Failed to allocate replay queue.\n");
+      return -1;
+    }
+
+    p->due = replayStart + (int64_t)((record->arrival - traceStart + extra * 1000000000) / speed);
+    p->sequence = sequence++;
+    p->length = record->length;
+    memcpy(p->data, packet, record->length);
+    if(retime(p->data, p->length, record->arrival, record->offset)) {
+      free(p);
+      ++skipped;
+      return 0;
+    }
+
+    if(pendingPush(p)) return -1;
+  }
+
+  return 0;
+}
+
+int sendPacket(int fd, const pendingPacket *p, int datagrams) {
+  uint64_t now = realtimeNow();
+  if(p->due > now) {
+    struct timespec wait = { (p->due - now) / 1000000000, (p->due - now) % 1000000000 };
+    while(nanosleep(&wait, &wait) && errno == EINTR);
+  }
+
+  size_t done = 0;
+  while(done < p->length) {
+    ssize_t len = write(fd, p->data + done, p->length - done);
+    if(len < 0) {
+      if(errno == EINTR) continue;
+      // nobody listening yet, the packet is lost like on a real network
+      if(datagrams && errno == ECONNREFUSED) return 0;
+
+      fprintf(stderr, "Failed to send packet: %s\n", strerror(errno));
+      return -1;
+    }
+    done += len;
+  }
+
+  ++sent;
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  char *destination = NULL;
+  int opt;
+
+  lossInit(&loss);
+
+  while((opt = getopt(argc, argv, "u:x:d:j:l:D:r:S:")) != -1) {
+    switch(opt) {
+      case 'u': destination = optarg; break;
+      case 'x': speed = atof(optarg); break;
+      case 'd': delay = atof(optarg) / 1000; break;
+      case 'j': jitter = atof(optarg) / 1000; break;
+      case 'l':
+        if(lossParse(&loss, optarg)) return 1;
+        break;
+      case 'D': duplicateRate = atof(optarg) / 100; break;
+      case 'r':
+        reorderRate = atof(optarg) / 100;
+        if(strchr(optarg, ':')) reorderHold = atof(strchr(optarg, ':') + 1) / 1000;
+        break;
+      case 'S':
+        loss.random = strtoull(optarg, NULL, 0);
+        if(!loss.random) loss.random = 1;
+        break;
+      default:
+        fprintf(stderr, "Usage: ./trace-replay [-u host:port] [-x speed] [-d ms] [-j ms] [-l loss] [-D percent] [-r percent[:ms]] [-S seed] trace\n");
+        fprintf(stderr, "  -u  send UDP datagrams to host:port instead of writing to stdout\n");
+        fprintf(stderr, "  -x  replay this many times faster than recorded, timestamps are compressed to match;\n");
+        fprintf(stderr, "      for throughput runs, playout only keeps up at 1\n");
+        fprintf(stderr, "  -d  delay every packet by this many ms\n");
+        fprintf(stderr, "  -j  delay packets by an exponentially distributed extra with this mean, in ms\n");
+        fprintf(stderr, "  -l  drop percent[:mean burst length] of the packets\n");
+        fprintf(stderr, "  -D  send this percentage of packets twice\n");
+        fprintf(stderr, "  -r  hold back this percentage of packets by ms, default 5, so later ones overtake them\n");
+        fprintf(stderr, "  -S  seed for the random impairments\n");
+        return 1;
+    }
+  }
+
+  if(argc - optind != 1 || speed <= 0 || delay < 0 || jitter < 0 || reorderHold < 0 ||
+      duplicateRate < 0 || duplicateRate > 1 || reorderRate < 0 || reorderRate > 1) {
+    fprintf(stderr, "Usage: ./trace-replay [-u host:port] [-x speed] [-d ms] [-j ms] [-l loss] [-D percent] [-r percent[:ms]] [-S seed] trace\n");
+    return 1;
+  }
+
+  FILE *trace = traceOpen(argv[optind]);
+  if(!trace) return 1;
+
+  int outputFd = 1;
+  if(destination) {
+    outputFd = udpOpen(destination, 0);
+    if(outputFd < 0) return 1;
+  }
+
+  traceRecord next;
+  char packet[sizeof(dataPacket)];
+  int status = traceRead(trace, &next, packet);
+  if(status < 0) return 1;
+
+  traceStart = next.arrival;
+  replayStart = realtimeNow();
+
+  // every packet is due no earlier than its arrival in the trace, so the
+  // earliest pending one can go once the next unread one is due after it
+  while(status > 0 || pendingCount) {
+    if(pendingCount && (status <= 0 || pending[0]->due <= replayStart + (int64_t)((next.arrival - traceStart) / speed))) {
+      pendingPacket *p = pendingPop();
+      int failed = sendPacket(outputFd, p, destination != NULL);
+      free(p);
+      if(failed) return 1;
+      continue;
+    }
+
+    if(impair(&next, packet)) return 1;
+    status = traceRead(trace, &next, packet);
+    if(status < 0) return 1;
+  }
+
+  fprintf(stderr, "Replayed %llu packets, %llu dropped, %llu duplicated, %llu held back, %llu clock sync or back channel packets skipped\n",
+      (unsigned long long)sent, (unsigned long long)loss.dropped, (unsigned long long)duplicated,
+      (unsigned long long)reordered, (unsigned long long)skipped);
+
+  return 0;
+}
@@ -0,0 +1,131 @@
+#ifndef H_7E0C5A41_3B9D_4F62_A8E1_52D6C07B9F34
+#define H_7E0C5A41_3B9D_4F62_A8E1_52D6C07B9F34
+
+#include "common.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define TRACE_MAGIC 0x32525450 // "PTR2", changes with the layout or wire format
+#define TRACE_FLUSH_INTERVAL 1000000000 // in ns of arrival time
+
+// Packet trace: everything a receiver got, as it was on the wire, with the
+// local time of arrival. trace-replay feeds it back with impairments.
+//
+// The file is a traceFileHeader followed by a traceRecord and the packet
+// bytes for every packet, in native byte order like the wire format.
+struct traceFileHeader_t {
+  uint32_t magic;
+  uint32_t reserved;
+};
+
+typedef struct traceFileHeader_t traceFileHeader;
+
+struct traceRecord_t {
+  uint64_t arrival; // nanoseconds since the epoch, receiver clock
+  int64_t offset;   // sender minus receiver clock in ns at arrival, 0 without clock sync
+  uint32_t length;  // of the packet which follows
+  uint32_t reserved;
+};
+
+typedef struct traceRecord_t traceRecord;
+
+struct traceWriter_t {
+  FILE *file; // NULL when not recording
+  uint64_t flushedAt;
+  uint64_t records;
+};
+
+typedef struct traceWriter_t traceWriter;
+
+static inline void traceInit(traceWriter *trace) {
+  trace->file = NULL;
+  trace->flushedAt = 0;
+  trace->records = 0;
+}
+
+static inline int traceCreate(traceWriter *trace, const char *path) {
+  trace->file = fopen(path, "wb");
+  if(!trace->file) {
+    fprintf(stderr, "Failed to create trace %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  traceFileHeader header = { TRACE_MAGIC, 0 };
+  if(fwrite(&header, sizeof(header), 1, trace->file) != 1) {
+    fprintf(stderr, "Failed to write trace %s: %s\n", path, strerror(errno));
+    fclose(trace->file);
+    trace->file = NULL;
+    return -1;
+  }
+
+  return 0;
+}
+
+// buffered, so it costs a write syscall about once per second; recording
+// stops on the first error
+static inline void traceWrite(traceWriter *trace, uint64_t arrival, int64_t offset, const void *packet, size_t len) {
+  if(!trace->file) return;
+
+  traceRecord record;
+  memset(&record, 0, sizeof(record));
+  record.arrival = arrival;
+  record.offset = offset;
+  record.length = len;
+
+  int failed = fwrite(&record, sizeof(record), 1, trace->file) != 1 || fwrite(packet, len, 1, trace->file) != 1;
+  if(!failed && arrival - trace->flushedAt >= TRACE_FLUSH_INTERVAL) {
+    failed = fflush(trace->file) != 0;
+    trace->flushedAt = arrival;
+  }
+
+  if(failed) {
+    fprintf(stderr, "Failed to write trace, stopping: %s\n", strerror(errno));
+    fclose(trace->file);
+    trace->file = NULL;
+    return;
+  }
+
+  ++trace->records;
+}
+
+static inline void traceClose(traceWriter *trace) {
+  if(!trace->file) return;
+
+  if(fclose(trace->file)) fprintf(stderr, "Failed to finish trace: %s\n", strerror(errno));
+  trace->file = NULL;
+}
+
+static inline FILE *traceOpen(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if(!file) {
+    fprintf(stderr, "Failed to open trace %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+
+  traceFileHeader header;
+  if(fread(&header, sizeof(header), 1, file) != 1 || header.magic != TRACE_MAGIC) {
+    fprintf(stderr, "%s is not a packet trace of this version.\n", path);
+    fclose(file);
+    return NULL;
+  }
+
+  return file;
+}
+
+// reads the next record and its packet into a buffer of sizeof(dataPacket),
+// returns 1 on success, 0 at the end and -1 for a damaged trace
+static inline int traceRead(FILE *file, traceRecord *record, char *packet) {
+  if(fread(record, sizeof(*record), 1, file) != 1) return ferror(file)? -1: 0;
+
+  if(record->length > sizeof(dataPacket) || fread(packet, record->length, 1, file) != 1) {
+    fprintf(stderr, "Trace ends in a damaged record.\n");
+    return -1;
+  }
+
+  return 1;
+}
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef H_3CA8C4DC_87B6_4F7D_B5EF_3D263378ECE7
+#define H_3CA8C4DC_87B6_4F7D_B5EF_3D263378ECE7
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// splits "host:port" (or just "port") into its parts, host may be NULL
+static inline int parseHostPort(const char *spec, char *host, size_t hostSize, const char **port) {
+  const char *colon = strrchr(spec, ':');
+  if(!colon) {
+    host[0] = '\0';
+    *port = spec;
+    return 0;
+  }
+
+  size_t len = colon - spec;
+  if(len >= hostSize) return -1;
+
+  memcpy(host, spec, len);
+  host[len] = '\0';
+  *port = colon + 1;
+  return 0;
+}
+
+static inline int udpMulticast(const struct sockaddr *address) {
+  if(address->sa_family == AF_INET) {
+    uint32_t ip = ntohl(((const struct sockaddr_in *)address)->sin_addr.s_addr);
+    return (ip & 0xf0000000) == 0xe0000000;
+  }
+  if(address->sa_family == AF_INET6) {
+    return ((const struct sockaddr_in6 *)address)->sin6_addr.s6_addr[0] == 0xff;
+  }
+  return 0;
+}
+
+// Binds to a multicast group's port on every local address, so unicast
+// answers to back channel requests get through as well, and joins the group
+// on the default interface. Several receivers on one host may share it,
+// though unicast answers then only reach one of them.
+static inline int udpJoin(int fd, const struct addrinfo *group) {
+  int on = 1;
+  if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on))) return -1;
+
+  struct sockaddr_storage any;
+  memset(&any, 0, sizeof(any));
+  if(group->ai_family == AF_INET) {
+    ((struct sockaddr_in *)&any)->sin_family = AF_INET;
+    ((struct sockaddr_in *)&any)->sin_port = ((const struct sockaddr_in *)group->ai_addr)->sin_port;
+  } else {
+    ((struct sockaddr_in6 *)&any)->sin6_family = AF_INET6;
+    ((struct sockaddr_in6 *)&any)->sin6_port = ((const struct sockaddr_in6 *)group->ai_addr)->sin6_port;
+  }
+  if(bind(fd, (struct sockaddr *)&any, group->ai_addrlen)) return -1;
+
+  if(group->ai_family == AF_INET) {
+    struct ip_mreq request;
+    request.imr_multiaddr = ((const struct sockaddr_in *)group->ai_addr)->sin_addr;
+    request.imr_interface.s_addr = htonl(INADDR_ANY);
+    return setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &request, sizeof(request));
+  }
+
+  struct ipv6_mreq request;
+  request.ipv6mr_multiaddr = ((const struct sockaddr_in6 *)group->ai_addr)->sin6_addr;
+  request.ipv6mr_interface = 0;
+  return setsockopt(fd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &request, sizeof(request));
+}
+
+// Creates a UDP socket for "host:port". Passive sockets are bound to it, or
+// join it if it is a multicast group. Active sockets are connected to it,
+// unless it is a multicast group and group is given: the group's receivers
+// answer from their own addresses, so the socket stays unconnected and the
+// group goes to *group for sendmsg. *groupLength is 0 for connected sockets.
+static inline int udpOpenGroup(const char *spec, int passive, struct sockaddr_storage *group, socklen_t *groupLength) {
+  char host[256];
+  const char *port;
+  if(parseHostPort(spec, host, sizeof(host), &port)) {
+    fprintf(stderr, "Invalid address: %s\n", spec);
+    return -1;
+  }
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = passive? AI_PASSIVE: 0;
+
+  struct addrinfo *addresses;
+  int err = getaddrinfo(host[0]? host: NULL, port, &hints, &addresses);
+  if(err) {
+    fprintf(stderr, "Could not resolve %s: %s\n", spec, gai_strerror(err));
+    return -1;
+  }
+
+  if(group) *groupLength = 0;
+
+  int fd = -1;
+  for(struct addrinfo *a = addresses; a; a = a->ai_next) {
+    fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if(fd < 0) continue;
+
+    int failed;
+    if(passive) {
+      failed = udpMulticast(a->ai_addr)? udpJoin(fd, a): bind(fd, a->ai_addr, a->ai_addrlen);
+    } else if(group && udpMulticast(a->ai_addr)) {
+      memcpy(group, a->ai_addr, a->ai_addrlen);
+      *groupLength = a->ai_addrlen;
+      failed = 0;
+    } else {
+      failed = connect(fd, a->ai_addr, a->ai_addrlen);
+    }
+    if(!failed) break;
+
+    close(fd);
+    fd = -1;
+  }
+
+  if(fd < 0) {
+    fprintf(stderr, "Could not open UDP socket for %s: %s\n", spec, strerror(errno));
+  }
+
+  freeaddrinfo(addresses);
+  return fd;
+}
+
+// creates a UDP socket for "host:port", bound to it if passive,
+// connected to it otherwise
+static inline int udpOpen(const char *spec, int passive) {
+  return udpOpenGroup(spec, passive, NULL, NULL);
+}
+
+#endif